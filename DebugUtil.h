@@ -20,7 +20,7 @@
  * 
  *     // Using manipulators
  *     Debug() << std::hex << 255;  // Outputs: ff
- *     Debug() << std::setw(4) << std::setfill('0') << 42;  // Outputs: 0042
+ *     Debug() << std::setw(4) << std::setfill(L'0') << 42;  // Outputs: 0042
  * 
  *     // Narrow string support
  *     Debug() << "Ascii string" << "Ascii string";
@@ -51,13 +51,20 @@
  * 
  * For other code pages, see: https://docs.microsoft.com/en-us/windows/win32/intl/code-page-identifiers
  * 
+ * Buffering:
+ * Each Debug() statement is collected in an internal buffer and written with a
+ * single OutputDebugStringW call when the statement ends, so a line is never split
+ * into fragments and lines from different threads are not interleaved. A stream
+ * constructed directly with DebugStream() flushes after every insertion instead;
+ * use DebugStream(false) and Flush() to control output manually.
+ * 
  * Features:
  * - Stream-style interface similar to std::cout
  * - Supports both narrow (UTF-8) and wide strings
  * - Handles all standard stream manipulators
  * - Automatic type conversion
  * - Zero overhead in release builds (all calls are removed)
- * - Thread-safe output
+ * - Thread-safe output (one OutputDebugStringW call per statement)
  * 
  * Note:
  * In release builds (when _DEBUG is not defined), all Debug() calls are compiled
@@ -66,293 +73,6669 @@
  */
 
 #pragma once
+// MSVC reports __cplusplus as 199711L unless /Zc:__cplusplus is set, so also check _MSVC_LANG
+#if __cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+#define DEBUG_HAS_CPP11 1
+#endif
 #include <Windows.h>
+#if defined(DEBUG_ENABLE_ETW)
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+#endif
 #include <string>
-#include <sstream>
+#include <ostream>
 #include <stdexcept>
 #include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <climits>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <iterator>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define DEBUG_HAS_STRING_VIEW 1
+#endif
+#if defined(DEBUG_HAS_STRING_VIEW) && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#if __has_include(<optional>)
+#include <optional>
+#define DEBUG_HAS_OPTIONAL 1
+#endif
+#endif
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define DEBUG_HAS_TO_CHARS 1
+#endif
+#if defined(DEBUG_HAS_CPP11)
+#include <tuple>
+#define DEBUG_HAS_VARIADIC_TEMPLATES 1
+#endif
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1600)
+#define DEBUG_HAS_LAMBDAS 1
+#endif
+#if defined(__cpp_constexpr) && __cpp_constexpr >= 201304L
+#define DEBUG_CONSTEXPR14 constexpr
+#else
+#define DEBUG_CONSTEXPR14 inline
+#endif
+#if defined(__cpp_consteval) && __cpp_consteval >= 201811L
+#define DEBUG_HAS_CONSTEVAL 1
+#endif
+#if defined(DEBUG_HAS_CPP11)
+#include <type_traits>
+#define DEBUG_HAS_STATIC_ASSERT 1
+#endif
 
 // Define the default code page for string conversion if not already defined
 #ifndef DEBUG_CODE_PAGE
 #define DEBUG_CODE_PAGE CP_UTF8
 #endif
 
+// Log levels, in increasing order of severity
+#define DEBUG_LEVEL_DEBUG 0
+#define DEBUG_LEVEL_INFO 1
+#define DEBUG_LEVEL_WARN 2
+#define DEBUG_LEVEL_ERROR 3
+#define DEBUG_LEVEL_NONE 4
+
+// Statements below this level are compiled out of debug builds, like all statements in release builds
+#ifndef DEBUG_MIN_LEVEL
+#define DEBUG_MIN_LEVEL DEBUG_LEVEL_DEBUG
+#endif
+
 #ifdef _DEBUG
-/**
- * @class DebugStream
- * @brief A class that provides a stream-like interface for writing debug output to the Visual Studio Output window.
- * 
- * DebugStream provides functionality similar to std::cout or std::cerr but outputs
- * to the Windows debug output stream using OutputDebugStringW. It supports both
- * narrow and wide strings, various manipulators, and automatic type conversion.
- */
-class DebugStream {
-private:
-    std::wostringstream buffer;         // Internal buffer for collecting output
-#if __cplusplus >= 201103L
-    const
+#define DEBUG_LEVEL_ENABLED(level) ((level) >= DEBUG_MIN_LEVEL)
+#else
+#define DEBUG_LEVEL_ENABLED(level) false
 #endif
-    bool autoFlush;                     // Flag controlling automatic flushing behavior
 
-    /**
-     * @brief Converts a narrow string to a wide string and outputs it to a buffer.
-     *
-     * This function takes a narrow string (default UTF-8 encoding), converts it to a wide string (USC-2),
-     * and then outputs the wide string to a buffer. If the input string is null, it throws
-     * an invalid_argument exception. If the conversion fails or the string is too long,
-     * it throws a runtime_error exception.
-     *
-     * @param str The narrow C style string to be converted and output.
-     * @throws std::invalid_argument If the input string is null.
-     * @throws std::runtime_error If the conversion fails or the string is too long.
-     * 
-     * @remark This function uses the DEBUG_CODE_PAGE macro to determine the code page for conversion,
-     * which defaults to CP_UTF8. You can define DEBUG_CODE_PAGE to a different code page if the debug
-     * output is not displayed correctly. See @link{https://docs.microsoft.com/en-us/windows/win32/intl/code-page-identifiers}
-     */
-    inline void ConvertAndOutput(const char* str) {
-        if (!str) {
-            throw std::invalid_argument("Null string pointer");
-        }
+// How often, in milliseconds, DebugLoggingAuto checks whether a debugger or DebugView is attached
+#ifndef DEBUG_AUTO_ENABLE_INTERVAL_MS
+#define DEBUG_AUTO_ENABLE_INTERVAL_MS 1000
+#endif
 
-        int length = MultiByteToWideChar(DEBUG_CODE_PAGE, 0, str, -1, nullptr, 0);
-        if (length <= 0) {
-            throw std::runtime_error("Failed to convert string to wide string.");
-        }
+// Number of characters a DebugStream can hold before it has to allocate from the heap
+#ifndef DEBUG_INLINE_BUFFER_SIZE
+#define DEBUG_INLINE_BUFFER_SIZE 512
+#endif
 
-        if (static_cast<SIZE_T>(length) > (SIZE_MAX / sizeof(WCHAR))) {
-            throw std::runtime_error("String too long");
-        }
+// Bytes of DebugStream::With() fields a DebugStream can hold before it has to allocate
+#ifndef DEBUG_INLINE_FIELD_SIZE
+#define DEBUG_INLINE_FIELD_SIZE 256
+#endif
 
-        std::wstring wstr(length, L'\0');
-        if (MultiByteToWideChar(DEBUG_CODE_PAGE, 0, str, -1, &wstr[0], length) == 0) {
-            throw std::runtime_error("Failed to convert string to wide string.");
-        }
+// Largest spill block, in characters, that a thread keeps for reuse after a long message
+#ifndef DEBUG_THREAD_CACHE_LIMIT
+#define DEBUG_THREAD_CACHE_LIMIT 65536
+#endif
 
-        buffer << wstr;
-        if (autoFlush) Flush();
-    }
+// Bytes of captured arguments each thread can queue for DebugDeferred(), rounded up to a power of two
+#ifndef DEBUG_DEFERRED_RING_SIZE
+#define DEBUG_DEFERRED_RING_SIZE 65536
+#endif
 
-public:
-    explicit DebugStream(bool autoFlushEnabled = true) : autoFlush(autoFlushEnabled) {}
+// Define DEBUG_NULL_OUTPUT to format everything but discard the result instead of calling
+// OutputDebugStringW, which isolates the cost of formatting from the cost of the debugger
 
-#if __cplusplus < 201103L
-    // Copy constructor and assignment operator for C++98
-    DebugStream(const DebugStream& other) : buffer(other.buffer.str()), autoFlush(other.autoFlush) {}
-    DebugStream& operator=(const DebugStream& other) {
-        if (this != &other) {
-            buffer.str(other.buffer.str());
-            buffer.clear();
-            autoFlush = other.autoFlush;
-        }
-        return *this;
-    }
-#else
-    // Delete copy constructor and assignment operator for C++11 and later
-    DebugStream(const DebugStream& other) = delete;
-    DebugStream& operator=(const DebugStream& other) = delete;
+// Accumulators per counter or histogram; threads are spread over them so they rarely share one
+#ifndef DEBUG_METRIC_SHARDS
+#define DEBUG_METRIC_SHARDS 16
 #endif
-    
-    ~DebugStream() {
-        Flush();
-    }
 
-    /**
-     * @brief Flushes the current contents of the buffer to the debug output.
-     *
-     * This function sends the current contents of the buffer to the debug output
-     * using OutputDebugStringW. After flushing, it clears the buffer for future use.
-     */
-    inline void Flush() {
-        OutputDebugStringW(buffer.str().c_str());
-        buffer.str(L"");
-        buffer.clear();
-    }
+// Longest piece, in characters, that the default sink passes to one OutputDebugStringW call.
+// DBWIN listeners such as DebugView receive at most 4096 bytes including the process ID and
+// the terminator, and double-byte code pages may need 2 bytes per character. 0 disables splitting
+#ifndef DEBUG_OUTPUT_CHUNK_SIZE
+#define DEBUG_OUTPUT_CHUNK_SIZE ((4096 - 4 - 1) / 2)
+#endif
 
-    /**
-     * @brief Overloaded insertion operator for DebugStream.
-     * 
-     * This template function allows any type T to be inserted into the DebugStream.
-     * The value is first inserted into the internal buffer. If autoFlush is enabled,
-     * the buffer is flushed immediately after the insertion.
-     * 
-     * @tparam T The type of the value to be inserted into the DebugStream.
-     * @param value The value to be inserted into the DebugStream.
-     * @return DebugStream& A reference to the current DebugStream object.
-     */
-    template<typename T>
-    inline DebugStream& operator<<(const T& value) {
-        buffer << value;
-        if (autoFlush) Flush();
-        return *this;
-    }
+// Characters a stream switched to Streaming() collects before it writes its completed lines
+#ifndef DEBUG_STREAM_WINDOW
+#define DEBUG_STREAM_WINDOW 65536
+#endif
 
-    // For endl and other basic_ostream manipulators
-    /**
-     * Overloaded operator<< for DebugStream to handle wide character stream manipulators.
-     *
-     * This function allows the use of standard wide character stream manipulators (such as std::endl)
-     * with the DebugStream class. It applies the manipulator to the internal buffer and flushes the
-     * buffer if autoFlush is enabled.
-     *
-     * @param manip A function pointer to a wide character stream manipulator.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(std::basic_ostream<wchar_t>& (*manip)(std::basic_ostream<wchar_t>&)) {
-        manip(buffer);
-        if (autoFlush) Flush();
-        return *this;
-    }
+// Rows written by DebugHex() and DebugDump() unless the call gives a limit; 0 means no limit
+#ifndef DEBUG_HEX_MAX_ROWS
+#define DEBUG_HEX_MAX_ROWS 256
+#endif
 
-    // For ios_base manipulators (hex, dec, etc)
-    /**
-     * Overloads the insertion operator to handle stream manipulators.
-     *
-     * This function allows the use of standard stream manipulators (such as std::endl)
-     * with the DebugStream class. It applies the manipulator to the internal buffer
-     * and flushes the buffer if autoFlush is enabled.
-     *
-     * @param manip A function pointer to a stream manipulator.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(std::ios_base& (*manip)(std::ios_base&)) {
-        manip(buffer);
-        if (autoFlush) Flush();
-        return *this;
-    }
+// Elements written of a container, array or DebugRange() unless the call gives a limit; 0 means no limit
+#ifndef DEBUG_RANGE_MAX_ELEMENTS
+#define DEBUG_RANGE_MAX_ELEMENTS 100
+#endif
 
-    // For basic_ios manipulators
-    /**
-     * Overloaded insertion operator for handling stream manipulators.
-     *
-     * This operator allows the use of stream manipulators (such as std::endl) with the DebugStream class.
-     *
-     * @param manip A function pointer to a stream manipulator that takes and returns a reference to a std::basic_ios<wchar_t> object.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(std::basic_ios<wchar_t>& (*manip)(std::basic_ios<wchar_t>&)) {
-        manip(buffer);
-        if (autoFlush) Flush();
-        return *this;
-    }
+// Error codes whose system message DebugLastError(), DebugError() and DebugHr() remember;
+// further codes call FormatMessageW every time they are written
+#ifndef DEBUG_ERROR_CACHE_SIZE
+#define DEBUG_ERROR_CACHE_SIZE 256
+#endif
 
-    // Specialized handling for C-style strings
-    /**
-     * @brief Overloaded insertion operator for DebugStream to handle C-style strings.
-     * 
-     * This operator allows you to use the insertion operator (<<) with C-style strings
-     * (const char*) to output them to the DebugStream. It converts the input string
-     * and outputs it using the ConvertAndOutput function.
-     * 
-     * @param value The C-style string to be output to the DebugStream.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(const char* value) {
-        ConvertAndOutput(value);
-        return *this;
-    }
+// Bytes of records a DebugSharedRingSink keeps for readers, rounded up to a power of two
+#ifndef DEBUG_SHARED_RING_SIZE
+#define DEBUG_SHARED_RING_SIZE (4 * 1024 * 1024)
+#endif
 
-    // Specialized handling for std::string
-    /**
-     * @brief Overloaded insertion operator for DebugStream to handle std::string.
-     * 
-     * This operator allows a DebugStream object to accept a std::string and 
-     * output its content by converting it to a C-style string and passing it 
-     * to the ConvertAndOutput function.
-     * 
-     * @param value The std::string to be output.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(const std::string& value) {
-        ConvertAndOutput(value.c_str());
-        return *this;
-    }
+// Milliseconds a DebugSharedRingReader waits for an incomplete record before it takes the
+// writing thread to have died. The wait does not count while the writer is being debugged
+#ifndef DEBUG_SHARED_RING_STALL_MS
+#define DEBUG_SHARED_RING_STALL_MS 30000
+#endif
 
-    // Direct wide string handling
-    /**
-     * @brief Overloaded insertion operator for wide character strings.
-     *
-     * This operator allows wide character strings (const wchar_t*) to be inserted
-     * into the DebugStream. If the value is not null, it appends the string to the
-     * internal buffer. If autoFlush is enabled, it will automatically flush the buffer.
-     *
-     * @param value The wide character string to be inserted into the DebugStream.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(const wchar_t* value) {
-        if (value) {
-            buffer << value;
-            if (autoFlush) Flush();
-        }
-        return *this;
-    }
+// Number of sinks that can be registered with DebugAddSink() at the same time
+#ifndef DEBUG_MAX_SINKS
+#define DEBUG_MAX_SINKS 8
+#endif
 
-    /**
-     * @brief Overloaded insertion operator for std::wstring.
-     *
-     * This operator allows you to insert a std::wstring into the DebugStream.
-     * The value is appended to the internal buffer. If autoFlush is enabled,
-     * the buffer is flushed immediately after the value is inserted.
-     *
-     * @param value The std::wstring to be inserted into the DebugStream.
-     * @return A reference to the current DebugStream object.
-     */
-    inline DebugStream& operator<<(const std::wstring& value) {
-        buffer << value;
-        if (autoFlush) Flush();
-        return *this;
-    }
+// Define DEBUG_ENABLE_ETW to make DebugEtwSink available (requires TraceLoggingProvider.h).
+// DEBUG_ETW_KEYWORD is the keyword attached to every event it writes
+#ifndef DEBUG_ETW_KEYWORD
+#define DEBUG_ETW_KEYWORD 0x1
+#endif
+
+// Vectorized code paths, unless disabled with DEBUG_DISABLE_SIMD
+#ifndef DEBUG_DISABLE_SIMD
+#if defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define DEBUG_HAS_SSE2 1
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define DEBUG_HAS_SSSE3 1
+#endif
+#if defined(__AVX2__)
+#define DEBUG_HAS_AVX2 1
+#endif
+#endif
+
+#if defined(DEBUG_HAS_SSE2)
+#include <immintrin.h>
+#endif
+
+/**
+ * @enum DebugOverflowPolicy
+ * @brief What the asynchronous output queue does with a message when it is full.
+ *
+ * @see DebugEnableAsync
+ */
+enum DebugOverflowPolicy {
+    DebugOverflowBlock,                 // Wait until the output thread frees a slot
+    DebugOverflowDropNewest,            // Discard the message being written
+    DebugOverflowDropOldest             // Discard the oldest queued message to make room
 };
 
 /**
- * @brief Creates a DebugStream object for logging debug messages.
+ * @enum DebugLoggingMode
+ * @brief Whether log statements produce output, switchable at run time.
  *
- * This function mimics the behavior of qDebug() in Qt which
- * returns a DebugStream object that can be used to log debug messages.
+ * @see DebugSetLoggingMode
+ */
+enum DebugLoggingMode {
+    DebugLoggingOn,                     // Format and write every statement (the default)
+    DebugLoggingOff,                    // Skip every statement
+    DebugLoggingAuto                    // Only format and write while a debugger or DebugView is attached
+};
+
+/**
+ * @enum DebugPrefix
+ * @brief Parts of the prefix written before every message; combine them with |.
  *
- * @return A DebugStream object for logging debug messages.
+ * @see DebugSetPrefix
  */
-inline DebugStream Debug() {
-    return DebugStream();
-}
+enum DebugPrefix {
+    DebugPrefixNone = 0,
+    DebugPrefixSequence = 1,            // #42: process-wide order in which messages were flushed
+    DebugPrefixTime = 2,                // 12.345678: seconds of QueryPerformanceCounter() time
+    DebugPrefixThread = 4,              // [1234]: id of the thread that flushed the message
+    DebugPrefixAll = 7
+};
 
-#else
+/**
+ * @struct DebugRecord
+ * @brief A finished log statement, as passed to a DebugSink.
+ */
+struct DebugRecord {
+    const wchar_t* text;                // Null-terminated message
+    size_t length;                      // Characters in text, excluding the terminator
+    int level;                          // DEBUG_LEVEL_* the statement was logged at
+    const wchar_t* format;              // Format string of a DebugDeferred() statement, otherwise null
+    const void* fields;                 // Fields attached with DebugStream::With(), or null; see DebugReadField()
+    size_t fieldsSize;                  // Bytes at fields
+    const void* arguments;              // Captured arguments of a DebugDeferred() statement, or null; see DebugReadArgument()
+    size_t argumentsSize;               // Bytes at arguments
+    unsigned int prefix;                // DebugPrefix parts at the start of text, or 0
+    DWORD threadId;                     // Thread that flushed the message, if prefix is set
+    LONG64 timestamp;                   // QueryPerformanceCounter() ticks, with DebugPrefixTime
+    LONG64 sequence;                    // Process-wide message number, with DebugPrefixSequence
+};
 
 /**
- * @class DebugStream
- * @brief A dummy class that provides a no-op stream-like interface in release builds.
- * 
- * DebugStream is a dummy class that provides a no-op stream-like interface in release builds.
+ * @enum DebugFieldType
+ * @brief Type of a value attached with DebugStream::With().
+ *
+ * The values are part of the binary field format and never change.
  */
-class DebugStream {
-public:
-    template<typename T>
-    DebugStream& operator<<(const T&) { return *this; }
+enum DebugFieldType {
+    DebugFieldBool, DebugFieldChar, DebugFieldWChar, DebugFieldSChar, DebugFieldUChar,
+    DebugFieldShort, DebugFieldUShort, DebugFieldInt, DebugFieldUInt, DebugFieldLong, DebugFieldULong,
+    DebugFieldLongLong, DebugFieldULongLong, DebugFieldFloat, DebugFieldDouble, DebugFieldLongDouble,
+    DebugFieldPointer, DebugFieldNarrowString, DebugFieldWideString
+};
 
-#if __cplusplus >= 201103L
-    // Delete copy constructor and assignment operator for C++11 and later for consistency
-    DebugStream(const DebugStream&) = delete;
-    DebugStream& operator=(const DebugStream&) = delete;
-#endif
+/**
+ * @struct DebugField
+ * @brief One field of a record, as decoded by DebugReadField().
+ */
+struct DebugField {
+    const wchar_t* key;                 // Not null-terminated
+    size_t keyLength;                   // Characters in key
+    int type;                           // DebugFieldType of the value
+    const void* value;                  // Bytes of the value, possibly unaligned
+    size_t size;                        // Bytes at value; for strings, the characters times their size
+};
 
-    // Support manipulators in release build too
-    DebugStream& operator<<(std::basic_ostream<wchar_t>& (*)(std::basic_ostream<wchar_t>&)) { return *this; }
-    DebugStream& operator<<(std::ios_base& (*)(std::ios_base&)) { return *this; }
-    DebugStream& operator<<(std::basic_ios<wchar_t>& (*)(std::basic_ios<wchar_t>&)) { return *this; }
+namespace DebugDetail {
 
-    void Flush() {}
-};
+// Reads the entry at offset: a type, a byte count and that many bytes, padded to 8 bytes
+inline bool ReadFieldEntry(const char* data, size_t size, size_t& offset, unsigned int& type, const char*& payload, unsigned int& bytes) {
+    unsigned int header[2];
+    if (!data || offset > size || size - offset < sizeof(header)) return false;
+    memcpy(header, data + offset, sizeof(header));
+    if (header[1] > size - offset - sizeof(header) || header[0] > DebugFieldWideString) return false;
+    type = header[0];
+    bytes = header[1];
+    payload = data + offset + sizeof(header);
+    offset = (offset + sizeof(header) + header[1] + 7) & ~static_cast<size_t>(7);
+    return true;
+}
+
+} // namespace DebugDetail
 
 /**
- * @brief Creates a dummy DebugStream object for logging debug messages in release builds.
+ * @brief Decodes the field at offset into DebugRecord::fields and advances offset past it.
  *
- * This function mimics the behavior of qDebug() in Qt which
- * returns a DebugStream object that can be used to log debug messages.
+ * Fields are stored as With() received them, without converting them to text. Each
+ * field is two entries: the key as a DebugFieldWideString, then the value. An entry is
+ * an unsigned int DebugFieldType and an unsigned int byte count, followed by that many
+ * bytes and padding to the next multiple of 8. Values keep the representation of the
+ * process that wrote them (UTF-16 wide strings, 4-byte long, pointer-sized pointers),
+ * so fields saved by DebugFileSink with DebugFileRecords can be decoded later on any
+ * machine of the same architecture.
+ * @code
+ *     size_t offset = 0;
+ *     DebugField field;
+ *     while (DebugReadField(record.fields, record.fieldsSize, offset, field)) {
+ *         if (field.type == DebugFieldInt) ...
+ *     }
+ * @endcode
+ *
+ * @return false at the end of the fields, or if the rest is truncated or malformed.
+ */
+inline bool DebugReadField(const void* fields, size_t size, size_t& offset, DebugField& field) {
+    const char* data = static_cast<const char*>(fields);
+    const char* payload[2];
+    unsigned int type[2];
+    unsigned int bytes[2];
+    size_t next = offset;
+    for (int i = 0; i < 2; ++i) {
+        if (!DebugDetail::ReadFieldEntry(data, size, next, type[i], payload[i], bytes[i])) return false;
+    }
+    if (type[0] != DebugFieldWideString) return false;
+
+    field.key = reinterpret_cast<const wchar_t*>(payload[0]);
+    field.keyLength = bytes[0] / sizeof(wchar_t);
+    field.type = static_cast<int>(type[1]);
+    field.value = payload[1];
+    field.size = bytes[1];
+    offset = next;
+    return true;
+}
+
+/**
+ * @brief Decodes the argument at offset into DebugRecord::arguments and advances offset past it.
+ *
+ * The arguments of a DebugDeferred() statement are stored like the values of fields,
+ * one entry per argument in the order of the call, but without keys; field.key is
+ * null. Strings are copied into the entries, so they can be saved with the record.
  *
- * @return A dummy DebugStream object for logging debug messages in release builds.
+ * @return false after the last argument, or if the rest is truncated or malformed.
  */
-inline DebugStream Debug() {
-    return DebugStream();
+inline bool DebugReadArgument(const void* arguments, size_t size, size_t& offset, DebugField& field) {
+    const char* payload;
+    unsigned int type;
+    unsigned int bytes;
+    size_t next = offset;
+    if (!DebugDetail::ReadFieldEntry(static_cast<const char*>(arguments), size, next, type, payload, bytes)) return false;
+
+    field.key = nullptr;
+    field.keyLength = 0;
+    field.type = static_cast<int>(type);
+    field.value = payload;
+    field.size = bytes;
+    offset = next;
+    return true;
 }
 
-#endif
\ No newline at end of file
+/**
+ * @enum DebugFileFormat
+ * @brief What DebugFileSink writes to its files.
+ */
+enum DebugFileFormat {
+    DebugFileText,                      // UTF-16LE lines after a byte order mark
+    DebugFileRecords                    // DebugRecordFrame records, with their fields and arguments still in binary
+};
+
+// First bytes of a DebugFileRecords file, including the terminator
+#define DEBUG_RECORD_FILE_SIGNATURE "DbgRecs"
+
+/**
+ * @struct DebugRecordFrame
+ * @brief Header of a record in a DebugFileRecords file.
+ *
+ * The file starts with DEBUG_RECORD_FILE_SIGNATURE, followed by one frame per record.
+ * The header is followed by the null-terminated text, the null-terminated format
+ * string if there is one, the fields and the arguments, each padded to the next
+ * multiple of 8. A frame whose size is 0 ends the data, like the zeros left after a
+ * record that a crashing process never finished.
+ */
+struct DebugRecordFrame {
+    unsigned int size;                  // Bytes of the frame, including this header; a multiple of 8
+    int level;                          // DebugRecord::level
+    unsigned int length;                // Characters in the text, excluding the terminator
+    unsigned int formatLength;          // Characters in the format string, or UINT_MAX if there is none
+    unsigned int fieldsSize;            // Bytes of fields
+    unsigned int argumentsSize;         // Bytes of arguments
+    unsigned int prefix;                // DebugRecord::prefix
+    DWORD threadId;                     // DebugRecord::threadId
+    LONG64 timestamp;                   // DebugRecord::timestamp
+    LONG64 sequence;                    // DebugRecord::sequence
+};
+
+/**
+ * @brief Decodes the frame at offset in a DebugFileRecords file and advances offset past it.
+ *
+ * Start with offset 0, where the signature is checked and skipped. The record points
+ * into data, which must be 8-byte aligned like a mapped view or a heap block, and
+ * can be passed to any sink or decoded further with DebugReadField() and
+ * DebugReadArgument().
+ * @code
+ *     size_t offset = 0;
+ *     DebugRecord record;
+ *     while (DebugReadRecordFrame(view, fileSize, offset, record)) {
+ *         sink.Write(record);
+ *     }
+ * @endcode
+ *
+ * @return false at the end of the data, or if the signature or the frame is malformed.
+ */
+inline bool DebugReadRecordFrame(const void* data, size_t size, size_t& offset, DebugRecord& record) {
+    const char* bytes = static_cast<const char*>(data);
+    size_t next = offset;
+    if (!bytes) return false;
+    if (next == 0) {
+        if (size < sizeof(DEBUG_RECORD_FILE_SIGNATURE) ||
+            memcmp(bytes, DEBUG_RECORD_FILE_SIGNATURE, sizeof(DEBUG_RECORD_FILE_SIGNATURE)) != 0) return false;
+        next = sizeof(DEBUG_RECORD_FILE_SIGNATURE);
+    }
+
+    DebugRecordFrame frame;
+    if (next > size || size - next < sizeof(frame)) return false;
+    memcpy(&frame, bytes + next, sizeof(frame));
+    if (frame.size < sizeof(frame) || frame.size % 8 != 0 || frame.size > size - next) return false;
+
+    // Every section, with its terminator, has to end inside the frame
+    bool hasFormat = frame.formatLength != UINT_MAX;
+    unsigned long long sectionBytes[4] = {
+        (frame.length + 1ULL) * sizeof(wchar_t),
+        hasFormat ? (frame.formatLength + 1ULL) * sizeof(wchar_t) : 0,
+        frame.fieldsSize,
+        frame.argumentsSize
+    };
+    size_t sectionOffset[4];
+    unsigned long long end = sizeof(frame);
+    for (int i = 0; i < 4; ++i) {
+        sectionOffset[i] = static_cast<size_t>(end);
+        end = (end + sectionBytes[i] + 7) & ~7ULL;
+        if (end > frame.size) return false;
+    }
+
+    const char* start = bytes + next;
+    const wchar_t* text = reinterpret_cast<const wchar_t*>(start + sectionOffset[0]);
+    const wchar_t* format = hasFormat ? reinterpret_cast<const wchar_t*>(start + sectionOffset[1]) : nullptr;
+    if (text[frame.length] != L'\0' || (format && format[frame.formatLength] != L'\0')) return false;
+
+    record.text = text;
+    record.length = frame.length;
+    record.level = frame.level;
+    record.format = format;
+    record.fields = frame.fieldsSize ? start + sectionOffset[2] : nullptr;
+    record.fieldsSize = frame.fieldsSize;
+    record.arguments = frame.argumentsSize ? start + sectionOffset[3] : nullptr;
+    record.argumentsSize = frame.argumentsSize;
+    record.prefix = frame.prefix;
+    record.threadId = frame.threadId;
+    record.timestamp = frame.timestamp;
+    record.sequence = frame.sequence;
+    offset = next + frame.size;
+    return true;
+}
+
+/**
+ * @class DebugSink
+ * @brief Receives finished log statements. Register one with DebugAddSink().
+ *
+ * Write() can be called from several threads at once, and from the output thread
+ * while DebugEnableAsync() is active. It must neither throw nor log itself.
+ */
+class DebugSink {
+public:
+    virtual ~DebugSink() {}
+
+    virtual void Write(const DebugRecord& record) = 0;
+
+    // Called by DebugFlushSinks(), e.g. to push buffered output to disk
+    virtual void Flush() {}
+};
+
+namespace DebugDetail {
+
+/**
+ * @brief Returns how many characters of text the next OutputDebugStringW call takes.
+ *
+ * A piece ends after the last newline in the second half of the limit if there is one,
+ * so a dump is split between rows, and never between the halves of a surrogate pair.
+ */
+inline size_t OutputChunkLength(const wchar_t* text, size_t length, size_t limit) {
+    if (length <= limit) return length;
+    for (size_t end = limit; end > limit / 2; --end) {
+        if (text[end - 1] == L'\n') return end;
+    }
+    return IS_HIGH_SURROGATE(text[limit - 1]) ? limit - 1 : limit;
+}
+
+/**
+ * @brief Writes a record with OutputDebugStringW, split into pieces of DEBUG_OUTPUT_CHUNK_SIZE.
+ *
+ * Listeners truncate longer strings. Each piece is copied into a fixed window on the
+ * stack, so a long message is never copied as a whole.
+ */
+inline void WriteDefaultOutput(const DebugRecord& record) {
+#if defined(DEBUG_NULL_OUTPUT)
+    (void)record;
+#else
+    const size_t limit = DEBUG_OUTPUT_CHUNK_SIZE < 2 ? 2 : DEBUG_OUTPUT_CHUNK_SIZE;
+    if (DEBUG_OUTPUT_CHUNK_SIZE == 0 || record.length <= limit) {
+        OutputDebugStringW(record.text);
+        return;
+    }
+
+    wchar_t window[(DEBUG_OUTPUT_CHUNK_SIZE < 2 ? 2 : DEBUG_OUTPUT_CHUNK_SIZE) + 1];
+    for (size_t offset = 0; offset < record.length;) {
+        size_t count = OutputChunkLength(record.text + offset, record.length - offset, limit);
+        std::char_traits<wchar_t>::copy(window, record.text + offset, count);
+        window[count] = L'\0';
+        OutputDebugStringW(window);
+        offset += count;
+    }
+#endif
+}
+
+} // namespace DebugDetail
+
+/**
+ * @class DebugOutputSink
+ * @brief Writes every record with OutputDebugStringW.
+ *
+ * This is the default sink; see DebugDefaultSink(). Records longer than
+ * DEBUG_OUTPUT_CHUNK_SIZE are written in pieces, also when passed to it directly. With
+ * DEBUG_NULL_OUTPUT defined, records are discarded instead.
+ */
+class DebugOutputSink : public DebugSink {
+public:
+    virtual void Write(const DebugRecord& record) {
+        DebugDetail::WriteDefaultOutput(record);
+    }
+};
+
+/**
+ * @class DebugNullSink
+ * @brief Discards every record.
+ */
+class DebugNullSink : public DebugSink {
+public:
+    virtual void Write(const DebugRecord&) {}
+};
+
+namespace DebugDetail {
+
+/**
+ * @struct FormatSpec
+ * @brief A parsed {:spec} placeholder: [[fill]align][sign][#][0][width][.precision][type].
+ */
+struct FormatSpec {
+    wchar_t fill;
+    wchar_t align;                      // L'<', L'>', L'^' or 0 for the default of the type
+    wchar_t sign;                       // L'+', L'-' or 0
+    bool alternate;                     // '#': base prefix for integers, decimal point for floats
+    bool zero;                          // '0': pad numbers with zeros after the sign
+    int width;
+    int precision;                      // -1 if not given
+    wchar_t type;                       // Presentation type letter, or 0
+
+    DEBUG_CONSTEXPR14 FormatSpec()
+        : fill(L' '), align(0), sign(0), alternate(false), zero(false), width(0), precision(-1), type(0) {}
+};
+
+enum FormatTokenKind {
+    FormatTokenEnd,
+    FormatTokenLiteral,                 // Text, or one brace of a {{ or }} pair
+    FormatTokenPlaceholder,
+    FormatTokenInvalid                  // A brace that starts no valid placeholder or pair
+};
+
+/**
+ * @struct FormatToken
+ * @brief One piece of a format string; begin to end is the text it stands for when
+ * it is output literally.
+ */
+struct FormatToken {
+    int kind;
+    const wchar_t* begin;
+    const wchar_t* end;
+    FormatSpec spec;
+
+    DEBUG_CONSTEXPR14 FormatToken() : kind(FormatTokenEnd), begin(nullptr), end(nullptr), spec() {}
+};
+
+DEBUG_CONSTEXPR14 bool IsFormatDigit(wchar_t ch) {
+    return ch >= L'0' && ch <= L'9';
+}
+
+DEBUG_CONSTEXPR14 bool IsFormatAlign(wchar_t ch) {
+    return ch == L'<' || ch == L'>' || ch == L'^';
+}
+
+DEBUG_CONSTEXPR14 const wchar_t* ParseFormatNumber(const wchar_t* text, int& value) {
+    value = 0;
+    for (; IsFormatDigit(*text); ++text) {
+        // Saturate instead of overflowing; no field is that wide
+        if (value < 100000) value = value * 10 + (*text - L'0');
+    }
+    return text;
+}
+
+// Parses the spec after the colon; returns the character after it, which must be '}'
+DEBUG_CONSTEXPR14 const wchar_t* ParseFormatSpec(const wchar_t* text, FormatSpec& spec) {
+    if (text[0] != 0 && text[0] != L'{' && text[0] != L'}' && IsFormatAlign(text[1])) {
+        spec.fill = text[0];
+        spec.align = text[1];
+        text += 2;
+    } else if (IsFormatAlign(text[0])) {
+        spec.align = *text++;
+    }
+    if (*text == L'+' || *text == L'-') spec.sign = *text++;
+    if (*text == L'#') {
+        spec.alternate = true;
+        ++text;
+    }
+    if (*text == L'0') {
+        spec.zero = true;
+        ++text;
+    }
+    text = ParseFormatNumber(text, spec.width);
+    if (*text == L'.') {
+        if (!IsFormatDigit(text[1])) return text;
+        text = ParseFormatNumber(text + 1, spec.precision);
+    }
+    if ((*text >= L'a' && *text <= L'z') || (*text >= L'A' && *text <= L'Z')) spec.type = *text++;
+    return text;
+}
+
+/**
+ * @brief Reads the token that starts at text and returns the position after it.
+ *
+ * Placeholders are {} or {:spec}; {{ and }} stand for literal braces. Usable in
+ * constant expressions from C++14 on, which is how format strings are checked at
+ * compile time.
+ */
+DEBUG_CONSTEXPR14 const wchar_t* NextFormatToken(const wchar_t* text, FormatToken& token) {
+    token.begin = text;
+    token.spec = FormatSpec();
+    if (*text == 0) {
+        token.kind = FormatTokenEnd;
+        token.end = text;
+        return text;
+    }
+
+    if (*text == L'{' || *text == L'}') {
+        if (text[1] == *text) {
+            token.kind = FormatTokenLiteral;
+            token.end = text + 1;
+            return text + 2;
+        }
+        if (*text == L'{') {
+            const wchar_t* next = text + 1;
+            if (*next == L':') next = ParseFormatSpec(next + 1, token.spec);
+            if (*next == L'}') {
+                token.kind = FormatTokenPlaceholder;
+                token.end = next + 1;
+                return next + 1;
+            }
+        }
+        token.kind = FormatTokenInvalid;
+        token.end = text + 1;
+        return text + 1;
+    }
+
+    while (*text != 0 && *text != L'{' && *text != L'}') ++text;
+    token.kind = FormatTokenLiteral;
+    token.end = text;
+    return text;
+}
+
+/**
+ * @enum FormatKind
+ * @brief How an argument type is formatted, which decides the specs it accepts.
+ */
+enum FormatKind {
+    FormatKindOther,                    // Written through std::wostream
+    FormatKindInteger,
+    FormatKindFloat,
+    FormatKindString,
+    FormatKindChar,
+    FormatKindBool,
+    FormatKindPointer
+};
+
+template<typename T> struct FormatKindOf { enum { Value = FormatKindOther }; };
+template<typename T> struct FormatKindOf<T*> { enum { Value = FormatKindPointer }; };
+template<> struct FormatKindOf<bool> { enum { Value = FormatKindBool }; };
+template<> struct FormatKindOf<char> { enum { Value = FormatKindChar }; };
+template<> struct FormatKindOf<wchar_t> { enum { Value = FormatKindChar }; };
+// Written as numbers, like std::wostream does
+template<> struct FormatKindOf<signed char> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<unsigned char> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<short> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<unsigned short> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<int> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<unsigned int> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<long> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<unsigned long> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<long long> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<unsigned long long> { enum { Value = FormatKindInteger }; };
+template<> struct FormatKindOf<float> { enum { Value = FormatKindFloat }; };
+template<> struct FormatKindOf<double> { enum { Value = FormatKindFloat }; };
+template<> struct FormatKindOf<long double> { enum { Value = FormatKindFloat }; };
+template<> struct FormatKindOf<const char*> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<char*> { enum { Value = FormatKindString }; };
+template<size_t N> struct FormatKindOf<char[N]> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<std::string> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<const wchar_t*> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<wchar_t*> { enum { Value = FormatKindString }; };
+template<size_t N> struct FormatKindOf<wchar_t[N]> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<std::wstring> { enum { Value = FormatKindString }; };
+#if defined(DEBUG_HAS_STRING_VIEW)
+template<> struct FormatKindOf<std::string_view> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<std::wstring_view> { enum { Value = FormatKindString }; };
+#endif
+
+// Whether a spec makes sense for an argument of the given kind
+DEBUG_CONSTEXPR14 bool FormatSpecFits(const FormatSpec& spec, int kind) {
+    bool plain = spec.sign == 0 && !spec.alternate && !spec.zero && spec.precision < 0;
+    switch (kind) {
+    case FormatKindInteger:
+        return spec.precision < 0 && (spec.type == 0 || spec.type == L'd' || spec.type == L'x' ||
+                                      spec.type == L'X' || spec.type == L'o');
+    case FormatKindFloat:
+        return spec.type == 0 || spec.type == L'f' || spec.type == L'F' || spec.type == L'e' || spec.type == L'E' ||
+               spec.type == L'g' || spec.type == L'G' || spec.type == L'a' || spec.type == L'A';
+    case FormatKindString:
+    case FormatKindBool:
+        return plain && (spec.type == 0 || spec.type == L's');
+    case FormatKindChar:
+        return plain && (spec.type == 0 || spec.type == L'c');
+    case FormatKindPointer:
+        return plain && (spec.type == 0 || spec.type == L'p');
+    default:
+        return plain && spec.type == 0;
+    }
+}
+
+/**
+ * @brief Checks that a format string is well-formed and has one fitting placeholder
+ * per argument.
+ *
+ * @param kinds The FormatKind of each argument.
+ */
+DEBUG_CONSTEXPR14 bool CheckFormat(const wchar_t* text, const int* kinds, size_t count) {
+    size_t used = 0;
+    for (;;) {
+        FormatToken token;
+        text = NextFormatToken(text, token);
+        if (token.kind == FormatTokenEnd) return used == count;
+        if (token.kind == FormatTokenInvalid) return false;
+        if (token.kind == FormatTokenPlaceholder) {
+            if (used == count || !FormatSpecFits(token.spec, kinds[used])) return false;
+            ++used;
+        }
+    }
+}
+
+// Not constexpr on purpose: reaching it while checking a format string at compile time
+// fails the build with its name in the error message
+inline void FormatStringDoesNotMatchArguments() {}
+
+template<typename T>
+struct FormatIdentity {
+    typedef T Type;
+};
+
+} // namespace DebugDetail
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+/**
+ * @class DebugFormatString
+ * @brief A format string for the arguments Args, checked at compile time from C++20 on.
+ *
+ * It is created implicitly from a string literal. With consteval support a placeholder
+ * without an argument, an argument without a placeholder, a spec that does not fit the
+ * argument's type or an unpaired brace fails the build. Earlier, the string is only
+ * interpreted at run time: unmatched placeholders and braces are output as they are,
+ * specs that do not fit are ignored, and extra arguments are dropped.
+ */
+template<typename... Args>
+class DebugFormatString {
+public:
+#if defined(DEBUG_HAS_CONSTEVAL)
+    consteval DebugFormatString(const wchar_t* formatText) : text(formatText) {
+        const int kinds[sizeof...(Args) + 1] = { DebugDetail::FormatKindOf<Args>::Value..., 0 };
+        if (!DebugDetail::CheckFormat(formatText, kinds, sizeof...(Args))) {
+            DebugDetail::FormatStringDoesNotMatchArguments();
+        }
+    }
+#else
+    DebugFormatString(const wchar_t* formatText) : text(formatText) {}
+#endif
+
+    const wchar_t* Text() const { return text; }
+
+private:
+    const wchar_t* text;
+};
+#endif
+
+/**
+ * @struct DebugHexDump
+ * @brief Bytes to be written as a hex dump; created by DebugHex() and DebugDump().
+ */
+struct DebugHexDump {
+    const void* data;
+    size_t size;
+    size_t maxRows;                     // Rows of 16 bytes to write at most, or 0 for all
+
+    DebugHexDump(const void* dumpData, size_t dumpSize, size_t dumpMaxRows)
+        : data(dumpData), size(dumpSize), maxRows(dumpMaxRows) {}
+};
+
+/**
+ * @brief Inserts size bytes at data as a hex dump, in rows of offset, hex and text.
+ *
+ * Each row shows 16 bytes:
+ * @code
+ *     00000000  47 45 54 20 2F 20 48 54  54 50 2F 31 2E 31 0D 0A  |GET / HTTP/1.1..|
+ * @endcode
+ * Bytes outside printable ASCII are shown as '.'. At most maxRows rows are written,
+ * followed by a line with the number of bytes left out. The whole dump is formatted
+ * into the statement's buffer in one step, so it is written with the statement.
+ *
+ * @param data The first byte to dump; may only be nullptr if size is 0.
+ * @param size The number of bytes to dump.
+ * @param maxRows The most rows to write, or 0 for no limit.
+ * @throws std::invalid_argument When inserted, if data is nullptr and size is not 0.
+ */
+inline DebugHexDump DebugHex(const void* data, size_t size, size_t maxRows = DEBUG_HEX_MAX_ROWS) {
+    return DebugHexDump(data, size, maxRows);
+}
+
+/**
+ * @brief Inserts the bytes of an object as a hex dump, like DebugHex(&object, sizeof(object)).
+ *
+ * For a pointer, this dumps the pointer itself; use DebugHex() for what it points to.
+ */
+template<typename T>
+inline DebugHexDump DebugDump(const T& object, size_t maxRows = DEBUG_HEX_MAX_ROWS) {
+    return DebugHexDump(&object, sizeof(object), maxRows);
+}
+
+/**
+ * @struct DebugErrorCode
+ * @brief An error code to be written with its system message; created by DebugLastError(),
+ * DebugError() and DebugHr().
+ */
+struct DebugErrorCode {
+    DWORD code;
+    bool isHresult;                     // Written as 8 hex digits instead of in decimal
+
+    DebugErrorCode(DWORD errorCode, bool errorIsHresult) : code(errorCode), isHresult(errorIsHresult) {}
+};
+
+/**
+ * @brief Inserts a Win32 error code and its system message.
+ * @code
+ *     Debug() << L"CreateFile failed: " << DebugError(5);  // CreateFile failed: 5 (Access is denied.)
+ * @endcode
+ * The message is looked up with FormatMessageW the first time a code is written and
+ * remembered for the rest of the process, so logging the same error again, e.g. in a
+ * retry loop, only reads the cache. Codes without a message are written alone.
+ */
+inline DebugErrorCode DebugError(DWORD code) {
+    return DebugErrorCode(code, false);
+}
+
+/**
+ * @brief Inserts the calling thread's GetLastError() code and its system message.
+ *
+ * The code is read when DebugLastError() is called. Creating the statement's stream
+ * leaves the last error alone, so it can be called anywhere in the statement.
+ */
+inline DebugErrorCode DebugLastError() {
+    return DebugErrorCode(GetLastError(), false);
+}
+
+/**
+ * @brief Inserts an HRESULT and its system message, e.g. "0x80070005 (Access is denied.)".
+ */
+inline DebugErrorCode DebugHr(HRESULT hr) {
+    return DebugErrorCode(static_cast<DWORD>(hr), true);
+}
+
+/**
+ * @struct DebugLazyValue
+ * @brief A callable whose result is inserted only if the stream writes it; created by DebugLazy().
+ */
+template<typename F>
+struct DebugLazyValue {
+    F function;
+
+    explicit DebugLazyValue(const F& lazyFunction) : function(lazyFunction) {}
+};
+
+/**
+ * @brief Inserts the result of function(), calling it only if the statement is written.
+ * @code
+ *     Debug() << L"Cache: " << DebugLazy([&] { return cache.Describe(); });
+ * @endcode
+ * A stream that discards its input, because logging is off, its level is compiled out
+ * or it is a release build, never calls the function. Use it for descriptions that are
+ * expensive to build, such as a ToString() of a large object. The result can be of any
+ * type the stream accepts; the function must be callable on a const object.
+ */
+template<typename F>
+inline DebugLazyValue<F> DebugLazy(const F& function) {
+    return DebugLazyValue<F>(function);
+}
+
+namespace DebugDetail {
+
+// Containers with a key_type, i.e. sets and maps, are written in braces
+template<typename T>
+struct HasKeyType {
+    template<typename U>
+    static char Test(typename U::key_type*);
+    template<typename U>
+    static long Test(...);
+    static const bool Value = sizeof(Test<T>(0)) == 1;
+};
+
+// Containers with a mapped_type write their elements as "key: value"
+template<typename T>
+struct HasMappedType {
+    template<typename U>
+    static char Test(typename U::mapped_type*);
+    template<typename U>
+    static long Test(...);
+    static const bool Value = sizeof(Test<T>(0)) == 1;
+};
+
+} // namespace DebugDetail
+
+/**
+ * @struct DebugRangeValue
+ * @brief Elements to be written as a list; created by DebugRange().
+ */
+template<typename Iterator, bool Mapped = false>
+struct DebugRangeValue {
+    Iterator first;
+    Iterator last;
+    size_t maxElements;                 // Elements to write at most, or 0 for all
+    bool associative;                   // Written in braces instead of brackets
+
+    DebugRangeValue(Iterator rangeFirst, Iterator rangeLast, size_t rangeMaxElements, bool rangeAssociative)
+        : first(rangeFirst), last(rangeLast), maxElements(rangeMaxElements), associative(rangeAssociative) {}
+};
+
+/**
+ * @brief Inserts the elements of a container, e.g. "[1, 2, 3]" or "{1: one, 2: two}".
+ *
+ * Sequences are written in brackets, sets in braces and maps as "{key: value, ...}".
+ * Each element is formatted straight into the statement's buffer, with the stream's
+ * manipulators; a width applies to every element. After maxElements elements the
+ * rest is only counted, as in "[1, 2, 3, ... (+999997 more)]", so logging a huge
+ * container by accident stays cheap. In C++11, containers can also be inserted
+ * without DebugRange(), with the limit DEBUG_RANGE_MAX_ELEMENTS.
+ *
+ * @param container Anything with begin() and end() members; it must outlive the statement.
+ * @param maxElements The most elements to write, or 0 for no limit.
+ */
+template<typename Container>
+inline DebugRangeValue<typename Container::const_iterator, DebugDetail::HasMappedType<Container>::Value>
+DebugRange(const Container& container, size_t maxElements = DEBUG_RANGE_MAX_ELEMENTS) {
+    return DebugRangeValue<typename Container::const_iterator, DebugDetail::HasMappedType<Container>::Value>(
+        container.begin(), container.end(), maxElements, DebugDetail::HasKeyType<Container>::Value);
+}
+
+/**
+ * @brief Inserts the elements of an array as a list, e.g. "[1, 2, 3]".
+ */
+template<typename T, size_t N>
+inline DebugRangeValue<const T*> DebugRange(const T (&array)[N], size_t maxElements = DEBUG_RANGE_MAX_ELEMENTS) {
+    return DebugRangeValue<const T*>(array, array + N, maxElements, false);
+}
+
+/**
+ * @brief Inserts the elements from first up to last as a list, e.g. "[1, 2, 3]".
+ *
+ * Counting the elements beyond the limit walks the rest of the range unless Iterator
+ * is a random access iterator.
+ */
+template<typename Iterator>
+inline DebugRangeValue<Iterator> DebugRange(Iterator first, Iterator last, size_t maxElements = DEBUG_RANGE_MAX_ELEMENTS) {
+    return DebugRangeValue<Iterator>(first, last, maxElements, false);
+}
+
+/**
+ * @struct DebugFlushPolicy
+ * @brief When a DebugStream writes what it has buffered.
+ *
+ * A default-constructed policy only writes on Flush() and destruction. The limits can
+ * be combined, and whichever is reached first writes the completed lines, keeping an
+ * unfinished last line in the buffer:
+ * @code
+ *     DebugStream network(DebugFlushPolicy().Characters(16384).Messages(64).Milliseconds(250));
+ * @endcode
+ * Limits are checked after each insertion, so a stream that nothing is inserted into
+ * keeps its lines until the next insertion, Flush() or its destruction.
+ */
+struct DebugFlushPolicy {
+    bool everyInsertion;                // Write after every insertion, partial lines included
+    size_t maxCharacters;               // Buffered characters that trigger a write, or 0
+    size_t maxMessages;                 // Buffered complete lines that trigger a write, or 0
+    unsigned long maxMilliseconds;      // Age of the oldest buffered character that triggers a write, or 0
+
+    DebugFlushPolicy() : everyInsertion(false), maxCharacters(0), maxMessages(0), maxMilliseconds(0) {}
+
+    // The policy of DebugStream(true): each insertion is written on its own
+    static DebugFlushPolicy EveryInsertion() {
+        DebugFlushPolicy policy;
+        policy.everyInsertion = true;
+        return policy;
+    }
+
+    DebugFlushPolicy& Characters(size_t count) { maxCharacters = count; return *this; }
+    DebugFlushPolicy& Messages(size_t count) { maxMessages = count; return *this; }
+    DebugFlushPolicy& Milliseconds(unsigned long milliseconds) { maxMilliseconds = milliseconds; return *this; }
+};
+
+namespace DebugDetail {
+
+/**
+ * @struct FlightRecorderHeader
+ * @brief Start of the flight recorder's memory, followed by capacity bytes of entries.
+ *
+ * The signature makes the ring easy to find in a minidump. Entries start at multiples
+ * of 8 bytes and wrap around the end of the ring. Each is a FlightEntry followed by
+ * its UTF-16 text, padded to 8 bytes.
+ *
+ * DebugSharedRingSink uses the same layout in shared memory, so the layout is the
+ * same for 32-bit and 64-bit processes, and it is defined in every build for readers.
+ */
+struct FlightRecorderHeader {
+    wchar_t signature[16];              // L"DebugUtilFlight", or L"DebugUtilRing" in shared memory
+    LONG64 capacity;                    // Bytes of entries after the header, a power of two
+    volatile LONG64 head;               // Bytes reserved since the recorder was enabled
+    DWORD processId;                    // Process writing a shared ring, 0 for the flight recorder
+};
+
+struct FlightEntry {
+    LONG64 stamp;                       // Ring position of the entry plus one, written last
+    unsigned int length;                // Characters of text
+    int level;                          // DEBUG_LEVEL_* of the statement
+};
+
+inline char* FlightData(FlightRecorderHeader* ring) {
+    return reinterpret_cast<char*>(ring + 1);
+}
+
+// Longest text kept per entry, so that the dump buffer stays small
+inline size_t FlightMaxLength(const FlightRecorderHeader* ring) {
+    return static_cast<size_t>(ring->capacity) / 16;
+}
+
+inline LONG64 FlightEntrySize(size_t length) {
+    return static_cast<LONG64>((sizeof(FlightEntry) + length * sizeof(wchar_t) + 7) & ~static_cast<size_t>(7));
+}
+
+inline void FlightCopyIn(FlightRecorderHeader* ring, LONG64 position, const void* source, size_t bytes) {
+    size_t offset = static_cast<size_t>(position) & static_cast<size_t>(ring->capacity - 1);
+    size_t first = static_cast<size_t>(ring->capacity) - offset;
+    if (first > bytes) first = bytes;
+    memcpy(FlightData(ring) + offset, source, first);
+    memcpy(FlightData(ring), static_cast<const char*>(source) + first, bytes - first);
+}
+
+inline void FlightCopyOut(FlightRecorderHeader* ring, LONG64 position, void* target, size_t bytes) {
+    size_t offset = static_cast<size_t>(position) & static_cast<size_t>(ring->capacity - 1);
+    size_t first = static_cast<size_t>(ring->capacity) - offset;
+    if (first > bytes) first = bytes;
+    memcpy(target, FlightData(ring) + offset, first);
+    memcpy(static_cast<char*>(target) + first, FlightData(ring), bytes - first);
+}
+
+inline volatile LONG64* FlightStamp(FlightRecorderHeader* ring, LONG64 position) {
+    size_t offset = static_cast<size_t>(position) & static_cast<size_t>(ring->capacity - 1);
+    return reinterpret_cast<volatile LONG64*>(FlightData(ring) + offset);
+}
+
+} // namespace DebugDetail
+
+/**
+ * @brief Returns the name of the shared-memory ring a DebugSharedRingSink creates by
+ * default in the given process, "Local\\DebugUtilRing.<processId>".
+ */
+inline std::wstring DebugSharedRingName(DWORD processId) {
+    wchar_t digits[16];
+    size_t count = 0;
+    for (DWORD value = processId; count == 0 || value; value /= 10) {
+        digits[count++] = static_cast<wchar_t>(L'0' + value % 10);
+    }
+    std::wstring name = L"Local\\DebugUtilRing.";
+    while (count) name += digits[--count];
+    return name;
+}
+
+/**
+ * @class DebugSharedRingReader
+ * @brief Reads, from another process, the records written through a DebugSharedRingSink.
+ *
+ * Defined in every build, for tools such as tools/DebugRingViewer.cpp. Writers never
+ * wait for a reader: a reader that falls more than the ring's capacity behind loses the
+ * oldest records, which LostBytes() counts.
+ * @code
+ *     DebugSharedRingReader reader(DebugSharedRingName(processId).c_str());
+ *     for (;;) {
+ *         if (reader.Read(sink) == 0) Sleep(10);
+ *     }
+ * @endcode
+ */
+class DebugSharedRingReader {
+public:
+    /**
+     * @brief Opens an existing ring and positions the reader at its oldest record.
+     *
+     * @param name The ring's name, e.g. from DebugSharedRingName().
+     * @throws std::invalid_argument If name is null.
+     * @throws std::runtime_error If there is no ring with that name or it cannot be mapped.
+     */
+    explicit DebugSharedRingReader(const wchar_t* name)
+        : mapping(nullptr), ring(nullptr), text(nullptr), writer(nullptr), writerId(0), position(0), lost(0),
+          stalledSince(0), resync(false) {
+        if (!name) {
+            throw std::invalid_argument("Null ring name");
+        }
+
+        mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name);
+        ring = mapping ? static_cast<DebugDetail::FlightRecorderHeader*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if (!ring || std::char_traits<wchar_t>::compare(ring->signature, L"DebugUtilRing", 14) != 0) {
+            if (ring) UnmapViewOfFile(ring);
+            if (mapping) CloseHandle(mapping);
+            throw std::runtime_error("Failed to open the shared ring");
+        }
+
+        text = new wchar_t[DebugDetail::FlightMaxLength(ring) + 1];
+        LONG64 head = ReadAcquire64(&ring->head);
+        position = head > ring->capacity ? head - ring->capacity : 0;
+        resync = position != 0;
+    }
+
+#if defined(DEBUG_HAS_CPP11)
+    DebugSharedRingReader(const DebugSharedRingReader&) = delete;
+    DebugSharedRingReader& operator=(const DebugSharedRingReader&) = delete;
+#endif
+
+    ~DebugSharedRingReader() {
+        if (writer) CloseHandle(writer);
+        delete[] text;
+        UnmapViewOfFile(ring);
+        CloseHandle(mapping);
+    }
+
+    /**
+     * @brief Passes the records written since the last call to a sink, oldest first.
+     *
+     * A record that is still being written ends the call; it is read by a later one.
+     * It is skipped once the writing process has exited, or after it stays incomplete
+     * for DEBUG_SHARED_RING_STALL_MS while the process is not being debugged, so a
+     * writer paused at a breakpoint does not lose the record.
+     *
+     * @return The number of records passed to target.
+     */
+    size_t Read(DebugSink& target) {
+        size_t count = 0;
+        LONG64 capacity = ring->capacity;
+        for (;;) {
+            LONG64 head = ReadAcquire64(&ring->head);
+            if (position >= head) {
+                // Every reservation ends at head, so the next record starts here
+                resync = false;
+                break;
+            }
+            if (head - position > capacity) {
+                // Overwritten; position may now be in the middle of a record
+                lost += static_cast<unsigned long long>(head - capacity - position);
+                position = head - capacity;
+                stalledSince = 0;
+                resync = true;
+            }
+
+            if (ReadAcquire64(DebugDetail::FlightStamp(ring, position)) != position + 1) {
+                if (!resync) {
+                    if (!WriterGone()) break;
+                    // The rest of the dead record is skipped without waiting again
+                    resync = true;
+                }
+                position += sizeof(LONG64);
+                lost += sizeof(LONG64);
+                stalledSince = 0;
+                continue;
+            }
+
+            unsigned int fields[2];
+            DebugDetail::FlightCopyOut(ring, position + sizeof(LONG64), fields, sizeof(fields));
+            LONG64 size = DebugDetail::FlightEntrySize(fields[0]);
+            if (fields[0] > DebugDetail::FlightMaxLength(ring) || position + size > head) {
+                position += sizeof(LONG64);
+                lost += sizeof(LONG64);
+                stalledSince = 0;
+                continue;
+            }
+            DebugDetail::FlightCopyOut(ring, position + sizeof(DebugDetail::FlightEntry), text, fields[0] * sizeof(wchar_t));
+            MemoryBarrier();
+
+            // A writer that reserved past position + capacity may have overwritten the copy;
+            // the next iteration counts it as lost
+            if (ReadAcquire64(&ring->head) - capacity > position) continue;
+
+            stalledSince = 0;
+            resync = false;
+            text[fields[0]] = L'\0';
+            DebugRecord record;
+            record.text = text;
+            record.length = fields[0];
+            record.level = static_cast<int>(fields[1]);
+            record.format = nullptr;
+            record.fields = nullptr;
+            record.fieldsSize = 0;
+            record.arguments = nullptr;
+            record.argumentsSize = 0;
+            record.prefix = 0;
+            record.threadId = 0;
+            record.timestamp = 0;
+            record.sequence = 0;
+            target.Write(record);
+            ++count;
+            position += size;
+        }
+        return count;
+    }
+
+    // Bytes of records that were overwritten before they could be read
+    unsigned long long LostBytes() const { return lost; }
+
+    // The process that last created a sink for the ring
+    DWORD ProcessId() const { return ring->processId; }
+
+private:
+#if !defined(DEBUG_HAS_CPP11)
+    // Not copyable
+    DebugSharedRingReader(const DebugSharedRingReader&);
+    DebugSharedRingReader& operator=(const DebugSharedRingReader&);
+#endif
+
+    // Whether the incomplete record at position is to be given up on
+    bool WriterGone() {
+        ULONGLONG now = GetTickCount64();
+        if (!stalledSince) stalledSince = now;
+
+        DWORD id = ring->processId;
+        if (id != writerId) {
+            // A new process took the ring over
+            if (writer) CloseHandle(writer);
+            writer = OpenProcess(SYNCHRONIZE | PROCESS_QUERY_INFORMATION, FALSE, id);
+            writerId = id;
+        }
+        if (writer) {
+            if (WaitForSingleObject(writer, 0) == WAIT_OBJECT_0) return true;
+            BOOL debugged = FALSE;
+            if (CheckRemoteDebuggerPresent(writer, &debugged) && debugged) {
+                // Possibly stopped at a breakpoint; the wait starts over when it runs again
+                stalledSince = now;
+                return false;
+            }
+        }
+        return now - stalledSince >= DEBUG_SHARED_RING_STALL_MS;
+    }
+
+    HANDLE mapping;
+    DebugDetail::FlightRecorderHeader* ring;    // Mapped read-only
+    wchar_t* text;                              // Copy of the record being read
+    HANDLE writer;                              // The process writing the ring, or null if it cannot be opened
+    DWORD writerId;                             // Process id writer was opened for
+    LONG64 position;                            // Ring position of the next record
+    unsigned long long lost;
+    ULONGLONG stalledSince;                     // When the record at position was first found incomplete, or 0
+    bool resync;                                // Whether position may not be the start of a record
+};
+
+#ifdef _DEBUG
+/**
+ * @namespace DebugDetail
+ * @brief Implementation details of DebugStream. Not intended to be used directly.
+ */
+namespace DebugDetail {
+
+struct AdapterStream;
+
+/**
+ * @struct DeferredRing
+ * @brief A single-producer single-consumer byte ring of DebugDeferred() records.
+ *
+ * Each thread that calls DebugDeferred() owns one ring and is its only writer; the
+ * output thread is its only reader. Rings are never freed: when a thread exits its
+ * ring is released and handed to the next thread that needs one.
+ */
+struct DeferredRing {
+    volatile LONG64 head;               // Bytes written by the owning thread
+    char headPadding[64 - sizeof(LONG64)];
+    volatile LONG64 tail;               // Bytes consumed by the output thread
+    char tailPadding[64 - sizeof(LONG64)];
+    volatile LONG owned;                // Nonzero while a thread writes to the ring
+    DeferredRing* next;                 // Next ring in DeferredState::rings
+    size_t mask;                        // Ring size - 1; the size is a power of two
+    char* data;                         // 8-byte aligned storage for the records
+};
+
+/**
+ * @struct ThreadCache
+ * @brief Per-thread objects that DebugStream borrows and gives back.
+ *
+ * A stream takes the cached spill block or adapter stream when it first needs one and
+ * returns it when it is destroyed, so consecutive statements on a thread keep their
+ * capacity. A nested stream, e.g. one created inside a streamed type's operator<<,
+ * finds the cache empty while the outer stream holds the objects and allocates its own.
+ */
+struct ThreadCache {
+    wchar_t* block;                     // Spill block of a WideBuffer, or nullptr
+    size_t blockCapacity;               // Usable characters in block, excluding the terminator slot
+    AdapterStream* adapter;             // Idle adapter stream, or nullptr
+    DeferredRing* deferredRing;         // Ring owned by this thread, or nullptr
+    unsigned long metricShard;          // Shard index + 1 for counters and histograms, 0 until assigned
+    unsigned int sampleState;           // xorshift32 state of DEBUG_LOG_SAMPLED, 0 until seeded
+    DWORD threadTextId;                 // Thread id last written in a prefix by this thread
+    size_t threadTextLength;            // Characters in threadText, 0 until a prefix is written
+    wchar_t threadText[10];             // Decimal digits of threadTextId
+};
+
+struct ThreadCacheState {
+    volatile LONG slot;                 // FLS index + 1; 0 until allocated, -1 if unavailable
+};
+
+inline ThreadCacheState& GetThreadCacheState() {
+    static ThreadCacheState state;
+    return state;
+}
+
+// Called by the system when a thread (or fiber) exits; defined after AdapterStream
+inline void NTAPI FreeThreadCache(PVOID data);
+
+// Frees the FLS index, so a DLL that includes this header can be unloaded safely
+inline void ReleaseThreadCacheSlot() {
+    LONG slot = InterlockedExchange(&GetThreadCacheState().slot, -1);
+    if (slot > 0) FlsFree(static_cast<DWORD>(slot - 1));
+}
+
+inline LONG AllocateThreadCacheSlot() {
+    ThreadCacheState& cacheState = GetThreadCacheState();
+    DWORD index = FlsAlloc(FreeThreadCache);
+    LONG slot = index == FLS_OUT_OF_INDEXES ? -1 : static_cast<LONG>(index) + 1;
+
+    LONG previous = InterlockedCompareExchange(&cacheState.slot, slot, 0);
+    if (previous != 0) {
+        // Another thread allocated the index first
+        if (slot > 0) FlsFree(index);
+        return previous;
+    }
+    if (slot > 0) std::atexit(ReleaseThreadCacheSlot);
+    return slot;
+}
+
+/**
+ * @brief Returns the calling thread's cache, creating it on first use.
+ *
+ * Fiber-local storage is used because it works in every language mode and frees the
+ * cache when the thread exits. Returns nullptr if no cache can be created, in which
+ * case callers allocate as if the cache were empty. Preserves GetLastError().
+ */
+inline ThreadCache* GetThreadCache() {
+    LONG slot = ReadAcquire(&GetThreadCacheState().slot);
+    if (slot == 0) slot = AllocateThreadCacheSlot();
+    if (slot < 0) return nullptr;
+
+    DWORD lastError = GetLastError();
+    DWORD index = static_cast<DWORD>(slot - 1);
+    ThreadCache* cache = static_cast<ThreadCache*>(FlsGetValue(index));
+    if (!cache) {
+        cache = new (std::nothrow) ThreadCache();
+        if (cache && !FlsSetValue(index, cache)) {
+            delete cache;
+            cache = nullptr;
+        }
+    }
+    SetLastError(lastError);
+    return cache;
+}
+
+// Takes the thread's cached spill block if it can hold required characters
+inline wchar_t* TakeCachedBlock(size_t required, size_t& blockCapacity) {
+    ThreadCache* cache = GetThreadCache();
+    if (!cache || !cache->block || cache->blockCapacity < required) return nullptr;
+
+    wchar_t* block = cache->block;
+    blockCapacity = cache->blockCapacity;
+    cache->block = nullptr;
+    return block;
+}
+
+// Keeps a spill block for the next long message on this thread, or frees it
+inline void ReleaseBlock(wchar_t* block, size_t blockCapacity) {
+    if (blockCapacity <= DEBUG_THREAD_CACHE_LIMIT) {
+        ThreadCache* cache = GetThreadCache();
+        if (cache && (!cache->block || cache->blockCapacity < blockCapacity)) {
+            delete[] cache->block;
+            cache->block = block;
+            cache->blockCapacity = blockCapacity;
+            return;
+        }
+    }
+    delete[] block;
+}
+
+/**
+ * @class WideBuffer
+ * @brief A growable wchar_t buffer with inline storage.
+ *
+ * Up to DEBUG_INLINE_BUFFER_SIZE characters are stored inside the object itself, so a
+ * typical log line is formatted without touching the heap. Longer messages spill to a
+ * heap block that grows geometrically. One extra character is always reserved so the
+ * contents can be null-terminated and passed to OutputDebugStringW in place.
+ */
+class WideBuffer {
+public:
+    WideBuffer() : data(inlineData), length(0), capacity(DEBUG_INLINE_BUFFER_SIZE) {}
+
+    WideBuffer(const WideBuffer& other) : data(inlineData), length(0), capacity(DEBUG_INLINE_BUFFER_SIZE) {
+        Append(other.data, other.length);
+    }
+
+    WideBuffer& operator=(const WideBuffer& other) {
+        if (this != &other) {
+            length = 0;
+            Append(other.data, other.length);
+        }
+        return *this;
+    }
+
+    ~WideBuffer() {
+        if (data != inlineData) ReleaseBlock(data, capacity);
+    }
+
+    // Takes the contents of other and leaves it empty. A heap block changes hands instead
+    // of being copied, so this never allocates.
+    inline void TakeFrom(WideBuffer& other) {
+        if (this == &other) return;
+        if (data != inlineData) ReleaseBlock(data, capacity);
+        if (other.data == other.inlineData) {
+            data = inlineData;
+            capacity = DEBUG_INLINE_BUFFER_SIZE;
+            std::char_traits<wchar_t>::copy(inlineData, other.inlineData, other.length);
+        } else {
+            data = other.data;
+            capacity = other.capacity;
+            other.data = other.inlineData;
+            other.capacity = DEBUG_INLINE_BUFFER_SIZE;
+        }
+        length = other.length;
+        other.length = 0;
+    }
+
+    inline size_t Size() const { return length; }
+    inline bool Empty() const { return length == 0; }
+    inline void Clear() { length = 0; }
+    inline wchar_t* Data() { return data; }
+
+    // Removes the first count characters and moves the rest to the front
+    inline void Consume(size_t count) {
+        std::char_traits<wchar_t>::move(data, data + count, length - count);
+        length -= count;
+    }
+
+    /**
+     * @brief Returns the contents as a null-terminated string.
+     *
+     * The pointer stays valid until the buffer is modified.
+     */
+    inline const wchar_t* CStr() {
+        data[length] = L'\0';
+        return data;
+    }
+
+    /**
+     * @brief Makes room for count characters at the end of the buffer.
+     *
+     * @return A pointer to the first writable character. Call Commit() with the number
+     * of characters actually written.
+     */
+    inline wchar_t* Reserve(size_t count) {
+        if (count > capacity - length) Grow(count);
+        return data + length;
+    }
+
+    inline void Commit(size_t count) { length += count; }
+
+    inline void Append(wchar_t ch) {
+        if (length == capacity) Grow(1);
+        data[length++] = ch;
+    }
+
+    inline void Append(const wchar_t* str, size_t count) {
+        std::char_traits<wchar_t>::copy(Reserve(count), str, count);
+        length += count;
+    }
+
+    inline void Append(size_t count, wchar_t ch) {
+        std::char_traits<wchar_t>::assign(Reserve(count), count, ch);
+        length += count;
+    }
+
+    // Widens 7-bit ASCII text (e.g. printf output) into the buffer
+    inline void AppendAscii(const char* str, size_t count) {
+        wchar_t* out = Reserve(count);
+        for (size_t i = 0; i < count; ++i) out[i] = static_cast<wchar_t>(static_cast<unsigned char>(str[i]));
+        length += count;
+    }
+
+    // Inserts count copies of ch at position, shifting the characters after it
+    inline void Insert(size_t position, size_t count, wchar_t ch) {
+        Reserve(count);
+        std::char_traits<wchar_t>::move(data + position + count, data + position, length - position);
+        std::char_traits<wchar_t>::assign(data + position, count, ch);
+        length += count;
+    }
+
+private:
+    void Grow(size_t extra) {
+        const size_t maxCapacity = SIZE_MAX / sizeof(wchar_t) - 1;
+        if (extra > maxCapacity - length) {
+            throw std::runtime_error("String too long");
+        }
+
+        size_t required = length + extra;
+        size_t newCapacity = capacity < maxCapacity / 2 ? capacity * 2 : maxCapacity;
+        if (newCapacity < required) newCapacity = required;
+
+        wchar_t* newData = nullptr;
+        if (data == inlineData) newData = TakeCachedBlock(newCapacity, newCapacity);
+        if (!newData) newData = new wchar_t[newCapacity + 1];
+        std::char_traits<wchar_t>::copy(newData, data, length);
+        if (data != inlineData) delete[] data;
+        data = newData;
+        capacity = newCapacity;
+    }
+
+    wchar_t* data;                                      // inlineData or a heap block
+    size_t length;                                      // Characters in use
+    size_t capacity;                                    // Usable characters, excluding the terminator slot
+    wchar_t inlineData[DEBUG_INLINE_BUFFER_SIZE + 1];
+};
+
+/**
+ * @class FieldBuffer
+ * @brief The encoded DebugStream::With() fields of a statement.
+ *
+ * Like WideBuffer, the first DEBUG_INLINE_FIELD_SIZE bytes are stored inside the
+ * object. The storage is 8-byte aligned, as the field entries are.
+ */
+class FieldBuffer {
+public:
+    FieldBuffer() : data(reinterpret_cast<char*>(inlineData)), size(0), capacity(sizeof(inlineData)) {}
+
+    FieldBuffer(const FieldBuffer& other) : data(reinterpret_cast<char*>(inlineData)), size(0), capacity(sizeof(inlineData)) {
+        Append(other.data, other.size);
+    }
+
+    FieldBuffer& operator=(const FieldBuffer& other) {
+        if (this != &other) {
+            size = 0;
+            Append(other.data, other.size);
+        }
+        return *this;
+    }
+
+    ~FieldBuffer() {
+        if (data != reinterpret_cast<char*>(inlineData)) delete[] reinterpret_cast<unsigned long long*>(data);
+    }
+
+    // Takes the contents of other and leaves it empty, without allocating, like WideBuffer
+    inline void TakeFrom(FieldBuffer& other) {
+        if (this == &other) return;
+        if (data != reinterpret_cast<char*>(inlineData)) delete[] reinterpret_cast<unsigned long long*>(data);
+        if (other.data == reinterpret_cast<char*>(other.inlineData)) {
+            data = reinterpret_cast<char*>(inlineData);
+            capacity = sizeof(inlineData);
+            memcpy(inlineData, other.inlineData, other.size);
+        } else {
+            data = other.data;
+            capacity = other.capacity;
+            other.data = reinterpret_cast<char*>(other.inlineData);
+            other.capacity = sizeof(other.inlineData);
+        }
+        size = other.size;
+        other.size = 0;
+    }
+
+    inline size_t Size() const { return size; }
+    inline const char* Data() const { return data; }
+    inline void Clear() { size = 0; }
+
+    // Makes room for count bytes at the end; call Commit() once they are written
+    inline char* Reserve(size_t count) {
+        if (count > capacity - size) Grow(count);
+        return data + size;
+    }
+
+    inline void Commit(size_t count) { size += count; }
+
+    inline void Append(const char* bytes, size_t count) {
+        if (count == 0) return;
+        memcpy(Reserve(count), bytes, count);
+        size += count;
+    }
+
+private:
+    void Grow(size_t extra) {
+        if (extra > SIZE_MAX / 4 - size) {
+            throw std::runtime_error("Fields too long");
+        }
+
+        size_t newCapacity = capacity * 2 > size + extra ? capacity * 2 : size + extra;
+        newCapacity = (newCapacity + 7) & ~static_cast<size_t>(7);
+        char* newData = reinterpret_cast<char*>(new unsigned long long[newCapacity / 8]);
+        memcpy(newData, data, size);
+        if (data != reinterpret_cast<char*>(inlineData)) delete[] reinterpret_cast<unsigned long long*>(data);
+        data = newData;
+        capacity = newCapacity;
+    }
+
+    char* data;                                         // inlineData or a heap block
+    size_t size;                                        // Bytes in use
+    size_t capacity;
+    unsigned long long inlineData[DEBUG_INLINE_FIELD_SIZE / 8 + 1];
+};
+
+/**
+ * @struct FormatState
+ * @brief The subset of std::ios_base state that DebugStream formats with.
+ *
+ * Defaults match a freshly constructed std::wostream.
+ */
+struct FormatState {
+    std::ios_base::fmtflags flags;
+    std::streamsize width;
+    std::streamsize precision;
+    wchar_t fill;
+
+    FormatState() : flags(std::ios_base::skipws | std::ios_base::dec), width(0), precision(6), fill(L' ') {}
+};
+
+/**
+ * @brief Pads the text appended since start to the field width, then resets the width.
+ *
+ * Like the standard inserters, the width applies to a single formatted value.
+ *
+ * @param prefix Length of the sign or base prefix, where std::internal inserts the fill.
+ */
+inline void PadField(WideBuffer& buffer, FormatState& state, size_t start, size_t prefix) {
+    size_t written = buffer.Size() - start;
+    if (state.width > 0 && static_cast<size_t>(state.width) > written) {
+        size_t count = static_cast<size_t>(state.width) - written;
+        std::ios_base::fmtflags adjust = state.flags & std::ios_base::adjustfield;
+        if (adjust == std::ios_base::left) {
+            buffer.Append(count, state.fill);
+        } else if (adjust == std::ios_base::internal) {
+            buffer.Insert(start + prefix, count, state.fill);
+        } else {
+            buffer.Insert(start, count, state.fill);
+        }
+    }
+    state.width = 0;
+}
+
+// Appends a string as a single formatted value, honoring the field width
+inline void FormatString(WideBuffer& buffer, FormatState& state, const wchar_t* str, size_t count) {
+    size_t start = buffer.Size();
+    buffer.Append(str, count);
+    PadField(buffer, state, start, 0);
+}
+
+/**
+ * @brief Translates a placeholder spec into the stream state that produces it.
+ *
+ * Every placeholder starts from a fresh FormatState, so no setting carries over to the
+ * next one. As with std::format, numbers are right-aligned and everything else is
+ * left-aligned by default, and bool prints as true or false. Centering is not a stream
+ * setting, so the width is left to PadCenter() for '^'.
+ */
+inline FormatState SpecState(const FormatSpec& spec, int kind) {
+    typedef std::ios_base Base;
+    FormatState state;
+    bool numeric = kind == FormatKindInteger || kind == FormatKindFloat || kind == FormatKindPointer;
+    Base::fmtflags adjust = numeric ? Base::right : Base::left;
+    state.fill = spec.fill;
+    state.width = spec.align == L'^' ? 0 : spec.width;
+    if (spec.align == L'<') {
+        adjust = Base::left;
+    } else if (spec.align == L'>') {
+        adjust = Base::right;
+    } else if (spec.align == 0 && spec.zero && numeric) {
+        state.fill = L'0';
+        adjust = Base::internal;
+    }
+    state.flags = (state.flags & ~Base::adjustfield) | adjust;
+    if (spec.precision >= 0) state.precision = spec.precision;
+    if (spec.sign == L'+') state.flags |= Base::showpos;
+    if (spec.alternate) state.flags |= kind == FormatKindFloat ? Base::showpoint : Base::showbase;
+    if (kind == FormatKindBool) state.flags |= Base::boolalpha;
+
+    switch (spec.type) {
+    case L'X': state.flags |= Base::uppercase; // Fall through
+    case L'x': state.flags = (state.flags & ~Base::basefield) | Base::hex; break;
+    case L'o': state.flags = (state.flags & ~Base::basefield) | Base::oct; break;
+    case L'F': state.flags |= Base::uppercase; // Fall through
+    case L'f': state.flags |= Base::fixed; break;
+    case L'E': state.flags |= Base::uppercase; // Fall through
+    case L'e': state.flags |= Base::scientific; break;
+    case L'G': state.flags |= Base::uppercase; break;
+    case L'A': state.flags |= Base::uppercase; // Fall through
+    case L'a': state.flags |= Base::fixed | Base::scientific; break;
+    }
+    return state;
+}
+
+// Centers the text appended since start in a field of the given width
+inline void PadCenter(WideBuffer& buffer, size_t start, int width, wchar_t fill) {
+    size_t written = buffer.Size() - start;
+    if (width > 0 && static_cast<size_t>(width) > written) {
+        size_t count = static_cast<size_t>(width) - written;
+        buffer.Insert(start, count / 2, fill);
+        buffer.Append(count - count / 2, fill);
+    }
+}
+
+/**
+ * @struct NarrowText
+ * @brief A narrow string of known length, formatted like std::string.
+ */
+struct NarrowText {
+    const char* data;
+    size_t size;
+
+    NarrowText(const char* text, size_t length) : data(text), size(length) {}
+};
+
+/**
+ * @struct WideText
+ * @brief A wide string of known length, formatted like std::wstring.
+ */
+struct WideText {
+    const wchar_t* data;
+    size_t size;
+
+    WideText(const wchar_t* text, size_t length) : data(text), size(length) {}
+};
+
+template<> struct FormatKindOf<NarrowText> { enum { Value = FormatKindString }; };
+template<> struct FormatKindOf<WideText> { enum { Value = FormatKindString }; };
+
+/**
+ * @brief Writes the decimal digits of value backwards from end, two at a time.
+ *
+ * The caller picks the narrowest UInt that holds the value, since a 64-bit division is
+ * a library call on 32-bit targets.
+ *
+ * @return The first digit written.
+ */
+template<typename UInt>
+inline wchar_t* WriteDecimal(wchar_t* end, UInt value) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    while (value >= 100) {
+        const char* pair = pairs + static_cast<unsigned int>(value % 100) * 2;
+        value /= 100;
+        *--end = static_cast<wchar_t>(pair[1]);
+        *--end = static_cast<wchar_t>(pair[0]);
+    }
+    if (value >= 10) {
+        const char* pair = pairs + static_cast<unsigned int>(value) * 2;
+        *--end = static_cast<wchar_t>(pair[1]);
+        *--end = static_cast<wchar_t>(pair[0]);
+    } else {
+        *--end = static_cast<wchar_t>(L'0' + static_cast<unsigned int>(value));
+    }
+    return end;
+}
+
+/**
+ * @brief Formats an integer the way std::num_put does.
+ *
+ * Honors dec/hex/oct, showbase, showpos, uppercase and the field width.
+ *
+ * @param magnitude Absolute value for decimal output, or the bit pattern in the unsigned
+ * type of the same width for hex/oct output.
+ * @param negative Whether a minus sign is written.
+ * @param isSigned Whether the source type is signed, which makes showpos apply.
+ */
+inline void FormatInteger(WideBuffer& buffer, FormatState& state, unsigned long long magnitude, bool negative, bool isSigned) {
+    wchar_t digits[3 * sizeof(unsigned long long) + 1];
+    wchar_t* end = digits + sizeof(digits) / sizeof(digits[0]);
+    wchar_t* first = end;
+
+    std::ios_base::fmtflags base = state.flags & std::ios_base::basefield;
+    bool upper = (state.flags & std::ios_base::uppercase) != 0;
+    bool showbase = (state.flags & std::ios_base::showbase) != 0;
+
+    wchar_t prefix[2];
+    size_t prefixLength = 0;
+
+    if (base == std::ios_base::hex) {
+        const wchar_t* table = upper ? L"0123456789ABCDEF" : L"0123456789abcdef";
+        if (showbase && magnitude != 0) {
+            prefix[prefixLength++] = L'0';
+            prefix[prefixLength++] = upper ? L'X' : L'x';
+        }
+        do { *--first = table[magnitude & 0xF]; magnitude >>= 4; } while (magnitude);
+    } else if (base == std::ios_base::oct) {
+        if (showbase && magnitude != 0) prefix[prefixLength++] = L'0';
+        do { *--first = static_cast<wchar_t>(L'0' + (magnitude & 7)); magnitude >>= 3; } while (magnitude);
+    } else {
+        if (negative) {
+            prefix[prefixLength++] = L'-';
+        } else if (isSigned && (state.flags & std::ios_base::showpos)) {
+            prefix[prefixLength++] = L'+';
+        }
+        if (magnitude <= 0xFFFFFFFFULL) {
+            first = WriteDecimal(end, static_cast<unsigned int>(magnitude));
+        } else {
+            first = WriteDecimal(end, magnitude);
+        }
+    }
+
+    size_t start = buffer.Size();
+    buffer.Append(prefix, prefixLength);
+    buffer.Append(first, static_cast<size_t>(end - first));
+    PadField(buffer, state, start, prefixLength);
+}
+
+template<typename Unsigned, typename Signed>
+inline void FormatSigned(WideBuffer& buffer, FormatState& state, Signed value) {
+    std::ios_base::fmtflags base = state.flags & std::ios_base::basefield;
+    if (base == std::ios_base::hex || base == std::ios_base::oct) {
+        // Non-decimal output prints the two's complement bit pattern, as printf does
+        FormatInteger(buffer, state, static_cast<Unsigned>(value), false, true);
+    } else if (value < 0) {
+        FormatInteger(buffer, state, 0ULL - static_cast<unsigned long long>(value), true, true);
+    } else {
+        FormatInteger(buffer, state, static_cast<unsigned long long>(value), false, true);
+    }
+}
+
+#if defined(DEBUG_HAS_TO_CHARS)
+/**
+ * @brief Formats a finite value in decimal with std::to_chars.
+ *
+ * Produces exactly what snprintf does with the same precision. Returns false, having
+ * written nothing, for what to_chars does not cover: hexfloat and showpoint, which
+ * differ in layout, infinities and NaNs, whose spelling differs between C libraries,
+ * and results that do not fit the stack buffer.
+ */
+template<typename Float>
+inline bool FormatFloatFast(WideBuffer& buffer, FormatState& state, Float value) {
+    std::ios_base::fmtflags floatfield = state.flags & std::ios_base::floatfield;
+    if (floatfield == (std::ios_base::fixed | std::ios_base::scientific) || (state.flags & std::ios_base::showpoint) ||
+        !(value - value == value - value)) {
+        return false;
+    }
+
+    std::chars_format format = floatfield == std::ios_base::fixed ? std::chars_format::fixed :
+                               floatfield == std::ios_base::scientific ? std::chars_format::scientific :
+                               std::chars_format::general;
+    int precision = state.precision < 0 ? 6 : (state.precision > 1000 ? 1000 : static_cast<int>(state.precision));
+
+    char text[128];
+    char* first = text + 1;
+    std::to_chars_result result = std::to_chars(first, text + sizeof(text), value, format, precision);
+    if (result.ec != std::errc()) return false;
+    if (*first != '-' && (state.flags & std::ios_base::showpos)) *--first = '+';
+    if (state.flags & std::ios_base::uppercase) {
+        for (char* p = first; p != result.ptr; ++p) {
+            if (*p == 'e') *p = 'E';
+        }
+    }
+
+    size_t start = buffer.Size();
+    buffer.AppendAscii(first, static_cast<size_t>(result.ptr - first));
+    PadField(buffer, state, start, (*first == '-' || *first == '+') ? 1 : 0);
+    return true;
+}
+#endif
+
+// printf length modifier for the floating point type being formatted
+inline void AppendLengthModifier(char*&, double) {}
+inline void AppendLengthModifier(char*& spec, long double) { *spec++ = 'L'; }
+
+/**
+ * @brief Formats a floating point value the way std::num_put does.
+ *
+ * Honors fixed/scientific/hexfloat, precision, showpoint, showpos, uppercase and the
+ * field width. The digits are produced into a stack buffer by std::to_chars where the
+ * library has it, which gives the same digits as snprintf without parsing a format
+ * string or consulting the C locale, and by snprintf otherwise.
+ *
+ * @tparam Float double or long double.
+ */
+template<typename Float>
+inline void FormatFloat(WideBuffer& buffer, FormatState& state, Float value) {
+#if defined(DEBUG_HAS_TO_CHARS)
+    if (FormatFloatFast(buffer, state, value)) return;
+#endif
+    char spec[16];
+    char* p = spec;
+    *p++ = '%';
+    if (state.flags & std::ios_base::showpos) *p++ = '+';
+    if (state.flags & std::ios_base::showpoint) *p++ = '#';
+
+    std::ios_base::fmtflags floatfield = state.flags & std::ios_base::floatfield;
+    bool hexfloat = floatfield == (std::ios_base::fixed | std::ios_base::scientific);
+    if (!hexfloat) {
+        *p++ = '.';
+        *p++ = '*';
+    }
+    AppendLengthModifier(p, value);
+
+    bool upper = (state.flags & std::ios_base::uppercase) != 0;
+    if (hexfloat) *p++ = upper ? 'A' : 'a';
+    else if (floatfield == std::ios_base::fixed) *p++ = upper ? 'F' : 'f';
+    else if (floatfield == std::ios_base::scientific) *p++ = upper ? 'E' : 'e';
+    else *p++ = upper ? 'G' : 'g';
+    *p = '\0';
+
+    int precision = state.precision < 0 ? 6 : (state.precision > 1000 ? 1000 : static_cast<int>(state.precision));
+
+    char text[128];
+    int count = hexfloat ? std::snprintf(text, sizeof(text), spec, value)
+                         : std::snprintf(text, sizeof(text), spec, precision, value);
+    if (count < 0) return;
+
+    size_t start = buffer.Size();
+    if (static_cast<size_t>(count) < sizeof(text)) {
+        buffer.AppendAscii(text, static_cast<size_t>(count));
+    } else {
+        // Only fixed notation with very large values or precision gets here
+        std::string large(static_cast<size_t>(count) + 1, '\0');
+        if (hexfloat) std::snprintf(&large[0], large.size(), spec, value);
+        else std::snprintf(&large[0], large.size(), spec, precision, value);
+        buffer.AppendAscii(large.c_str(), static_cast<size_t>(count));
+    }
+
+    size_t prefix = (text[0] == '-' || text[0] == '+') ? 1 : 0;
+    if (hexfloat) prefix += 2;  // "0x"
+    PadField(buffer, state, start, prefix);
+}
+
+/**
+ * @brief Converts one row of 16 bytes to 32 hex digits and 16 printable characters.
+ *
+ * With SSE2, all 16 bytes are split into nibbles at once; SSSE3 then looks the digits
+ * up with one shuffle per nibble, and plain SSE2 adds the offset to 'A' where a nibble
+ * is above 9. Bytes outside 0x20-0x7E become '.'.
+ */
+inline void HexRowChars(const unsigned char* bytes, char* digits, char* text) {
+#if defined(DEBUG_HAS_SSE2)
+    __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(data, 4), nibbleMask);
+    __m128i low = _mm_and_si128(data, nibbleMask);
+#if defined(DEBUG_HAS_SSSE3)
+    const __m128i table = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    high = _mm_shuffle_epi8(table, high);
+    low = _mm_shuffle_epi8(table, low);
+#else
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zeroChar = _mm_set1_epi8('0');
+    const __m128i letterOffset = _mm_set1_epi8('A' - '0' - 10);
+    high = _mm_add_epi8(_mm_add_epi8(high, zeroChar), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letterOffset));
+    low = _mm_add_epi8(_mm_add_epi8(low, zeroChar), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letterOffset));
+#endif
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(digits), _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(digits + 16), _mm_unpackhi_epi8(high, low));
+
+    // Signed compares: bytes of 0x80 and above are negative and fail the first one
+    __m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8(0x7F)),
+                                         _mm_cmpgt_epi8(data, _mm_set1_epi8(0x1F)));
+    __m128i shown = _mm_or_si128(_mm_and_si128(printable, data), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(text), shown);
+#else
+    for (size_t i = 0; i < 16; ++i) {
+        digits[2 * i] = "0123456789ABCDEF"[bytes[i] >> 4];
+        digits[2 * i + 1] = "0123456789ABCDEF"[bytes[i] & 0xF];
+        text[i] = bytes[i] >= 0x20 && bytes[i] < 0x7F ? static_cast<char>(bytes[i]) : '.';
+    }
+#endif
+}
+
+/**
+ * @brief Helpers that append a hex dump to a buffer; see DebugHex().
+ *
+ * Space for the rows is reserved up front and the rows are written straight into it.
+ * Offsets have 8 digits, or 16 if the dump is larger than 4 GB. HexDumpRows() throws
+ * std::invalid_argument if the data pointer is null and the size is not 0.
+ */
+inline size_t HexDumpRows(const DebugHexDump& dump) {
+    if (!dump.data && dump.size) {
+        throw std::invalid_argument("Null hex dump pointer");
+    }
+    size_t rows = dump.size / 16 + (dump.size % 16 != 0);
+    return dump.maxRows && rows > dump.maxRows ? dump.maxRows : rows;
+}
+
+// Appends rows firstRow to endRow - 1 of a dump
+inline void FormatHexRows(WideBuffer& buffer, const DebugHexDump& dump, size_t firstRow, size_t endRow) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(dump.data);
+    size_t endOffset = endRow * 16 < dump.size ? endRow * 16 : dump.size;
+    size_t offsetDigits = static_cast<unsigned long long>(dump.size) > 0x100000000ULL ? 16 : 8;
+
+    // Offset, 2 spaces, 16 hex bytes with a space each and one more after 8, a space,
+    // 16 characters between bars and a newline
+    const size_t rowLength = offsetDigits + 2 + 16 * 3 + 1 + 1 + 18 + 1;
+    wchar_t* out = buffer.Reserve((endRow - firstRow) * rowLength);
+    wchar_t* start = out;
+
+    for (size_t offset = firstRow * 16; offset < endOffset; offset += 16) {
+        size_t count = endOffset - offset < 16 ? endOffset - offset : 16;
+        unsigned char last[16];
+        const unsigned char* row = bytes + offset;
+        if (count < 16) {
+            // Never read past the end of the data
+            std::memset(last, 0, sizeof(last));
+            std::memcpy(last, row, count);
+            row = last;
+        }
+        char digits[32];
+        char text[16];
+        HexRowChars(row, digits, text);
+
+        for (size_t i = offsetDigits; i > 0; --i) {
+            *out++ = L"0123456789ABCDEF"[(offset >> (4 * (i - 1))) & 0xF];
+        }
+        *out++ = L' ';
+        for (size_t i = 0; i < 16; ++i) {
+            if (i % 8 == 0) *out++ = L' ';
+            if (i < count) {
+                *out++ = static_cast<wchar_t>(digits[2 * i]);
+                *out++ = static_cast<wchar_t>(digits[2 * i + 1]);
+            } else {
+                *out++ = L' ';
+                *out++ = L' ';
+            }
+            *out++ = L' ';
+        }
+        *out++ = L' ';
+        *out++ = L'|';
+        for (size_t i = 0; i < count; ++i) *out++ = static_cast<wchar_t>(text[i]);
+        *out++ = L'|';
+        *out++ = L'\n';
+    }
+    buffer.Commit(static_cast<size_t>(out - start));
+}
+
+// Appends "... N more bytes" if the row limit left bytes out
+inline void FormatHexOmitted(WideBuffer& buffer, const DebugHexDump& dump) {
+    size_t shownSize = HexDumpRows(dump) * 16;
+    if (shownSize >= dump.size) return;
+
+    unsigned long long left = dump.size - shownSize;
+    wchar_t number[24];
+    size_t length = 0;
+    do {
+        number[length++] = static_cast<wchar_t>(L'0' + left % 10);
+        left /= 10;
+    } while (left);
+    static const wchar_t suffix[] = L" more bytes\n";
+    buffer.Append(L"... ", 4);
+    while (length) buffer.Append(number[--length]);
+    buffer.Append(suffix, sizeof(suffix) / sizeof(wchar_t) - 1);
+}
+
+inline void FormatHexDump(WideBuffer& buffer, const DebugHexDump& dump) {
+    FormatHexRows(buffer, dump, 0, HexDumpRows(dump));
+    FormatHexOmitted(buffer, dump);
+}
+
+// Formats a pointer like the Microsoft C++ library: uppercase hex digits padded to the pointer width
+inline void FormatPointer(WideBuffer& buffer, FormatState& state, const void* value) {
+    wchar_t digits[2 * sizeof(void*)];
+    ULONG_PTR bits = reinterpret_cast<ULONG_PTR>(value);
+    for (size_t i = sizeof(digits) / sizeof(digits[0]); i > 0; --i) {
+        digits[i - 1] = L"0123456789ABCDEF"[bits & 0xF];
+        bits >>= 4;
+    }
+    FormatString(buffer, state, digits, sizeof(digits) / sizeof(digits[0]));
+}
+
+/**
+ * @struct ErrorMessage
+ * @brief The system message of one error code, allocated as one block with its text.
+ *
+ * The text follows the structure, without a terminator. Messages are never freed.
+ */
+struct ErrorMessage {
+    DWORD code;
+    size_t length;                      // 0 if the system has no message for the code
+};
+
+inline const wchar_t* ErrorMessageText(const ErrorMessage* message) {
+    return reinterpret_cast<const wchar_t*>(message + 1);
+}
+
+/**
+ * @struct ErrorCacheState
+ * @brief The messages remembered by ErrorMessageFor(), in an open-addressed hash table.
+ *
+ * Zero-initialized static storage like SinkState. A slot is set once and then only read,
+ * so a lookup takes no lock.
+ */
+struct ErrorCacheState {
+    PVOID volatile slots[DEBUG_ERROR_CACHE_SIZE];
+};
+
+inline ErrorCacheState& GetErrorCacheState() {
+    static ErrorCacheState state;
+    return state;
+}
+
+// Writes the system message of code into text, without the trailing line break, and
+// returns its length; 0 if there is none or it does not fit. Keeps the last error.
+inline size_t LoadErrorMessage(DWORD code, wchar_t* text, DWORD capacity) {
+    DWORD lastError = GetLastError();
+    DWORD length = FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr, code, 0, text, capacity, nullptr);
+    while (length > 0 && (text[length - 1] == L'\r' || text[length - 1] == L'\n' || text[length - 1] == L' ')) --length;
+    SetLastError(lastError);
+    return length;
+}
+
+// Returns nullptr if the message cannot be allocated
+inline ErrorMessage* CreateErrorMessage(DWORD code) {
+    wchar_t text[1024];
+    size_t length = LoadErrorMessage(code, text, sizeof(text) / sizeof(text[0]));
+    void* block = ::operator new(sizeof(ErrorMessage) + length * sizeof(wchar_t), std::nothrow);
+    if (!block) return nullptr;
+
+    ErrorMessage* message = static_cast<ErrorMessage*>(block);
+    message->code = code;
+    message->length = length;
+    std::char_traits<wchar_t>::copy(reinterpret_cast<wchar_t*>(message + 1), text, length);
+    return message;
+}
+
+/**
+ * @brief Returns the remembered message of an error code, loading it on first use.
+ *
+ * Threads that miss the same code at the same time may each call FormatMessageW, but
+ * only one message is kept. Returns nullptr if the table is full or out of memory.
+ */
+inline const ErrorMessage* ErrorMessageFor(DWORD code) {
+    ErrorCacheState& cache = GetErrorCacheState();
+    size_t first = static_cast<size_t>(code * 2654435761u) % DEBUG_ERROR_CACHE_SIZE;
+    ErrorMessage* created = nullptr;
+    for (size_t probe = 0; probe < DEBUG_ERROR_CACHE_SIZE; ++probe) {
+        PVOID volatile* slot = &cache.slots[(first + probe) % DEBUG_ERROR_CACHE_SIZE];
+        ErrorMessage* message = static_cast<ErrorMessage*>(ReadPointerAcquire(slot));
+        if (!message) {
+            if (!created) created = CreateErrorMessage(code);
+            if (!created) return nullptr;
+            message = static_cast<ErrorMessage*>(InterlockedCompareExchangePointer(slot, created, nullptr));
+            if (!message) return created;
+        }
+        if (message->code == code) {
+            ::operator delete(created);
+            return message;
+        }
+    }
+    ::operator delete(created);
+    return nullptr;
+}
+
+/**
+ * @brief Appends an error code and its message as a single formatted value.
+ *
+ * The code ignores the stream's base and fill, so that hex output set earlier in the
+ * statement does not change how an error reads; the field width applies to the whole.
+ */
+inline void FormatErrorCode(WideBuffer& buffer, FormatState& state, const DebugErrorCode& error) {
+    size_t start = buffer.Size();
+    FormatState digits;
+    if (error.isHresult) {
+        buffer.Append(L"0x", 2);
+        digits.flags = std::ios_base::hex | std::ios_base::uppercase;
+        digits.width = 8;
+        digits.fill = L'0';
+    }
+    FormatInteger(buffer, digits, error.code, false, false);
+
+    wchar_t text[1024];
+    const wchar_t* messageText = text;
+    size_t length;
+    if (const ErrorMessage* message = ErrorMessageFor(error.code)) {
+        messageText = ErrorMessageText(message);
+        length = message->length;
+    } else {
+        length = LoadErrorMessage(error.code, text, sizeof(text) / sizeof(text[0]));
+    }
+    if (length) {
+        buffer.Append(L" (", 2);
+        buffer.Append(messageText, length);
+        buffer.Append(L')');
+    }
+    PadField(buffer, state, start, 0);
+}
+
+/**
+ * @brief Widens the leading 7-bit ASCII run of str and appends it to buffer.
+ *
+ * ASCII is encoded identically in UTF-8 and UTF-16, so the run can be zero-extended
+ * without calling MultiByteToWideChar. 16 or 32 bytes are processed per step with
+ * SSE2 or AVX2 when available.
+ *
+ * @return The number of characters appended, which is where the first non-ASCII byte is.
+ */
+inline size_t WidenAscii(WideBuffer& buffer, const char* str, size_t count) {
+    wchar_t* out = buffer.Reserve(count);
+    size_t i = 0;
+
+#if defined(DEBUG_HAS_AVX2)
+    for (; i + 32 <= count; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i));
+        if (_mm256_movemask_epi8(bytes) != 0) break;
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+    }
+#endif
+#if defined(DEBUG_HAS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+        if (_mm_movemask_epi8(bytes) != 0) break;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+    }
+#endif
+    for (; i < count; ++i) {
+        unsigned char ch = static_cast<unsigned char>(str[i]);
+        if (ch >= 0x80) break;
+        out[i] = static_cast<wchar_t>(ch);
+    }
+
+    buffer.Commit(i);
+    return i;
+}
+
+/**
+ * @brief Converts count bytes of narrow text in DEBUG_CODE_PAGE and appends them to buffer.
+ *
+ * The text is converted in a single MultiByteToWideChar call straight into the buffer.
+ * No Windows code page produces more UTF-16 code units than input bytes, so reserving
+ * count characters is enough; the length is queried and the call retried only if the
+ * conversion still reports an insufficient buffer. With CP_UTF8, pure ASCII text is
+ * widened by WidenAscii() without calling the Win32 API at all.
+ *
+ * @throws std::runtime_error If the conversion fails or the string is too long.
+ */
+inline void AppendNarrow(WideBuffer& buffer, const char* str, size_t count) {
+#if DEBUG_CODE_PAGE == CP_UTF8
+    // ASCII bytes never occur inside a multi-byte UTF-8 sequence, so splitting here is safe
+    size_t ascii = WidenAscii(buffer, str, count);
+    str += ascii;
+    count -= ascii;
+#endif
+    if (count == 0) return;
+
+    if (count > static_cast<size_t>(INT_MAX)) {
+        throw std::runtime_error("String too long");
+    }
+
+    int length = static_cast<int>(count);
+    int written = MultiByteToWideChar(DEBUG_CODE_PAGE, 0, str, length, buffer.Reserve(count), length);
+    if (written == 0) {
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            throw std::runtime_error("Failed to convert string to wide string.");
+        }
+
+        int required = MultiByteToWideChar(DEBUG_CODE_PAGE, 0, str, length, nullptr, 0);
+        if (required <= 0) {
+            throw std::runtime_error("Failed to convert string to wide string.");
+        }
+
+        written = MultiByteToWideChar(DEBUG_CODE_PAGE, 0, str, length, buffer.Reserve(required), required);
+        if (written == 0) {
+            throw std::runtime_error("Failed to convert string to wide string.");
+        }
+    }
+    buffer.Commit(static_cast<size_t>(written));
+}
+
+/**
+ * @brief Applies a standard std::ios_base manipulator (std::hex, std::boolalpha, ...) to state.
+ *
+ * @return false if manip is not a standard manipulator.
+ */
+inline bool ApplyManipulator(FormatState& state, std::ios_base& (*manip)(std::ios_base&)) {
+    typedef std::ios_base Base;
+    struct Entry {
+        std::ios_base& (*function)(std::ios_base&);
+        Base::fmtflags set;
+        Base::fmtflags mask;
+    };
+    static const Entry table[] = {
+        { &std::dec, Base::dec, Base::basefield },
+        { &std::hex, Base::hex, Base::basefield },
+        { &std::oct, Base::oct, Base::basefield },
+        { &std::fixed, Base::fixed, Base::floatfield },
+        { &std::scientific, Base::scientific, Base::floatfield },
+#if defined(DEBUG_HAS_CPP11)
+        { &std::hexfloat, Base::fixed | Base::scientific, Base::floatfield },
+        { &std::defaultfloat, Base::fmtflags(0), Base::floatfield },
+#endif
+        { &std::left, Base::left, Base::adjustfield },
+        { &std::right, Base::right, Base::adjustfield },
+        { &std::internal, Base::internal, Base::adjustfield },
+        { &std::boolalpha, Base::boolalpha, Base::boolalpha },
+        { &std::noboolalpha, Base::fmtflags(0), Base::boolalpha },
+        { &std::showbase, Base::showbase, Base::showbase },
+        { &std::noshowbase, Base::fmtflags(0), Base::showbase },
+        { &std::showpoint, Base::showpoint, Base::showpoint },
+        { &std::noshowpoint, Base::fmtflags(0), Base::showpoint },
+        { &std::showpos, Base::showpos, Base::showpos },
+        { &std::noshowpos, Base::fmtflags(0), Base::showpos },
+        { &std::uppercase, Base::uppercase, Base::uppercase },
+        { &std::nouppercase, Base::fmtflags(0), Base::uppercase },
+        { &std::skipws, Base::skipws, Base::skipws },
+        { &std::noskipws, Base::fmtflags(0), Base::skipws },
+        { &std::unitbuf, Base::unitbuf, Base::unitbuf },
+        { &std::nounitbuf, Base::fmtflags(0), Base::unitbuf },
+    };
+
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+        if (table[i].function == manip) {
+            state.flags = (state.flags & ~table[i].mask) | table[i].set;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @class BufferStreamBuf
+ * @brief A stream buffer that appends everything written to it to a WideBuffer.
+ */
+class BufferStreamBuf : public std::basic_streambuf<wchar_t> {
+public:
+    explicit BufferStreamBuf(WideBuffer& target) : target(&target) {}
+
+    inline void Retarget(WideBuffer& newTarget) { target = &newTarget; }
+
+protected:
+    virtual int_type overflow(int_type ch) {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            target->Append(traits_type::to_char_type(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    virtual std::streamsize xsputn(const wchar_t* str, std::streamsize count) {
+        target->Append(str, static_cast<size_t>(count));
+        return count;
+    }
+
+private:
+    WideBuffer* target;
+};
+
+/**
+ * @struct AdapterStream
+ * @brief A std::wostream that writes into a WideBuffer.
+ *
+ * Used for values DebugStream does not format itself: user types with an
+ * operator<<(std::wostream&, ...) and manipulators that take arguments, such as
+ * std::setw or std::setfill.
+ */
+struct AdapterStream {
+    BufferStreamBuf streamBuf;
+    std::basic_ostream<wchar_t> stream;
+
+    explicit AdapterStream(WideBuffer& target) : streamBuf(target), stream(&streamBuf) {}
+};
+
+// Borrows the thread's cached adapter stream, or creates one if it is in use or missing
+inline AdapterStream* AcquireAdapter(WideBuffer& target) {
+    ThreadCache* cache = GetThreadCache();
+    if (!cache || !cache->adapter) return new AdapterStream(target);
+
+    AdapterStream* adapter = cache->adapter;
+    cache->adapter = nullptr;
+    adapter->streamBuf.Retarget(target);
+    return adapter;
+}
+
+inline void ReleaseAdapter(AdapterStream* adapter) {
+    if (!adapter) return;
+
+    ThreadCache* cache = GetThreadCache();
+    if (cache && !cache->adapter) {
+        cache->adapter = adapter;
+    } else {
+        delete adapter;
+    }
+}
+
+inline void NTAPI FreeThreadCache(PVOID data) {
+    ThreadCache* cache = static_cast<ThreadCache*>(data);
+    if (!cache) return;
+
+    delete[] cache->block;
+    delete cache->adapter;
+    if (cache->deferredRing) {
+        // Queued records are still written; the ring itself is reused by another thread
+        InterlockedExchange(&cache->deferredRing->owned, 0);
+    }
+    delete cache;
+}
+
+/**
+ * @struct DeferredRecord
+ * @brief Header of one DebugDeferred() statement in a DeferredRing.
+ *
+ * It is followed by argumentCount DeferredArgument entries. Records and arguments
+ * start at multiples of 8 bytes, so the header never straddles the end of the ring,
+ * and the first 8 bytes are enough to recognize padding.
+ */
+struct DeferredRecord {
+    unsigned int size;                  // Bytes including this header and its arguments
+    unsigned int argumentCount;         // DeferredPadding for the unused space at the end of the ring
+    const wchar_t* format;              // The format string, which must outlive the record
+};
+
+struct DeferredArgument {
+    unsigned int tag;                   // DeferredTag of the captured value
+    unsigned int size;                  // Bytes of payload following this entry
+};
+
+// Captured arguments and With() fields are stored the same way, with the same type codes
+enum DeferredTag {
+    DeferredBool = DebugFieldBool,
+    DeferredChar = DebugFieldChar,
+    DeferredWChar = DebugFieldWChar,
+    DeferredSChar = DebugFieldSChar,
+    DeferredUChar = DebugFieldUChar,
+    DeferredShort = DebugFieldShort,
+    DeferredUShort = DebugFieldUShort,
+    DeferredInt = DebugFieldInt,
+    DeferredUInt = DebugFieldUInt,
+    DeferredLong = DebugFieldLong,
+    DeferredULong = DebugFieldULong,
+    DeferredLongLong = DebugFieldLongLong,
+    DeferredULongLong = DebugFieldULongLong,
+    DeferredFloat = DebugFieldFloat,
+    DeferredDouble = DebugFieldDouble,
+    DeferredLongDouble = DebugFieldLongDouble,
+    DeferredPointer = DebugFieldPointer,
+    DeferredNarrowString = DebugFieldNarrowString,
+    DeferredWideString = DebugFieldWideString
+};
+
+const unsigned int DeferredPadding = UINT_MAX;
+
+inline size_t DeferredAlign(size_t size) {
+    return (size + 7) & ~static_cast<size_t>(7);
+}
+
+const size_t DeferredRecordHeaderSize = (sizeof(DeferredRecord) + 7) & ~static_cast<size_t>(7);
+
+struct DeferredState {
+    PVOID volatile rings;               // DeferredRing list, only ever prepended to
+    SRWLOCK drainLock;                  // Held by the single reader of the rings
+};
+
+inline DeferredState& GetDeferredState() {
+    static DeferredState state;
+    return state;
+}
+
+// Returns the calling thread's ring, claiming a released one or creating a new one
+inline DeferredRing* GetDeferredRing() {
+    ThreadCache* cache = GetThreadCache();
+    if (!cache) return nullptr;
+    if (cache->deferredRing) return cache->deferredRing;
+
+    DeferredState& deferred = GetDeferredState();
+    DeferredRing* ring = static_cast<DeferredRing*>(ReadPointerAcquire(&deferred.rings));
+    for (; ring; ring = ring->next) {
+        if (!ReadNoFence(&ring->owned) && InterlockedCompareExchange(&ring->owned, 1, 0) == 0) break;
+    }
+
+    if (!ring) {
+        size_t size = 64;
+        while (size < DEBUG_DEFERRED_RING_SIZE && size < SIZE_MAX / 4) size <<= 1;
+        ring = new (std::nothrow) DeferredRing();
+        LONG64* data = ring ? new (std::nothrow) LONG64[size / sizeof(LONG64)] : nullptr;
+        if (!data) {
+            delete ring;
+            return nullptr;
+        }
+        ring->owned = 1;
+        ring->mask = size - 1;
+        ring->data = reinterpret_cast<char*>(data);
+
+        PVOID first = ReadPointerNoFence(&deferred.rings);
+        for (;;) {
+            ring->next = static_cast<DeferredRing*>(first);
+            PVOID previous = InterlockedCompareExchangePointer(&deferred.rings, ring, first);
+            if (previous == first) break;
+            first = previous;
+        }
+    }
+
+    cache->deferredRing = ring;
+    return ring;
+}
+
+/**
+ * @brief Reserves size bytes in the owner's ring.
+ *
+ * @return A pointer to the reserved space, or nullptr if the ring is full. Call
+ * DeferredCommit() with the same size once the record is written.
+ */
+inline char* DeferredReserve(DeferredRing& ring, size_t size) {
+    LONG64 head = ReadNoFence64(&ring.head);
+    size_t used = static_cast<size_t>(head - ReadAcquire64(&ring.tail));
+    size_t offset = static_cast<size_t>(head) & ring.mask;
+    size_t contiguous = ring.mask + 1 - offset;
+    size_t needed = contiguous < size ? contiguous + size : size;
+    if (needed > ring.mask + 1 - used) return nullptr;
+
+    if (contiguous < size) {
+        // Records are contiguous: skip the rest of the ring and start over at its beginning
+        DeferredRecord* padding = reinterpret_cast<DeferredRecord*>(ring.data + offset);
+        padding->size = static_cast<unsigned int>(contiguous);
+        padding->argumentCount = DeferredPadding;
+        // Release, so a consumer that sees the new head also sees the padding record
+        WriteRelease64(&ring.head, head + static_cast<LONG64>(contiguous));
+        offset = 0;
+    }
+    return ring.data + offset;
+}
+
+inline void DeferredCommit(DeferredRing& ring, size_t size) {
+    WriteRelease64(&ring.head, ReadNoFence64(&ring.head) + static_cast<LONG64>(size));
+}
+
+inline bool DeferredHasRecords() {
+    DeferredRing* ring = static_cast<DeferredRing*>(ReadPointerAcquire(&GetDeferredState().rings));
+    for (; ring; ring = ring->next) {
+        if (ReadAcquire64(&ring->head) != ReadNoFence64(&ring->tail)) return true;
+    }
+    return false;
+}
+
+// Formats and writes every queued DebugDeferred() record; defined after DebugStream
+inline void DrainDeferred();
+
+/**
+ * @struct QueuedRecord
+ * @brief A copy of a DebugRecord for the output thread, allocated as one block.
+ *
+ * The text follows the structure in the same allocation, and the fields follow the
+ * text at the next multiple of 8 bytes.
+ */
+struct QueuedRecord {
+    DebugRecord record;
+};
+
+// Returns nullptr if the copy cannot be allocated
+inline QueuedRecord* CopyRecord(const DebugRecord& record) {
+    if (record.length > (SIZE_MAX / 2 - sizeof(QueuedRecord)) / sizeof(wchar_t) - 1 || record.fieldsSize > SIZE_MAX / 2) return nullptr;
+
+    size_t fieldsOffset = (sizeof(QueuedRecord) + (record.length + 1) * sizeof(wchar_t) + 7) & ~static_cast<size_t>(7);
+    void* block = ::operator new(fieldsOffset + record.fieldsSize, std::nothrow);
+    if (!block) return nullptr;
+
+    QueuedRecord* queued = static_cast<QueuedRecord*>(block);
+    wchar_t* text = reinterpret_cast<wchar_t*>(queued + 1);
+    std::char_traits<wchar_t>::copy(text, record.text, record.length);
+    text[record.length] = L'\0';
+    queued->record = record;
+    queued->record.text = text;
+    if (record.fieldsSize) {
+        char* fields = static_cast<char*>(block) + fieldsOffset;
+        memcpy(fields, record.fields, record.fieldsSize);
+        queued->record.fields = fields;
+    }
+    return queued;
+}
+
+inline void FreeRecord(QueuedRecord* queued) {
+    ::operator delete(queued);
+}
+
+/**
+ * @struct AsyncSlot
+ * @brief One cell of the asynchronous output queue.
+ *
+ * The sequence number tells producers and the consumer whose turn the cell is, as in
+ * Dmitry Vyukov's bounded MPMC queue.
+ */
+struct AsyncSlot {
+    volatile LONG64 sequence;
+    QueuedRecord* record;
+};
+
+/**
+ * @struct AsyncState
+ * @brief Process-wide state of the asynchronous output thread.
+ *
+ * Zero-initialized static storage, so it needs no constructor and is usable from
+ * static initializers and exit handlers of any translation unit.
+ */
+struct AsyncState {
+    volatile LONG64 enqueuePosition;
+    char enqueuePadding[64 - sizeof(LONG64)];
+    volatile LONG64 dequeuePosition;
+    char dequeuePadding[64 - sizeof(LONG64)];
+    volatile LONG64 dropped;            // Messages discarded by the overflow policy
+    volatile LONG running;              // Nonzero while the output thread accepts messages
+    volatile LONG consumerSleeping;     // Set by the output thread before it waits on wakeEvent
+    volatile LONG policy;               // DebugOverflowPolicy applied when the queue is full
+    AsyncSlot* slots;                   // Allocated on first start and never freed
+    size_t mask;                        // Queue capacity - 1; the capacity is a power of two
+    HANDLE wakeEvent;
+    HANDLE thread;
+    SRWLOCK controlLock;                // Serializes AsyncStart() and AsyncStop()
+    bool exitHandlerRegistered;
+};
+
+inline AsyncState& GetAsyncState() {
+    static AsyncState state;
+    return state;
+}
+
+inline bool AsyncTryPush(AsyncState& async, QueuedRecord* record) {
+    LONG64 position = ReadNoFence64(&async.enqueuePosition);
+    for (;;) {
+        AsyncSlot& slot = async.slots[static_cast<size_t>(position) & async.mask];
+        LONG64 difference = ReadAcquire64(&slot.sequence) - position;
+        if (difference == 0) {
+            LONG64 previous = InterlockedCompareExchange64(&async.enqueuePosition, position + 1, position);
+            if (previous == position) {
+                slot.record = record;
+                WriteRelease64(&slot.sequence, position + 1);
+                return true;
+            }
+            position = previous;
+        } else if (difference < 0) {
+            return false;               // Full: the consumer has not released this cell yet
+        } else {
+            position = ReadNoFence64(&async.enqueuePosition);
+        }
+    }
+}
+
+inline QueuedRecord* AsyncTryPop(AsyncState& async) {
+    LONG64 position = ReadNoFence64(&async.dequeuePosition);
+    for (;;) {
+        AsyncSlot& slot = async.slots[static_cast<size_t>(position) & async.mask];
+        LONG64 difference = ReadAcquire64(&slot.sequence) - (position + 1);
+        if (difference == 0) {
+            LONG64 previous = InterlockedCompareExchange64(&async.dequeuePosition, position + 1, position);
+            if (previous == position) {
+                QueuedRecord* record = slot.record;
+                WriteRelease64(&slot.sequence, position + static_cast<LONG64>(async.mask) + 1);
+                return record;
+            }
+            position = previous;
+        } else if (difference < 0) {
+            return nullptr;             // Empty
+        } else {
+            position = ReadNoFence64(&async.dequeuePosition);
+        }
+    }
+}
+
+inline bool AsyncHasMessages(AsyncState& async) {
+    LONG64 position = ReadAcquire64(&async.dequeuePosition);
+    return ReadAcquire64(&async.slots[static_cast<size_t>(position) & async.mask].sequence) == position + 1;
+}
+
+/**
+ * @struct SinkState
+ * @brief The sinks registered with DebugAddSink().
+ *
+ * Zero-initialized static storage like AsyncState. Writers hold the lock shared, so
+ * DebugRemoveSink() can wait until no thread is inside the removed sink.
+ */
+struct SinkState {
+    DebugSink* sinks[DEBUG_MAX_SINKS];
+    volatile LONG count;
+    volatile LONG defaultRemoved;       // Nonzero after DebugRemoveSink(DebugDefaultSink())
+    SRWLOCK lock;
+};
+
+inline SinkState& GetSinkState() {
+    static SinkState state;
+    return state;
+}
+
+// Identifies the default sink in DebugAddSink() and DebugRemoveSink(). Records are not
+// passed through it, since it is destroyed at exit before the output thread is drained.
+inline DebugOutputSink& GetDefaultSink() {
+    static DebugOutputSink sink;
+    return sink;
+}
+
+// Release an SRW lock even if a sink throws despite being told not to
+struct SharedLockGuard {
+    explicit SharedLockGuard(SRWLOCK& srwLock) : lock(srwLock) { AcquireSRWLockShared(&lock); }
+    ~SharedLockGuard() { ReleaseSRWLockShared(&lock); }
+
+    SRWLOCK& lock;
+
+private:
+    SharedLockGuard& operator=(const SharedLockGuard&);
+};
+
+struct ExclusiveLockGuard {
+    explicit ExclusiveLockGuard(SRWLOCK& srwLock) : lock(srwLock) { AcquireSRWLockExclusive(&lock); }
+    ~ExclusiveLockGuard() { ReleaseSRWLockExclusive(&lock); }
+
+    SRWLOCK& lock;
+
+private:
+    ExclusiveLockGuard& operator=(const ExclusiveLockGuard&);
+};
+
+// Calls every sink with a record
+inline void DispatchOutput(const DebugRecord& record) {
+    SinkState& sinks = GetSinkState();
+    if (ReadAcquire(&sinks.count) == 0) {
+        // Only the default sink, which needs no lock
+        if (!ReadNoFence(&sinks.defaultRemoved)) WriteDefaultOutput(record);
+        return;
+    }
+
+    SharedLockGuard guard(sinks.lock);
+    if (!sinks.defaultRemoved) WriteDefaultOutput(record);
+    for (LONG i = 0; i < sinks.count; ++i) {
+        sinks.sinks[i]->Write(record);
+    }
+}
+
+/**
+ * @struct RepeatState
+ * @brief The last line written, for collapsing identical consecutive lines.
+ *
+ * Zero-initialized static storage like AsyncState. While collapsing is enabled, every
+ * record is compared and dispatched under the lock, so that the summary of a run of
+ * repeats is written before the line that ends it. Records are compared before their
+ * prefix is added, since a sequence number or time would make every line different.
+ */
+struct RepeatState {
+    volatile LONG enabled;              // Set by DebugSetCollapseRepeats()
+    SRWLOCK lock;
+    wchar_t* last;                      // Text of the last line written, followed by its encoded fields
+    size_t lastLength;
+    size_t lastFieldsSize;              // Bytes of fields after the text
+    size_t lastCapacity;                // Characters of last
+    int lastLevel;
+    unsigned long repeats;              // Copies of the last line suppressed since it was written
+};
+
+inline RepeatState& GetRepeatState() {
+    static RepeatState state;
+    return state;
+}
+
+// Writes "Last message repeated N times" if copies were suppressed; the lock must be held
+inline void FlushRepeats(RepeatState& repeat) {
+    if (repeat.repeats == 0) return;
+
+    static const wchar_t prefix[] = L"Last message repeated ";
+    static const wchar_t suffix[] = L" times\n";
+    wchar_t text[64];
+    size_t length = sizeof(prefix) / sizeof(wchar_t) - 1;
+    std::char_traits<wchar_t>::copy(text, prefix, length);
+    wchar_t digits[16];
+    size_t count = 0;
+    for (unsigned long value = repeat.repeats; value; value /= 10) {
+        digits[count++] = static_cast<wchar_t>(L'0' + value % 10);
+    }
+    while (count) text[length++] = digits[--count];
+    std::char_traits<wchar_t>::copy(text + length, suffix, sizeof(suffix) / sizeof(wchar_t));
+    length += sizeof(suffix) / sizeof(wchar_t) - 1;
+
+    DebugRecord record;
+    record.text = text;
+    record.length = length;
+    record.level = repeat.lastLevel;
+    record.format = nullptr;
+    record.fields = nullptr;
+    record.fieldsSize = 0;
+    record.arguments = nullptr;
+    record.argumentsSize = 0;
+    record.prefix = 0;
+    record.threadId = 0;
+    record.timestamp = 0;
+    record.sequence = 0;
+    repeat.repeats = 0;
+    DispatchOutput(record);
+}
+
+// Adds the prefix and fields of a record to its text and writes it; defined after DebugStream
+inline void WriteDecoratedNow(const DebugRecord& record);
+
+// Hands a record to every sink, turning its prefix and fields into text first if it has any
+inline void DispatchDecorated(const DebugRecord& record) {
+    if (record.fieldsSize || record.prefix) {
+        WriteDecoratedNow(record);
+        return;
+    }
+    DispatchOutput(record);
+}
+
+// Sinks are called inside the lock, so that no other line can come between a line and its repeats
+inline void WriteCollapsed(const DebugRecord& record) {
+    RepeatState& repeat = GetRepeatState();
+    ExclusiveLockGuard guard(repeat.lock);
+    if (!repeat.enabled) {
+        // Disabled while this thread waited for the lock
+        DispatchDecorated(record);
+        return;
+    }
+    if (repeat.last && record.level == repeat.lastLevel && record.length == repeat.lastLength &&
+        record.fieldsSize == repeat.lastFieldsSize &&
+        std::char_traits<wchar_t>::compare(record.text, repeat.last, record.length) == 0 &&
+        (record.fieldsSize == 0 || memcmp(record.fields, repeat.last + record.length, record.fieldsSize) == 0)) {
+        ++repeat.repeats;
+        return;
+    }
+
+    FlushRepeats(repeat);
+    size_t needed = record.length + (record.fieldsSize + sizeof(wchar_t) - 1) / sizeof(wchar_t);
+    if (needed >= repeat.lastCapacity) {
+        // Without room to remember the line, it is written but never collapsed
+        size_t capacity = needed + 1 > repeat.lastCapacity * 2 ? needed + 1 : repeat.lastCapacity * 2;
+        wchar_t* grown = new (std::nothrow) wchar_t[capacity];
+        delete[] repeat.last;
+        repeat.last = grown;
+        repeat.lastCapacity = grown ? capacity : 0;
+    }
+    if (repeat.last) {
+        std::char_traits<wchar_t>::copy(repeat.last, record.text, record.length);
+        if (record.fieldsSize) memcpy(repeat.last + record.length, record.fields, record.fieldsSize);
+        repeat.lastLength = record.length;
+        repeat.lastFieldsSize = record.fieldsSize;
+        repeat.lastLevel = record.level;
+    }
+    DispatchDecorated(record);
+}
+
+/**
+ * @brief Hands a finished message to every sink without going through the queue.
+ *
+ * The prefix and fields are turned into text here, so that with DebugEnableAsync() it
+ * happens on the output thread. Sinks receive both the text and the encoded fields.
+ */
+inline void WriteOutputNow(const DebugRecord& record) {
+    if (ReadNoFence(&GetRepeatState().enabled)) {
+        WriteCollapsed(record);
+        return;
+    }
+    DispatchDecorated(record);
+}
+
+inline void AsyncDrain(AsyncState& async) {
+    while (QueuedRecord* queued = AsyncTryPop(async)) {
+        WriteOutputNow(queued->record);
+        FreeRecord(queued);
+    }
+}
+
+inline void AsyncWakeConsumer(AsyncState& async) {
+    if (ReadNoFence(&async.consumerSleeping) && InterlockedExchange(&async.consumerSleeping, 0)) {
+        SetEvent(async.wakeEvent);
+    }
+}
+
+/**
+ * @brief Queues a message for the output thread, applying the overflow policy when full.
+ *
+ * Takes ownership of record. If the output thread is stopped concurrently, the message
+ * is written on the calling thread instead, so it is never lost.
+ */
+inline void AsyncPush(AsyncState& async, QueuedRecord* record) {
+    while (!AsyncTryPush(async, record)) {
+        LONG policy = ReadNoFence(&async.policy);
+        if (policy == DebugOverflowDropNewest) {
+            InterlockedIncrement64(&async.dropped);
+            FreeRecord(record);
+            return;
+        }
+
+        if (policy == DebugOverflowDropOldest) {
+            if (QueuedRecord* oldest = AsyncTryPop(async)) {
+                InterlockedIncrement64(&async.dropped);
+                FreeRecord(oldest);
+            }
+            continue;
+        }
+
+        if (!ReadAcquire(&async.running)) {
+            WriteOutputNow(record->record);
+            FreeRecord(record);
+            return;
+        }
+        AsyncWakeConsumer(async);
+        SwitchToThread();
+    }
+
+    // Pairs with AsyncStop(): either it sees this message or this thread sees it stopping
+    MemoryBarrier();
+    if (ReadNoFence(&async.running)) {
+        AsyncWakeConsumer(async);
+    } else {
+        AsyncDrain(async);
+    }
+}
+
+inline DWORD WINAPI AsyncThreadProc(LPVOID) {
+    AsyncState& async = GetAsyncState();
+    for (;;) {
+        AsyncDrain(async);
+        DrainDeferred();
+        if (!ReadAcquire(&async.running)) break;
+
+        // Announce the wait first, then check again so a concurrent push is not missed
+        InterlockedExchange(&async.consumerSleeping, 1);
+        if (AsyncHasMessages(async) || DeferredHasRecords() || !ReadAcquire(&async.running)) {
+            InterlockedExchange(&async.consumerSleeping, 0);
+            continue;
+        }
+        WaitForSingleObject(async.wakeEvent, INFINITE);
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops the output thread and writes every queued message.
+ *
+ * The queue is drained on the calling thread rather than by waiting for the output
+ * thread, which may already have been terminated when this runs at process exit.
+ * The queue itself stays allocated, since a producer may still be inside AsyncPush().
+ */
+inline void AsyncStop() {
+    AsyncState& async = GetAsyncState();
+    AcquireSRWLockExclusive(&async.controlLock);
+    if (async.running) {
+        InterlockedExchange(&async.running, 0);
+        InterlockedExchange(&async.consumerSleeping, 0);
+        SetEvent(async.wakeEvent);
+
+        AsyncDrain(async);
+        DrainDeferred();
+
+        WaitForSingleObject(async.thread, 1000);
+        CloseHandle(async.thread);
+        async.thread = nullptr;
+    }
+    ReleaseSRWLockExclusive(&async.controlLock);
+}
+
+inline void AsyncExitHandler() {
+    AsyncStop();
+}
+
+/**
+ * @brief Starts the output thread, allocating the queue on first use.
+ *
+ * @return false if the queue, event or thread could not be created.
+ */
+inline bool AsyncStart(size_t capacity, DebugOverflowPolicy policy) {
+    AsyncState& async = GetAsyncState();
+    AcquireSRWLockExclusive(&async.controlLock);
+    InterlockedExchange(&async.policy, policy);
+
+    if (!async.slots) {
+        size_t size = 2;
+        while (size < capacity && size < (SIZE_MAX / sizeof(AsyncSlot)) / 2) size <<= 1;
+
+        AsyncSlot* slots = new (std::nothrow) AsyncSlot[size];
+        if (slots) {
+            for (size_t i = 0; i < size; ++i) {
+                slots[i].sequence = static_cast<LONG64>(i);
+                slots[i].record = nullptr;
+            }
+            async.mask = size - 1;
+            async.slots = slots;
+        }
+    }
+    if (!async.wakeEvent) {
+        async.wakeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    }
+
+    bool started = async.running != 0;
+    if (!started && async.slots && async.wakeEvent) {
+        InterlockedExchange(&async.running, 1);
+        async.thread = CreateThread(nullptr, 0, &AsyncThreadProc, nullptr, 0, nullptr);
+        if (async.thread) {
+            started = true;
+            if (!async.exitHandlerRegistered) {
+                async.exitHandlerRegistered = std::atexit(&AsyncExitHandler) == 0;
+            }
+        } else {
+            InterlockedExchange(&async.running, 0);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&async.controlLock);
+    return started;
+}
+
+/**
+ * @struct GateState
+ * @brief Process-wide run-time switch read by every log statement.
+ *
+ * Zero-initialized static storage like AsyncState, so logging is on (DebugLoggingOn)
+ * until DebugSetLoggingMode() is called.
+ */
+struct GateState {
+    volatile LONG mode;                 // DebugLoggingMode
+    volatile LONG observed;             // Cached result of IsOutputObserved() for DebugLoggingAuto
+    volatile LONG64 nextCheck;          // GetTickCount64() value after which the cache is refreshed
+};
+
+inline GateState& GetGateState() {
+    static GateState state;
+    return state;
+}
+
+/**
+ * @struct PrefixState
+ * @brief The parts of the message prefix and the last sequence number handed out.
+ *
+ * The counter has a cache line of its own, since every prefixed message on every
+ * thread increments it.
+ */
+struct PrefixState {
+    volatile LONG flags;                // DebugPrefix parts, 0 for no prefix
+    char padding[64 - sizeof(LONG)];
+    volatile LONG64 sequence;
+};
+
+inline PrefixState& GetPrefixState() {
+    static PrefixState state;
+    return state;
+}
+
+inline LONG64 TimerNow() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// QueryPerformanceCounter() ticks per second
+inline LONG64 TimerFrequency() {
+    // The frequency is fixed at boot, so a racy first read only repeats the query
+    static volatile LONG64 frequency;
+    LONG64 perSecond = ReadNoFence64(&frequency);
+    if (perSecond == 0) {
+        LARGE_INTEGER result;
+        QueryPerformanceFrequency(&result);
+        perSecond = result.QuadPart;
+        WriteNoFence64(&frequency, perSecond);
+    }
+    return perSecond;
+}
+
+/**
+ * @brief Records what the prefix of a message is made of, without formatting it.
+ *
+ * Only the thread id, the raw counter and the sequence number are taken here; they are
+ * turned into text by WriteOutputNow(), on the output thread with DebugEnableAsync().
+ *
+ * @param lineStart Whether the record starts a line; continuations get no prefix.
+ */
+inline void StampRecord(DebugRecord& record, bool lineStart) {
+    LONG flags = ReadNoFence(&GetPrefixState().flags);
+    if (flags == 0 || !lineStart) return;
+    record.prefix = static_cast<unsigned int>(flags);
+    record.threadId = GetCurrentThreadId();
+    if (flags & DebugPrefixTime) record.timestamp = TimerNow();
+    if (flags & DebugPrefixSequence) record.sequence = InterlockedIncrement64(&GetPrefixState().sequence);
+}
+
+// Appends a thread id, reusing its digits while one thread keeps writing
+inline void AppendThreadId(WideBuffer& buffer, DWORD threadId) {
+    ThreadCache* cache = GetThreadCache();
+    if (cache && cache->threadTextLength && cache->threadTextId == threadId) {
+        buffer.Append(cache->threadText, cache->threadTextLength);
+        return;
+    }
+
+    wchar_t digits[10];
+    size_t count = 0;
+    for (DWORD value = threadId; count == 0 || value; value /= 10) {
+        digits[9 - count++] = static_cast<wchar_t>(L'0' + value % 10);
+    }
+    buffer.Append(digits + 10 - count, count);
+    if (cache) {
+        std::char_traits<wchar_t>::copy(cache->threadText, digits + 10 - count, count);
+        cache->threadTextLength = count;
+        cache->threadTextId = threadId;
+    }
+}
+
+// Appends the prefix of a stamped record, e.g. "#42 12.345678 [1234] "
+inline void AppendPrefix(WideBuffer& buffer, const DebugRecord& record) {
+    FormatState state;
+    if (record.prefix & DebugPrefixSequence) {
+        buffer.Append(L'#');
+        FormatInteger(buffer, state, static_cast<unsigned long long>(record.sequence), false, false);
+        buffer.Append(L' ');
+    }
+    if (record.prefix & DebugPrefixTime) {
+        // Integer arithmetic keeps every digit of the counter, however long the system has run
+        unsigned long long perSecond = static_cast<unsigned long long>(TimerFrequency());
+        unsigned long long ticks = static_cast<unsigned long long>(record.timestamp);
+        FormatInteger(buffer, state, ticks / perSecond, false, false);
+        buffer.Append(L'.');
+        state.width = 6;
+        state.fill = L'0';
+        FormatInteger(buffer, state, ticks % perSecond * 1000000 / perSecond, false, false);
+        buffer.Append(L' ');
+    }
+    if (record.prefix & DebugPrefixThread) {
+        buffer.Append(L'[');
+        AppendThreadId(buffer, record.threadId);
+        buffer.Append(L"] ", 2);
+    }
+}
+
+// Whether anything receives OutputDebugStringW output: a debugger, or a capture tool such
+// as DebugView, which creates the DBWIN_BUFFER_READY event. The answer is cached for
+// DEBUG_AUTO_ENABLE_INTERVAL_MS, so most calls cost one GetTickCount64().
+inline bool IsOutputObserved() {
+    GateState& gate = GetGateState();
+    ULONGLONG now = GetTickCount64();
+    if (now >= static_cast<ULONGLONG>(ReadNoFence64(&gate.nextCheck))) {
+        DWORD lastError = GetLastError();
+        bool observed = IsDebuggerPresent() != FALSE;
+        if (!observed) {
+            HANDLE ready = OpenEventW(SYNCHRONIZE, FALSE, L"DBWIN_BUFFER_READY");
+            if (!ready) ready = OpenEventW(SYNCHRONIZE, FALSE, L"Global\\DBWIN_BUFFER_READY");
+            if (ready) {
+                observed = true;
+                CloseHandle(ready);
+            }
+        }
+        SetLastError(lastError);
+
+        InterlockedExchange(&gate.observed, observed ? 1 : 0);
+        WriteNoFence64(&gate.nextCheck, static_cast<LONG64>(now + DEBUG_AUTO_ENABLE_INTERVAL_MS));
+    }
+    return ReadNoFence(&gate.observed) != 0;
+}
+
+/**
+ * @struct FlightRecorderState
+ * @brief The process-wide flight recorder, see DebugEnableFlightRecorder().
+ *
+ * Zero-initialized static storage like AsyncState. The ring is allocated once and then
+ * kept for the life of the process, so writers never need a lock to use it. It is
+ * followed in the same allocation by the buffer that dumps copy each entry into.
+ */
+struct FlightRecorderState {
+    PVOID volatile ring;                // FlightRecorderHeader, or nullptr while disabled
+    SRWLOCK dumpLock;                   // Serializes use of the dump buffer
+    LPTOP_LEVEL_EXCEPTION_FILTER previousFilter;
+    volatile LONG crashPathSet;
+    wchar_t crashPath[MAX_PATH];        // Where the unhandled-exception filter dumps the ring
+};
+
+inline FlightRecorderState& GetFlightRecorderState() {
+    static FlightRecorderState state;
+    return state;
+}
+
+// Appends a record, overwriting the oldest entries: one fetch-add, a copy and a store
+inline void FlightRecord(FlightRecorderHeader* ring, const DebugRecord& record) {
+    size_t length = record.length;
+    if (length > FlightMaxLength(ring)) length = FlightMaxLength(ring);
+
+    LONG64 position = InterlockedExchangeAdd64(&ring->head, FlightEntrySize(length));
+    unsigned int fields[2];
+    fields[0] = static_cast<unsigned int>(length);
+    fields[1] = static_cast<unsigned int>(record.level);
+    FlightCopyIn(ring, position + sizeof(LONG64), fields, sizeof(fields));
+    FlightCopyIn(ring, position + sizeof(FlightEntry), record.text, length * sizeof(wchar_t));
+    WriteRelease64(FlightStamp(ring, position), position + 1);
+}
+
+/**
+ * @brief Passes the entries still in the ring to a sink, oldest first.
+ *
+ * Other threads may keep writing, including over the oldest entries, so entries are
+ * recognized by their stamp and dropped if the writers may have reached them while
+ * they were being copied. Entries that are still being written are skipped.
+ *
+ * @return false if another dump holds the dump buffer and wait is false.
+ */
+inline bool FlightDump(DebugSink& target, bool wait) {
+    FlightRecorderState& recorder = GetFlightRecorderState();
+    FlightRecorderHeader* ring = static_cast<FlightRecorderHeader*>(ReadPointerAcquire(&recorder.ring));
+    if (!ring) return true;
+
+    if (wait) {
+        AcquireSRWLockExclusive(&recorder.dumpLock);
+    } else if (!TryAcquireSRWLockExclusive(&recorder.dumpLock)) {
+        return false;
+    }
+
+    wchar_t* text = reinterpret_cast<wchar_t*>(FlightData(ring) + ring->capacity);
+    LONG64 head = ReadAcquire64(&ring->head);
+    LONG64 position = head > ring->capacity ? head - ring->capacity : 0;
+    while (position < head) {
+        if (ReadAcquire64(FlightStamp(ring, position)) != position + 1) {
+            position += sizeof(LONG64);
+            continue;
+        }
+
+        unsigned int fields[2];
+        FlightCopyOut(ring, position + sizeof(LONG64), fields, sizeof(fields));
+        LONG64 size = FlightEntrySize(fields[0]);
+        if (fields[0] > FlightMaxLength(ring) || position + size > head) {
+            position += sizeof(LONG64);
+            continue;
+        }
+        FlightCopyOut(ring, position + sizeof(FlightEntry), text, fields[0] * sizeof(wchar_t));
+        MemoryBarrier();
+
+        // A writer that reserved past position + capacity may have overwritten the copy
+        if (ReadAcquire64(&ring->head) - ring->capacity <= position) {
+            text[fields[0]] = L'\0';
+            DebugRecord record;
+            record.text = text;
+            record.length = fields[0];
+            record.level = static_cast<int>(fields[1]);
+            record.format = nullptr;
+            record.fields = nullptr;
+            record.fieldsSize = 0;
+            record.arguments = nullptr;
+            record.argumentsSize = 0;
+            record.prefix = 0;
+            record.threadId = 0;
+            record.timestamp = 0;
+            record.sequence = 0;
+            target.Write(record);
+        }
+        position += size;
+    }
+
+    ReleaseSRWLockExclusive(&recorder.dumpLock);
+    return true;
+}
+
+// Passes dumped entries on to the registered sinks
+struct SinkDispatcher : public DebugSink {
+    virtual void Write(const DebugRecord& record) {
+        WriteOutputNow(record);
+    }
+};
+
+// Writes dumped entries to an open file as UTF-16LE lines, without allocating
+struct HandleWriter : public DebugSink {
+    explicit HandleWriter(HANDLE fileHandle) : file(fileHandle) {}
+
+    virtual void Write(const DebugRecord& record) {
+        DWORD written;
+        ::WriteFile(file, record.text, static_cast<DWORD>(record.length * sizeof(wchar_t)), &written, NULL);
+        if (record.length == 0 || record.text[record.length - 1] != L'\n') {
+            ::WriteFile(file, L"\r\n", 2 * sizeof(wchar_t), &written, NULL);
+        }
+    }
+
+    HANDLE file;
+};
+
+inline bool FlightDumpToFile(const wchar_t* filePath, bool wait) {
+    HANDLE file = CreateFileW(filePath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    HandleWriter writer(file);
+    DWORD written;
+    const wchar_t bom = 0xFEFF;
+    bool dumped = ::WriteFile(file, &bom, sizeof(bom), &written, NULL) != FALSE && FlightDump(writer, wait);
+    CloseHandle(file);
+    return dumped;
+}
+
+// Dumps the ring before the process dies, then lets the previous filter run
+inline LONG WINAPI FlightRecorderFilter(EXCEPTION_POINTERS* exception) {
+    FlightRecorderState& recorder = GetFlightRecorderState();
+    if (ReadAcquire(&recorder.crashPathSet)) {
+        FlightDumpToFile(recorder.crashPath, false);
+    } else {
+        SinkDispatcher sinks;
+        FlightDump(sinks, false);
+    }
+    if (recorder.previousFilter) return recorder.previousFilter(exception);
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+inline bool FlightStart(size_t capacity) {
+    FlightRecorderState& recorder = GetFlightRecorderState();
+    if (ReadPointerAcquire(&recorder.ring)) return true;
+
+    size_t size = 4096;
+    while (size < capacity && size < SIZE_MAX / 4) size <<= 1;
+
+    // Committed pages are zeroed, so no stale stamp can match, and the ring is one region in a minidump
+    void* block = VirtualAlloc(NULL, sizeof(FlightRecorderHeader) + size + (size / 16 + 1) * sizeof(wchar_t), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!block) return false;
+    FlightRecorderHeader* ring = static_cast<FlightRecorderHeader*>(block);
+    memcpy(ring->signature, L"DebugUtilFlight", sizeof(ring->signature));
+    ring->capacity = static_cast<LONG64>(size);
+
+    if (InterlockedCompareExchangePointer(&recorder.ring, ring, nullptr) != nullptr) {
+        // Another thread enabled it first
+        VirtualFree(block, 0, MEM_RELEASE);
+        return true;
+    }
+    recorder.previousFilter = SetUnhandledExceptionFilter(FlightRecorderFilter);
+    return true;
+}
+
+/**
+ * @brief Writes a finished message to the registered sinks.
+ *
+ * The flight recorder, if enabled, records the message first; in DebugLoggingAuto it
+ * then only reaches the sinks while output is observed. While the asynchronous output
+ * thread is running, the message is copied into its queue and this returns without
+ * waiting for the sinks. Otherwise, or if the copy cannot be allocated, the sinks are
+ * called directly.
+ *
+ * @param record The message; its text must be null-terminated.
+ */
+inline void WriteOutput(const DebugRecord& record) {
+    if (FlightRecorderHeader* ring = static_cast<FlightRecorderHeader*>(ReadPointerAcquire(&GetFlightRecorderState().ring))) {
+        FlightRecord(ring, record);
+        if (ReadNoFence(&GetGateState().mode) == DebugLoggingAuto && !IsOutputObserved()) return;
+    }
+
+    AsyncState& async = GetAsyncState();
+    if (ReadAcquire(&async.running)) {
+        if (QueuedRecord* queued = CopyRecord(record)) {
+            AsyncPush(async, queued);
+            return;
+        }
+    }
+    WriteOutputNow(record);
+}
+
+struct DeferredFormatter;
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+// Encodes one DebugStream::With() field; defined with the DebugDeferred() capture traits
+template<typename T>
+inline void AppendField(FieldBuffer& fields, const wchar_t* key, const T& value);
+#endif
+
+// How DebugStream inserts a type that it has no overload for
+enum InsertKind {
+    InsertKindStream,                   // Through a std::wostream
+    InsertKindWriter,                   // By calling it with the DebugStream
+    InsertKindRange                     // As a list of its elements
+};
+
+template<int Kind>
+struct InsertTag {};
+
+// Whether the elements of a list are key-value pairs, written as "key: value"
+template<bool Mapped>
+struct MappedTag {};
+
+#if defined(DEBUG_HAS_CPP11)
+// Whether a const T can be called with a Stream&, which is how the stream inserts it
+template<typename T, typename Stream>
+struct IsStreamWriter {
+    template<typename U>
+    static char Test(decltype(std::declval<const U&>()(std::declval<Stream&>()), 0)*);
+    template<typename U>
+    static long Test(...);
+    static const bool Value = sizeof(Test<T>(nullptr)) == 1;
+};
+
+// Whether a T can be written to a std::wostream, which takes precedence over its elements
+template<typename T>
+struct IsWideStreamable {
+    template<typename U>
+    static char Test(decltype(std::declval<std::basic_ostream<wchar_t>&>() << std::declval<const U&>(), 0)*);
+    template<typename U>
+    static long Test(...);
+    static const bool Value = sizeof(Test<T>(nullptr)) == 1;
+};
+
+// Whether a T has begin() and end() members and nothing else to write it with
+template<typename T>
+struct IsRange {
+    template<typename U>
+    static char Test(decltype(std::declval<const U&>().begin() != std::declval<const U&>().end(), 0)*);
+    template<typename U>
+    static long Test(...);
+    static const bool Value = sizeof(Test<T>(nullptr)) == 1 && !IsWideStreamable<T>::Value;
+};
+
+template<typename T, typename Stream>
+struct InsertKindOf {
+    static const int Value = IsStreamWriter<T, Stream>::Value ? InsertKindWriter :
+        IsRange<T>::Value ? InsertKindRange : InsertKindStream;
+};
+#endif
+
+} // namespace DebugDetail
+
+/**
+ * @brief Returns whether log statements currently produce output.
+ *
+ * With DebugLoggingOn or DebugLoggingOff this is a single relaxed load, so a disabled
+ * statement costs little more than a predicted branch.
+ */
+inline bool DebugIsEnabled() {
+    LONG mode = ReadNoFence(&DebugDetail::GetGateState().mode);
+    if (mode == DebugLoggingOn) return true;
+    if (mode == DebugLoggingOff) return false;
+    return ReadPointerNoFence(&DebugDetail::GetFlightRecorderState().ring) || DebugDetail::IsOutputObserved();
+}
+
+/**
+ * @brief Switches logging on or off at run time, without rebuilding.
+ *
+ * Streams created while logging is off discard everything inserted into them. The
+ * DEBUG_LOG_* macros check the mode before creating a stream, so their arguments are
+ * not evaluated. DebugLoggingAuto only writes output while a debugger or DebugView is
+ * attached, since OutputDebugStringW output goes nowhere otherwise. With the flight
+ * recorder enabled, it keeps recording in between; see DebugEnableFlightRecorder().
+ *
+ * @param mode The new logging mode.
+ */
+inline void DebugSetLoggingMode(DebugLoggingMode mode) {
+    DebugDetail::GateState& gate = DebugDetail::GetGateState();
+    if (mode == DebugLoggingAuto) {
+        // Make the first statement check again instead of trusting an old answer
+        WriteNoFence64(&gate.nextCheck, 0);
+    }
+    InterlockedExchange(&gate.mode, mode);
+}
+
+/**
+ * @brief Returns the mode set by DebugSetLoggingMode().
+ */
+inline DebugLoggingMode DebugGetLoggingMode() {
+    return static_cast<DebugLoggingMode>(ReadNoFence(&DebugDetail::GetGateState().mode));
+}
+
+/**
+ * @brief Starts every message with a sequence number, a timestamp and/or a thread id.
+ *
+ * With DebugPrefixAll a message is written as
+ * @code
+ *     #42 12.345678 [1234] Hello World
+ * @endcode
+ * The sequence number is taken from one process-wide counter when the message is
+ * flushed, so interleaved output from many threads can be put back in order. The time
+ * is QueryPerformanceCounter() time in seconds. When a message is flushed only the
+ * raw values are taken, without a lock; the text is produced where the message is
+ * written, which with DebugEnableAsync() is the output thread. DebugDeferred() records
+ * get no prefix.
+ *
+ * @param flags DebugPrefix parts combined with |, or DebugPrefixNone to turn it off.
+ * @throws std::invalid_argument If flags contains anything but DebugPrefix parts.
+ */
+inline void DebugSetPrefix(unsigned int flags) {
+    if (flags & ~static_cast<unsigned int>(DebugPrefixAll)) throw std::invalid_argument("Unknown prefix flags");
+    InterlockedExchange(&DebugDetail::GetPrefixState().flags, static_cast<LONG>(flags));
+}
+
+/**
+ * @brief Returns the parts set by DebugSetPrefix().
+ */
+inline unsigned int DebugGetPrefix() {
+    return static_cast<unsigned int>(ReadNoFence(&DebugDetail::GetPrefixState().flags));
+}
+
+/**
+ * @class DebugStream
+ * @brief A class that provides a stream-like interface for writing debug output to the Visual Studio Output window.
+ * 
+ * DebugStream provides functionality similar to std::cout or std::cerr but outputs
+ * to the Windows debug output stream using OutputDebugStringW. It supports both
+ * narrow and wide strings, various manipulators, and automatic type conversion.
+ * 
+ * With auto-flush enabled every insertion is written immediately. With auto-flush
+ * disabled the output is collected until Flush() is called or the stream is
+ * destroyed, which is how the Debug() factory emits one line per statement. A
+ * DebugFlushPolicy can also write a long-lived stream's lines in batches.
+ * 
+ * Output is formatted into an inline buffer of DEBUG_INLINE_BUFFER_SIZE characters.
+ * Strings, integers, floating point values, pointers and booleans are formatted
+ * directly and honor the standard manipulators. Containers, arrays, pairs, tuples and
+ * optionals are written element by element, see DebugRange(). Other types are written
+ * through a std::wostream that is only created when such a value is inserted.
+ */
+class DebugStream {
+private:
+    typedef std::basic_ostream<wchar_t>& (*OstreamManipulator)(std::basic_ostream<wchar_t>&);
+
+    DebugDetail::WideBuffer buffer;     // Internal buffer for collecting output
+    DebugDetail::FieldBuffer fields;    // Fields attached with With(), written with the next flush
+    DebugDetail::FormatState state;     // Flags, width, precision and fill set by manipulators
+    DebugDetail::AdapterStream* adapter; // Borrowed from the thread cache on first use by InsertFallback()
+    DebugFlushPolicy policy;            // When buffered output is written; Streaming() sets maxCharacters
+    bool enabled;                       // If false, insertions are ignored; see DebugSetLoggingMode()
+    int level;                          // DEBUG_LEVEL_* passed on to the sinks
+    bool lineStart;                     // Whether the next record starts a line and gets the DebugSetPrefix() prefix
+    size_t scanned;                     // Buffered characters already searched for line ends by the message limit
+    size_t bufferedLines;               // Complete lines among them
+    ULONGLONG firstBufferedTick;        // GetTickCount64() when the buffer became non-empty, for the time limit
+
+    friend struct DebugDetail::DeferredFormatter;
+
+    // Takes the prefix parts of a record about to be written; an auto-flush stream only
+    // prefixes the first piece of each line, a buffered stream every statement
+    inline void Stamp(DebugRecord& record, bool statementEnd) {
+        DebugDetail::StampRecord(record, lineStart);
+        if (record.length) lineStart = record.text[record.length - 1] == L'\n';
+        if (statementEnd && !policy.everyInsertion) lineStart = true;
+    }
+
+    // Called after every insertion
+    inline void FlushIfNeeded() {
+        if (policy.everyInsertion) {
+            Flush();
+            return;
+        }
+        if (policy.maxCharacters && buffer.Size() >= policy.maxCharacters) {
+            FlushLines();
+            return;
+        }
+        if (policy.maxMessages) {
+            const wchar_t* text = buffer.Data();
+            for (size_t end = buffer.Size(); scanned < end; ++scanned) {
+                if (text[scanned] == L'\n') ++bufferedLines;
+            }
+            if (bufferedLines >= policy.maxMessages) {
+                FlushLines();
+                return;
+            }
+        }
+        if (policy.maxMilliseconds && !buffer.Empty()) {
+            ULONGLONG now = GetTickCount64();
+            if (!firstBufferedTick) {
+                firstBufferedTick = now;
+            } else if (now - firstBufferedTick >= policy.maxMilliseconds) {
+                FlushLines();
+            }
+        }
+    }
+
+    // Takes over the output, state and policy of other, leaving it empty; the adapter
+    // stays with its stream, since it writes to that stream's buffer
+    inline void TakeFrom(DebugStream& other) {
+        buffer.TakeFrom(other.buffer);
+        fields.TakeFrom(other.fields);
+        state = other.state;
+        policy = other.policy;
+        enabled = other.enabled;
+        level = other.level;
+        lineStart = other.lineStart;
+        scanned = other.scanned;
+        bufferedLines = other.bufferedLines;
+        firstBufferedTick = other.firstBufferedTick;
+        other.ResetPolicyState();
+    }
+
+    // Forgets what the flush policy knew about the buffer, after some of it was written
+    inline void ResetPolicyState() {
+        scanned = buffer.Size();
+        bufferedLines = 0;
+        firstBufferedTick = buffer.Empty() || !policy.maxMilliseconds ? 0 : GetTickCount64();
+    }
+
+    /**
+     * @brief Writes the completed lines in the buffer and keeps the unfinished last one.
+     *
+     * Without a newline in the buffer, everything except a trailing high surrogate is
+     * written, so the buffer cannot grow past the window by more than one insertion.
+     */
+    inline void FlushLines() {
+        wchar_t* text = buffer.Data();
+        size_t end = buffer.Size();
+        while (end > 0 && text[end - 1] != L'\n') --end;
+        if (end == 0) {
+            end = buffer.Size();
+            if (IS_HIGH_SURROGATE(text[end - 1])) --end;
+            if (end == 0) return;
+        }
+
+        // Terminate the lines in place, so they are not copied before being written
+        wchar_t next = text[end];
+        text[end] = L'\0';
+        DebugRecord record;
+        record.length = end;
+        record.text = text;
+        record.level = level;
+        record.format = nullptr;
+        record.fields = nullptr;
+        record.fieldsSize = 0;
+        record.arguments = nullptr;
+        record.argumentsSize = 0;
+        record.prefix = 0;
+        record.threadId = 0;
+        record.timestamp = 0;
+        record.sequence = 0;
+        Stamp(record, false);
+        try {
+            DebugDetail::WriteOutput(record);
+        } catch (...) {
+            text[end] = next;
+            throw;
+        }
+        text[end] = next;
+        buffer.Consume(end);
+        ResetPolicyState();
+    }
+
+    /**
+     * @brief Converts a narrow string to a wide string and outputs it to a buffer.
+     *
+     * This function takes a narrow string (default UTF-8 encoding), converts it to a wide string (USC-2)
+     * directly in the buffer with a single conversion pass. If the input string is null, it throws
+     * an invalid_argument exception. If the conversion fails or the string is too long,
+     * it throws a runtime_error exception.
+     *
+     * @param str The narrow C style string to be converted and output.
+     * @throws std::invalid_argument If the input string is null.
+     * @throws std::runtime_error If the conversion fails or the string is too long.
+     * 
+     * @remark This function uses the DEBUG_CODE_PAGE macro to determine the code page for conversion,
+     * which defaults to CP_UTF8. You can define DEBUG_CODE_PAGE to a different code page if the debug
+     * output is not displayed correctly. See @link{https://docs.microsoft.com/en-us/windows/win32/intl/code-page-identifiers}
+     */
+    inline void ConvertAndOutput(const char* str) {
+        if (!str) {
+            throw std::invalid_argument("Null string pointer");
+        }
+
+        ConvertAndOutput(str, std::char_traits<char>::length(str));
+    }
+
+    /**
+     * @brief Converts length bytes of a narrow string and outputs them to the buffer.
+     *
+     * The string does not need to be null-terminated, and embedded nulls are converted
+     * like any other character.
+     *
+     * @param str The narrow string to be converted and output.
+     * @param length The number of bytes to convert.
+     * @throws std::runtime_error If the conversion fails or the string is too long.
+     */
+    inline void ConvertAndOutput(const char* str, size_t length) {
+        AppendConverted(str, length);
+        FlushIfNeeded();
+    }
+
+    // Converts a narrow string as one formatted value, without flushing
+    inline void AppendConverted(const char* str, size_t length) {
+        size_t start = buffer.Size();
+        DebugDetail::AppendNarrow(buffer, str, length);
+        DebugDetail::PadField(buffer, state, start, 0);
+    }
+
+    // Formats values of types that DebugStream does not handle itself through a std::wostream
+    template<typename T>
+    inline void InsertFallback(const T& value) {
+        if (!adapter) adapter = DebugDetail::AcquireAdapter(buffer);
+
+        std::basic_ostream<wchar_t>& stream = adapter->stream;
+        stream.clear();
+        stream.flags(state.flags);
+        stream.width(state.width);
+        stream.precision(state.precision);
+        stream.fill(state.fill);
+
+        stream << value;
+
+        state.flags = stream.flags();
+        state.width = stream.width();
+        state.precision = stream.precision();
+        state.fill = stream.fill();
+    }
+
+#if defined(DEBUG_HAS_CPP11)
+    template<typename T>
+    inline void Insert(const T& value) { InsertValue(value, DebugDetail::InsertTag<DebugDetail::InsertKindOf<T, DebugStream>::Value>()); }
+#else
+    template<typename T>
+    inline void Insert(const T& value) { InsertFallback(value); }
+#endif
+
+    template<typename T>
+    inline void InsertValue(const T& value, DebugDetail::InsertTag<DebugDetail::InsertKindStream>) { InsertFallback(value); }
+
+    // Callables that take a DebugStream& write into the stream themselves
+    template<typename T>
+    inline void InsertValue(const T& writer, DebugDetail::InsertTag<DebugDetail::InsertKindWriter>) { writer(*this); }
+
+    template<typename T>
+    inline void InsertValue(const T& container, DebugDetail::InsertTag<DebugDetail::InsertKindRange>) {
+        InsertRange(container.begin(), container.end(), DEBUG_RANGE_MAX_ELEMENTS, DebugDetail::HasKeyType<T>::Value,
+            DebugDetail::MappedTag<DebugDetail::HasMappedType<T>::Value>());
+    }
+
+    // Writes one element of a list, giving it the width that applies to the whole list
+    template<typename T>
+    inline void PutElement(const T& value, std::streamsize width) {
+        state.width = width;
+        Put(value);
+    }
+
+    template<typename Iterator>
+    inline void PutElement(Iterator element, std::streamsize width, DebugDetail::MappedTag<false>) {
+        PutElement(*element, width);
+    }
+
+    template<typename Iterator>
+    inline void PutElement(Iterator element, std::streamsize width, DebugDetail::MappedTag<true>) {
+        PutElement((*element).first, width);
+        buffer.Append(L": ", 2);
+        PutElement((*element).second, width);
+    }
+
+    /**
+     * @brief Writes the elements from first up to last, separated by ", ".
+     *
+     * Elements beyond maxElements are counted instead of formatted, so the time and
+     * memory spent on a huge range is bounded by the limit.
+     */
+    template<typename Iterator, bool Mapped>
+    inline void InsertRange(Iterator first, Iterator last, size_t maxElements, bool associative, DebugDetail::MappedTag<Mapped> mapped) {
+        std::streamsize width = state.width;
+        buffer.Append(associative ? L'{' : L'[');
+        size_t written = 0;
+        for (; first != last; ++first) {
+            if (maxElements && written == maxElements) break;
+            if (written++) buffer.Append(L", ", 2);
+            PutElement(first, width, mapped);
+        }
+        if (first != last) {
+            if (written) buffer.Append(L", ", 2);
+            buffer.Append(L"... (+", 6);
+            DebugDetail::FormatState plain;
+            DebugDetail::FormatInteger(buffer, plain, static_cast<unsigned long long>(std::distance(first, last)), false, false);
+            buffer.Append(L" more)", 6);
+        }
+        buffer.Append(associative ? L'}' : L']');
+        state.width = 0;
+    }
+
+    template<typename Iterator, bool Mapped>
+    inline void Insert(const DebugRangeValue<Iterator, Mapped>& range) {
+        InsertRange(range.first, range.last, range.maxElements, range.associative, DebugDetail::MappedTag<Mapped>());
+    }
+
+    template<typename T, size_t N>
+    inline void InsertArray(const T (&array)[N]) {
+        InsertRange(array, array + N, DEBUG_RANGE_MAX_ELEMENTS, false, DebugDetail::MappedTag<false>());
+    }
+
+    template<typename First, typename Second>
+    inline void Insert(const std::pair<First, Second>& value) {
+        std::streamsize width = state.width;
+        buffer.Append(L'(');
+        PutElement(value.first, width);
+        buffer.Append(L", ", 2);
+        PutElement(value.second, width);
+        buffer.Append(L')');
+        state.width = 0;
+    }
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+    template<size_t Index, typename Tuple>
+    inline void PutTupleElements(const Tuple& value, std::streamsize width, std::true_type) {
+        if (Index) buffer.Append(L", ", 2);
+        PutElement(std::get<Index>(value), width);
+        PutTupleElements<Index + 1>(value, width, std::integral_constant<bool, (Index + 1 < std::tuple_size<Tuple>::value)>());
+    }
+
+    template<size_t Index, typename Tuple>
+    inline void PutTupleElements(const Tuple&, std::streamsize, std::false_type) {}
+
+    template<typename... Types>
+    inline void Insert(const std::tuple<Types...>& value) {
+        std::streamsize width = state.width;
+        buffer.Append(L'(');
+        PutTupleElements<0>(value, width, std::integral_constant<bool, (0 < sizeof...(Types))>());
+        buffer.Append(L')');
+        state.width = 0;
+    }
+#endif
+
+#if defined(DEBUG_HAS_OPTIONAL)
+    // An empty optional is written as "nullopt", a full one as its value
+    template<typename T>
+    inline void Insert(const std::optional<T>& value) {
+        if (value) Put(*value);
+        else DebugDetail::FormatString(buffer, state, L"nullopt", 7);
+    }
+#endif
+
+    inline void Insert(void (*writer)(DebugStream&)) { writer(*this); }
+
+    template<typename F>
+    inline void Insert(const DebugLazyValue<F>& value) { Put(value.function()); }
+
+    // Pointers to anything else print their address, as with std::wostream
+    template<typename T>
+    inline void Insert(T* value) { DebugDetail::FormatPointer(buffer, state, value); }
+
+    inline void Insert(const void* value) { DebugDetail::FormatPointer(buffer, state, value); }
+    inline void Insert(bool value) {
+        if (state.flags & std::ios_base::boolalpha) {
+            if (value) DebugDetail::FormatString(buffer, state, L"true", 4);
+            else DebugDetail::FormatString(buffer, state, L"false", 5);
+        } else {
+            DebugDetail::FormatInteger(buffer, state, value ? 1 : 0, false, true);
+        }
+    }
+
+    inline void Insert(char value) {
+        wchar_t ch = static_cast<wchar_t>(static_cast<unsigned char>(value));
+        DebugDetail::FormatString(buffer, state, &ch, 1);
+    }
+    inline void Insert(wchar_t value) { DebugDetail::FormatString(buffer, state, &value, 1); }
+
+    // std::wostream prints signed and unsigned char as integers
+    inline void Insert(signed char value) { Insert(static_cast<int>(value)); }
+    inline void Insert(unsigned char value) { Insert(static_cast<int>(value)); }
+
+    inline void Insert(short value) { DebugDetail::FormatSigned<unsigned short>(buffer, state, value); }
+    inline void Insert(int value) { DebugDetail::FormatSigned<unsigned int>(buffer, state, value); }
+    inline void Insert(long value) { DebugDetail::FormatSigned<unsigned long>(buffer, state, value); }
+    inline void Insert(long long value) { DebugDetail::FormatSigned<unsigned long long>(buffer, state, value); }
+    inline void Insert(unsigned short value) { DebugDetail::FormatInteger(buffer, state, value, false, false); }
+    inline void Insert(unsigned int value) { DebugDetail::FormatInteger(buffer, state, value, false, false); }
+    inline void Insert(unsigned long value) { DebugDetail::FormatInteger(buffer, state, value, false, false); }
+    inline void Insert(unsigned long long value) { DebugDetail::FormatInteger(buffer, state, value, false, false); }
+
+    inline void Insert(float value) { DebugDetail::FormatFloat(buffer, state, static_cast<double>(value)); }
+    inline void Insert(double value) { DebugDetail::FormatFloat(buffer, state, value); }
+    inline void Insert(long double value) { DebugDetail::FormatFloat(buffer, state, value); }
+    inline void Insert(const DebugErrorCode& value) { DebugDetail::FormatErrorCode(buffer, state, value); }
+    inline void Insert(const DebugHexDump& value) {
+        size_t window = policy.maxCharacters;
+        if (!window) {
+            DebugDetail::FormatHexDump(buffer, value);
+            return;
+        }
+        // Write a window of rows at a time, so a large dump is never formatted as a whole
+        size_t rows = DebugDetail::HexDumpRows(value);
+        size_t rowsPerWindow = window / 80 + 1;
+        for (size_t row = 0; row < rows; row += rowsPerWindow) {
+            DebugDetail::FormatHexRows(buffer, value, row, rows - row < rowsPerWindow ? rows : row + rowsPerWindow);
+            if (buffer.Size() >= window) FlushLines();
+        }
+        DebugDetail::FormatHexOmitted(buffer, value);
+    }
+
+    // Formats one format argument, including the strings that operator<< handles itself
+    template<typename T>
+    inline void Put(const T& value) { Insert(value); }
+
+    // Arrays other than strings are lists; Insert() could also take them as pointers
+    template<typename T, size_t N>
+    inline void Put(const T (&array)[N]) { InsertArray(array); }
+
+    inline void Put(const char* value) {
+        if (!value) {
+            throw std::invalid_argument("Null string pointer");
+        }
+        AppendConverted(value, std::char_traits<char>::length(value));
+    }
+    inline void Put(char* value) { Put(static_cast<const char*>(value)); }
+    inline void Put(const std::string& value) { AppendConverted(value.data(), value.size()); }
+    inline void Put(const DebugDetail::NarrowText& value) { AppendConverted(value.data, value.size); }
+    inline void Put(const wchar_t* value) {
+        if (value) DebugDetail::FormatString(buffer, state, value, std::char_traits<wchar_t>::length(value));
+    }
+    inline void Put(wchar_t* value) { Put(static_cast<const wchar_t*>(value)); }
+    inline void Put(const std::wstring& value) { DebugDetail::FormatString(buffer, state, value.data(), value.size()); }
+    inline void Put(const DebugDetail::WideText& value) { DebugDetail::FormatString(buffer, state, value.data, value.size); }
+#if defined(DEBUG_HAS_STRING_VIEW)
+    inline void Put(std::string_view value) { AppendConverted(value.data(), value.size()); }
+    inline void Put(std::wstring_view value) { DebugDetail::FormatString(buffer, state, value.data(), value.size()); }
+#endif
+
+    /**
+     * @brief Formats one argument with the spec of its placeholder.
+     *
+     * The stream's own state is set aside meanwhile, so manipulators inserted before
+     * do not affect placeholders and placeholders do not change the stream. A spec that
+     * does not fit the argument's type is ignored.
+     */
+    template<typename T>
+    inline void FormatArgument(const T& value, const DebugDetail::FormatSpec& requested) {
+        int kind = DebugDetail::FormatKindOf<T>::Value;
+        DebugDetail::FormatSpec spec = DebugDetail::FormatSpecFits(requested, kind) ? requested : DebugDetail::FormatSpec();
+        DebugDetail::FormatState saved = state;
+        state = DebugDetail::SpecState(spec, kind);
+        size_t start = buffer.Size();
+        try {
+            Put(value);
+        } catch (...) {
+            state = saved;
+            throw;
+        }
+        if (spec.align == L'^') DebugDetail::PadCenter(buffer, start, spec.width, spec.fill);
+        state = saved;
+    }
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+    // Appends what is left of the format string once every argument is used
+    inline void FormatRest(const wchar_t* text) {
+        DebugDetail::FormatToken token;
+        for (;;) {
+            text = DebugDetail::NextFormatToken(text, token);
+            if (token.kind == DebugDetail::FormatTokenEnd) return;
+            buffer.Append(token.begin, static_cast<size_t>(token.end - token.begin));
+        }
+    }
+
+    // Appends the text up to the next placeholder, the first argument, then the rest;
+    // the overload for each argument type is chosen at compile time
+    template<typename T, typename... Rest>
+    inline void FormatRest(const wchar_t* text, const T& value, const Rest&... rest) {
+        DebugDetail::FormatToken token;
+        for (;;) {
+            text = DebugDetail::NextFormatToken(text, token);
+            if (token.kind == DebugDetail::FormatTokenEnd) return;
+            if (token.kind == DebugDetail::FormatTokenPlaceholder) break;
+            buffer.Append(token.begin, static_cast<size_t>(token.end - token.begin));
+        }
+        FormatArgument(value, token.spec);
+        FormatRest(text, rest...);
+    }
+#endif
+
+public:
+    /**
+     * @brief Constructs a DebugStream.
+     *
+     * @param autoFlushEnabled If true, the buffer is flushed after every insertion.
+     * If false, output is buffered until Flush() is called or the stream is destroyed.
+     */
+    explicit DebugStream(bool autoFlushEnabled = true)
+        : adapter(nullptr), policy(autoFlushEnabled ? DebugFlushPolicy::EveryInsertion() : DebugFlushPolicy()), enabled(DebugIsEnabled()),
+          level(DEBUG_LEVEL_DEBUG), lineStart(true), scanned(0), bufferedLines(0), firstBufferedTick(0) {}
+
+    /**
+     * @brief Constructs a DebugStream that writes its output as a flush policy says.
+     *
+     * Meant for long-lived streams, e.g. one per subsystem, that write many lines: with
+     * a batching policy they reach the sinks in a few large records instead of one call
+     * per line.
+     *
+     * @param flushPolicy When buffered output is written.
+     */
+    explicit DebugStream(const DebugFlushPolicy& flushPolicy)
+        : adapter(nullptr), policy(flushPolicy), enabled(DebugIsEnabled()), level(DEBUG_LEVEL_DEBUG), lineStart(true),
+          scanned(0), bufferedLines(0), firstBufferedTick(0) {}
+
+    /**
+     * @brief Constructs a DebugStream that is enabled or disabled regardless of DebugIsEnabled().
+     *
+     * @param autoFlushEnabled If true, the buffer is flushed after every insertion.
+     * @param enabledState If false, everything inserted into the stream is discarded
+     * without being formatted.
+     * @param logLevel The DEBUG_LEVEL_* reported to the sinks.
+     */
+    DebugStream(bool autoFlushEnabled, bool enabledState, int logLevel = DEBUG_LEVEL_DEBUG)
+        : adapter(nullptr), policy(autoFlushEnabled ? DebugFlushPolicy::EveryInsertion() : DebugFlushPolicy()), enabled(enabledState),
+          level(logLevel), lineStart(true), scanned(0), bufferedLines(0), firstBufferedTick(0) {}
+
+#if defined(DEBUG_HAS_CPP11)
+    /**
+     * @brief Moves the buffered output of other into a new stream.
+     *
+     * A spilled heap block changes hands and inline contents are copied, so this never
+     * allocates. The moved-from stream is left empty and writes nothing when destroyed.
+     */
+    DebugStream(DebugStream&& other)
+        : adapter(nullptr), policy(other.policy), enabled(other.enabled), level(other.level), lineStart(true),
+          scanned(0), bufferedLines(0), firstBufferedTick(0) {
+        TakeFrom(other);
+    }
+
+    // Writes this stream's own output first, then moves other's into it
+    DebugStream& operator=(DebugStream&& other) {
+        if (this != &other) {
+            Flush();
+            TakeFrom(other);
+        }
+        return *this;
+    }
+
+    DebugStream(const DebugStream& other) = delete;
+    DebugStream& operator=(const DebugStream& other) = delete;
+#else
+    // Without move semantics, copying transfers the buffered output like std::auto_ptr,
+    // so returning a stream from Debug() never copies or allocates
+    DebugStream(const DebugStream& other)
+        : adapter(nullptr), policy(other.policy), enabled(other.enabled), level(other.level), lineStart(true),
+          scanned(0), bufferedLines(0), firstBufferedTick(0) {
+        TakeFrom(const_cast<DebugStream&>(other));
+    }
+
+    DebugStream& operator=(const DebugStream& other) {
+        if (this != &other) {
+            Flush();
+            TakeFrom(const_cast<DebugStream&>(other));
+        }
+        return *this;
+    }
+#endif
+
+    ~DebugStream() {
+        Flush();
+        DebugDetail::ReleaseAdapter(adapter);
+    }
+
+    /**
+     * @brief Flushes the current contents of the buffer to the debug output.
+     *
+     * This function sends the current contents of the buffer to the registered sinks,
+     * by default OutputDebugStringW, or hands them to the output thread if
+     * DebugEnableAsync() is active. After flushing, it clears the buffer for future use.
+     * If the buffer is empty and no field was attached, nothing is written.
+     */
+    inline void Flush() {
+        if (buffer.Empty() && fields.Size() == 0) return;
+
+        DebugRecord record;
+        record.length = buffer.Size();
+        record.text = buffer.CStr();
+        record.level = level;
+        record.format = nullptr;
+        record.fields = fields.Size() ? fields.Data() : nullptr;
+        record.fieldsSize = fields.Size();
+        record.arguments = nullptr;
+        record.argumentsSize = 0;
+        record.prefix = 0;
+        record.threadId = 0;
+        record.timestamp = 0;
+        record.sequence = 0;
+        Stamp(record, true);
+        DebugDetail::WriteOutput(record);
+        buffer.Clear();
+        fields.Clear();
+        ResetPolicyState();
+    }
+
+    /**
+     * @brief Bounds the memory a buffered stream uses for very long output.
+     *
+     * Once the buffer holds windowCharacters or more, the completed lines in it are
+     * written and only the unfinished last line is kept. Hex dumps are formatted and
+     * written a window of rows at a time, even with auto-flush, so that a dump of a
+     * large image never exists as a whole in memory:
+     *
+     *   Debug().Streaming() << DebugHex(image, imageSize, 0);
+     *
+     * @param windowCharacters The window size in characters, or 0 to buffer everything again.
+     * @return DebugStream& A reference to the current DebugStream object.
+     */
+    inline DebugStream& Streaming(size_t windowCharacters = DEBUG_STREAM_WINDOW) {
+        policy.maxCharacters = windowCharacters;
+        return *this;
+    }
+
+    /**
+     * @brief Replaces the flush policy; see DebugFlushPolicy.
+     *
+     * What is already buffered is kept and written under the new policy.
+     *
+     * @param flushPolicy When buffered output is written.
+     * @return DebugStream& A reference to the current DebugStream object.
+     */
+    inline DebugStream& SetFlushPolicy(const DebugFlushPolicy& flushPolicy) {
+        policy = flushPolicy;
+        scanned = 0;
+        bufferedLines = 0;
+        firstBufferedTick = 0;
+        return *this;
+    }
+
+    /**
+     * @brief Overloaded insertion operator for DebugStream.
+     * 
+     * This template function allows any type T to be inserted into the DebugStream.
+     * The value is first inserted into the internal buffer. If auto-flush is enabled,
+     * the buffer is flushed immediately after the insertion.
+     * 
+     * @tparam T The type of the value to be inserted into the DebugStream.
+     * @param value The value to be inserted into the DebugStream.
+     * @return DebugStream& A reference to the current DebugStream object.
+     */
+    template<typename T>
+    inline DebugStream& operator<<(const T& value) {
+        if (!enabled) return *this;
+        Insert(value);
+        FlushIfNeeded();
+        return *this;
+    }
+
+    /**
+     * @brief Inserts the result of a DebugLazy() function, calling it only if the stream is enabled.
+     *
+     * The result goes through operator<< as if it had been inserted directly. Callables
+     * that take a DebugStream& (C++11) are called with this stream instead, so that a
+     * description made of several insertions is also only built when it is written:
+     * @code
+     *     Debug() << L"Queue: " << [&](DebugStream& out) { for (const Job& job : queue) out << job.id << L' '; };
+     * @endcode
+     */
+    template<typename F>
+    inline DebugStream& operator<<(const DebugLazyValue<F>& value) {
+        if (!enabled) return *this;
+        return *this << value.function();
+    }
+
+    /**
+     * @brief Inserts the elements of an array as a list, e.g. "[1, 2, 3]".
+     *
+     * Character arrays are still written as strings. At most DEBUG_RANGE_MAX_ELEMENTS
+     * elements are written; use DebugRange() for another limit.
+     */
+    template<typename T, size_t N>
+    inline DebugStream& operator<<(const T (&array)[N]) {
+        if (!enabled) return *this;
+        InsertArray(array);
+        FlushIfNeeded();
+        return *this;
+    }
+
+    // For endl and other basic_ostream manipulators
+    /**
+     * Overloaded operator<< for DebugStream to handle wide character stream manipulators.
+     *
+     * This function allows the use of standard wide character stream manipulators (such as std::endl)
+     * with the DebugStream class. std::endl appends a newline and std::flush does nothing, since
+     * the buffer is only written by Flush(). The buffer is flushed if auto-flush is enabled.
+     *
+     * @param manip A function pointer to a wide character stream manipulator.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(OstreamManipulator manip) {
+        if (!enabled) return *this;
+        if (manip == static_cast<OstreamManipulator>(std::endl)) {
+            buffer.Append(L'\n');
+        } else if (manip != static_cast<OstreamManipulator>(std::flush)) {
+            InsertFallback(manip);
+        }
+        FlushIfNeeded();
+        return *this;
+    }
+
+    // For ios_base manipulators (hex, dec, etc)
+    /**
+     * Overloads the insertion operator to handle stream manipulators.
+     *
+     * This function allows the use of standard stream manipulators (such as std::hex)
+     * with the DebugStream class. Standard manipulators update the formatting state
+     * directly, and the buffer is flushed if auto-flush is enabled.
+     *
+     * @param manip A function pointer to a stream manipulator.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(std::ios_base& (*manip)(std::ios_base&)) {
+        if (!enabled) return *this;
+        if (!DebugDetail::ApplyManipulator(state, manip)) {
+            InsertFallback(manip);
+        }
+        FlushIfNeeded();
+        return *this;
+    }
+
+    // For basic_ios manipulators
+    /**
+     * Overloaded insertion operator for handling stream manipulators.
+     *
+     * This operator allows the use of stream manipulators (such as std::endl) with the DebugStream class.
+     *
+     * @param manip A function pointer to a stream manipulator that takes and returns a reference to a std::basic_ios<wchar_t> object.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(std::basic_ios<wchar_t>& (*manip)(std::basic_ios<wchar_t>&)) {
+        if (!enabled) return *this;
+        InsertFallback(manip);
+        FlushIfNeeded();
+        return *this;
+    }
+
+    // Specialized handling for C-style strings
+    /**
+     * @brief Overloaded insertion operator for DebugStream to handle C-style strings.
+     * 
+     * This operator allows you to use the insertion operator (<<) with C-style strings
+     * (const char*) to output them to the DebugStream. It converts the input string
+     * and outputs it using the ConvertAndOutput function.
+     * 
+     * @param value The C-style string to be output to the DebugStream.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(const char* value) {
+        if (!enabled) return *this;
+        ConvertAndOutput(value);
+        return *this;
+    }
+
+    // Keeps non-const strings from being printed as pointers by the template overload
+    inline DebugStream& operator<<(char* value) {
+        if (!enabled) return *this;
+        ConvertAndOutput(value);
+        return *this;
+    }
+
+    // Specialized handling for std::string
+    /**
+     * @brief Overloaded insertion operator for DebugStream to handle std::string.
+     * 
+     * This operator allows a DebugStream object to accept a std::string and 
+     * output its content by passing its data and size to the ConvertAndOutput
+     * function. Embedded null characters are output as well.
+     * 
+     * @param value The std::string to be output.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(const std::string& value) {
+        if (!enabled) return *this;
+        ConvertAndOutput(value.data(), value.size());
+        return *this;
+    }
+
+#if defined(DEBUG_HAS_STRING_VIEW)
+    /**
+     * @brief Overloaded insertion operator for std::string_view.
+     *
+     * The viewed characters are converted with their exact length, so the view does
+     * not need to be null-terminated.
+     *
+     * @param value The std::string_view to be output.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(std::string_view value) {
+        if (!enabled) return *this;
+        ConvertAndOutput(value.data(), value.size());
+        return *this;
+    }
+#endif
+
+    // Direct wide string handling
+    /**
+     * @brief Overloaded insertion operator for wide character strings.
+     *
+     * This operator allows wide character strings (const wchar_t*) to be inserted
+     * into the DebugStream. If the value is not null, it appends the string to the
+     * internal buffer. If auto-flush is enabled, it will automatically flush the buffer.
+     *
+     * @param value The wide character string to be inserted into the DebugStream.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(const wchar_t* value) {
+        if (!enabled) return *this;
+        if (value) {
+            DebugDetail::FormatString(buffer, state, value, std::char_traits<wchar_t>::length(value));
+            FlushIfNeeded();
+        }
+        return *this;
+    }
+
+    // Keeps non-const strings from being printed as pointers by the template overload
+    inline DebugStream& operator<<(wchar_t* value) {
+        return *this << static_cast<const wchar_t*>(value);
+    }
+
+    /**
+     * @brief Overloaded insertion operator for std::wstring.
+     *
+     * This operator allows you to insert a std::wstring into the DebugStream.
+     * The value is appended to the internal buffer. If auto-flush is enabled,
+     * the buffer is flushed immediately after the value is inserted.
+     *
+     * @param value The std::wstring to be inserted into the DebugStream.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(const std::wstring& value) {
+        if (!enabled) return *this;
+        DebugDetail::FormatString(buffer, state, value.data(), value.size());
+        FlushIfNeeded();
+        return *this;
+    }
+
+#if defined(DEBUG_HAS_STRING_VIEW)
+    /**
+     * @brief Overloaded insertion operator for std::wstring_view.
+     *
+     * The viewed characters are appended with their exact length, so the view does
+     * not need to be null-terminated.
+     *
+     * @param value The std::wstring_view to be output.
+     * @return A reference to the current DebugStream object.
+     */
+    inline DebugStream& operator<<(std::wstring_view value) {
+        if (!enabled) return *this;
+        DebugDetail::FormatString(buffer, state, value.data(), value.size());
+        FlushIfNeeded();
+        return *this;
+    }
+#endif
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+    /**
+     * @brief Appends text built from a format string, in the style of std::format.
+     *
+     * Each {} or {:spec} is replaced by the next argument, formatted straight into the
+     * buffer by the overload for its type; {{ and }} output literal braces. The spec is
+     * [[fill]align][sign][#][0][width][.precision][type], with align one of < > ^,
+     * sign +, and type d x X o for integers, f F e E g G a A for floating point, s for
+     * strings and bool, c for characters and p for pointers. Each placeholder is
+     * formatted on its own, independent of the manipulators inserted into the stream.
+     * @code
+     *     Debug().Format(L"x={} y={:#x} name={:>8}", x, y, name);
+     * @endcode
+     *
+     * @param format The format string, checked against the arguments at compile time
+     * when consteval is available; see DebugFormatString.
+     * @param args The values to format.
+     * @return A reference to the current DebugStream object.
+     * @throws std::invalid_argument If a narrow string argument is null.
+     * @throws std::runtime_error If a narrow string argument cannot be converted.
+     */
+    template<typename... Args>
+    inline DebugStream& Format(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...> format, const Args&... args) {
+        if (!enabled) return *this;
+        FormatRest(format.Text(), args...);
+        FlushIfNeeded();
+        return *this;
+    }
+
+    /**
+     * @brief Attaches a named value to the statement, to be written with its text.
+     *
+     * The value is copied in binary with its type, not formatted. It only becomes text
+     * when the record reaches the sinks, on the output thread with DebugEnableAsync():
+     * the message is followed by key=value for each field, before its final line break.
+     * Sinks can also read the fields from DebugRecord::fields with DebugReadField(), as
+     * DebugEtwSink does. Takes the types DebugDeferred() can capture, which are
+     * arithmetic types, characters, pointers and strings.
+     * @code
+     *     Debug().With(L"request", id).With(L"latency_us", elapsed) << L"done";
+     *     // Outputs: done request=42 latency_us=180
+     * @endcode
+     *
+     * @param key The field name.
+     * @param value The value.
+     * @return A reference to the current DebugStream object.
+     * @throws std::invalid_argument If key or a narrow string value is null.
+     */
+    template<typename T>
+    inline DebugStream& With(const wchar_t* key, const T& value) {
+        if (!enabled) return *this;
+        DebugDetail::AppendField(fields, key, value);
+        return *this;
+    }
+#endif
+
+    /**
+     * @brief Writes length bytes of a narrow string to the stream.
+     *
+     * Like std::ostream::write, this is unformatted output: the field width is neither
+     * applied nor reset. The string does not need to be null-terminated, which makes
+     * this suitable for slices of larger buffers such as packets or parser tokens.
+     *
+     * @param str The narrow string to be converted and output.
+     * @param length The number of bytes to write.
+     * @return A reference to the current DebugStream object.
+     * @throws std::invalid_argument If str is null and length is not zero.
+     */
+    inline DebugStream& Write(const char* str, size_t length) {
+        if (!enabled) return *this;
+        if (!str && length != 0) {
+            throw std::invalid_argument("Null string pointer");
+        }
+
+        DebugDetail::AppendNarrow(buffer, str, length);
+        FlushIfNeeded();
+        return *this;
+    }
+
+    /**
+     * @brief Writes length characters of a wide string to the stream.
+     *
+     * Like std::ostream::write, this is unformatted output: the field width is neither
+     * applied nor reset. The string does not need to be null-terminated.
+     *
+     * @param str The wide string to be output.
+     * @param length The number of characters to write.
+     * @return A reference to the current DebugStream object.
+     * @throws std::invalid_argument If str is null and length is not zero.
+     */
+    inline DebugStream& Write(const wchar_t* str, size_t length) {
+        if (!enabled) return *this;
+        if (!str && length != 0) {
+            throw std::invalid_argument("Null string pointer");
+        }
+
+        buffer.Append(str, length);
+        FlushIfNeeded();
+        return *this;
+    }
+};
+
+namespace DebugDetail {
+
+/**
+ * @struct DeferredFormatter
+ * @brief Turns DebugDeferred() records into text with the DebugStream formatting rules.
+ */
+struct DeferredFormatter {
+    template<typename T>
+    static T Load(const char* payload) {
+        T value;
+        std::char_traits<char>::copy(reinterpret_cast<char*>(&value), payload, sizeof(T));
+        return value;
+    }
+
+    // Formats one captured value of the given DeferredTag, size bytes at payload
+    static void InsertValue(DebugStream& stream, unsigned int tag, const char* payload, size_t size, const FormatSpec& spec) {
+        switch (tag) {
+        case DeferredBool: stream.FormatArgument(Load<bool>(payload), spec); break;
+        case DeferredChar: stream.FormatArgument(Load<char>(payload), spec); break;
+        case DeferredWChar: stream.FormatArgument(Load<wchar_t>(payload), spec); break;
+        case DeferredSChar: stream.FormatArgument(Load<signed char>(payload), spec); break;
+        case DeferredUChar: stream.FormatArgument(Load<unsigned char>(payload), spec); break;
+        case DeferredShort: stream.FormatArgument(Load<short>(payload), spec); break;
+        case DeferredUShort: stream.FormatArgument(Load<unsigned short>(payload), spec); break;
+        case DeferredInt: stream.FormatArgument(Load<int>(payload), spec); break;
+        case DeferredUInt: stream.FormatArgument(Load<unsigned int>(payload), spec); break;
+        case DeferredLong: stream.FormatArgument(Load<long>(payload), spec); break;
+        case DeferredULong: stream.FormatArgument(Load<unsigned long>(payload), spec); break;
+        case DeferredLongLong: stream.FormatArgument(Load<long long>(payload), spec); break;
+        case DeferredULongLong: stream.FormatArgument(Load<unsigned long long>(payload), spec); break;
+        case DeferredFloat: stream.FormatArgument(Load<float>(payload), spec); break;
+        case DeferredDouble: stream.FormatArgument(Load<double>(payload), spec); break;
+        case DeferredLongDouble: stream.FormatArgument(Load<long double>(payload), spec); break;
+        case DeferredPointer: stream.FormatArgument(Load<const void*>(payload), spec); break;
+        case DeferredNarrowString: stream.FormatArgument(NarrowText(payload, size), spec); break;
+        case DeferredWideString:
+            stream.FormatArgument(WideText(reinterpret_cast<const wchar_t*>(payload), size / sizeof(wchar_t)), spec);
+            break;
+        }
+    }
+
+    // Formats one captured argument with its placeholder's spec and returns the entry after it
+    static const char* InsertArgument(DebugStream& stream, const char* entry, const FormatSpec& spec) {
+        const DeferredArgument* argument = reinterpret_cast<const DeferredArgument*>(entry);
+        InsertValue(stream, argument->tag, entry + sizeof(DeferredArgument), argument->size, spec);
+        return entry + DeferredAlign(sizeof(DeferredArgument) + argument->size);
+    }
+
+    /**
+     * @brief Appends the formatted record to the stream.
+     *
+     * The format is interpreted like DebugStream::Format(). Placeholders without a
+     * matching argument and unpaired braces are output as they are, and extra arguments
+     * are ignored.
+     */
+    static void Format(DebugStream& stream, const DeferredRecord& record) {
+        const char* entry = reinterpret_cast<const char*>(&record) + DeferredRecordHeaderSize;
+        unsigned int remaining = record.argumentCount;
+        const wchar_t* text = record.format;
+        FormatToken token;
+        for (;;) {
+            text = NextFormatToken(text, token);
+            if (token.kind == FormatTokenEnd) break;
+            if (token.kind == FormatTokenPlaceholder && remaining != 0) {
+                entry = InsertArgument(stream, entry, token.spec);
+                --remaining;
+            } else {
+                stream.buffer.Append(token.begin, static_cast<size_t>(token.end - token.begin));
+            }
+        }
+    }
+
+    // Formats a record on the output thread and writes it without queueing it again
+    static void Write(const DeferredRecord& record) {
+        DebugStream stream(false, true);
+        try {
+            Format(stream, record);
+        } catch (const std::exception&) {
+            // A record that cannot be converted is dropped rather than ending the output thread
+            stream.buffer.Clear();
+        }
+        if (!stream.buffer.Empty()) {
+            DebugRecord output;
+            output.length = stream.buffer.Size();
+            output.text = stream.buffer.CStr();
+            output.level = DEBUG_LEVEL_DEBUG;
+            output.format = record.format;
+            output.fields = nullptr;
+            output.fieldsSize = 0;
+            output.arguments = reinterpret_cast<const char*>(&record) + DeferredRecordHeaderSize;
+            output.argumentsSize = record.size - DeferredRecordHeaderSize;
+            output.prefix = 0;
+            output.threadId = 0;
+            output.timestamp = 0;
+            output.sequence = 0;
+            WriteOutputNow(output);
+            stream.buffer.Clear();
+        }
+    }
+
+    // Writes a record with its prefix before the text and " key=value" after it for every field
+    static void WriteDecorated(const DebugRecord& record) {
+        DebugStream stream(false, true);
+        try {
+            AppendPrefix(stream.buffer, record);
+            size_t textStart = stream.buffer.Size();
+            size_t length = record.length;
+            bool lineBreak = length != 0 && record.text[length - 1] == L'\n';
+            if (lineBreak) --length;
+            stream.buffer.Append(record.text, length);
+
+            size_t offset = 0;
+            DebugField field;
+            while (DebugReadField(record.fields, record.fieldsSize, offset, field)) {
+                if (stream.buffer.Size() != textStart) stream.buffer.Append(L' ');
+                stream.buffer.Append(field.key, field.keyLength);
+                stream.buffer.Append(L'=');
+                InsertValue(stream, static_cast<unsigned int>(field.type), static_cast<const char*>(field.value), field.size, FormatSpec());
+            }
+            if (lineBreak) stream.buffer.Append(L'\n');
+        } catch (const std::exception&) {
+            // Fields that cannot be converted are left out rather than losing the message
+            stream.buffer.Clear();
+            DebugRecord plain = record;
+            plain.prefix = 0;
+            DispatchOutput(plain);
+            return;
+        }
+
+        DebugRecord output = record;
+        output.length = stream.buffer.Size();
+        output.text = stream.buffer.CStr();
+        DispatchOutput(output);
+        stream.buffer.Clear();
+    }
+};
+
+inline void WriteDecoratedNow(const DebugRecord& record) {
+    DeferredFormatter::WriteDecorated(record);
+}
+
+inline void DrainDeferred() {
+    DeferredState& deferred = GetDeferredState();
+    if (!ReadPointerAcquire(&deferred.rings)) return;
+
+    AcquireSRWLockExclusive(&deferred.drainLock);
+    DeferredRing* ring = static_cast<DeferredRing*>(ReadPointerAcquire(&deferred.rings));
+    for (; ring; ring = ring->next) {
+        LONG64 tail = ReadNoFence64(&ring->tail);
+        LONG64 head = ReadAcquire64(&ring->head);
+        while (tail != head) {
+            const DeferredRecord* record = reinterpret_cast<const DeferredRecord*>(ring->data + (static_cast<size_t>(tail) & ring->mask));
+            if (record->argumentCount != DeferredPadding) DeferredFormatter::Write(*record);
+            tail += record->size;
+            WriteRelease64(&ring->tail, tail);
+        }
+    }
+    ReleaseSRWLockExclusive(&deferred.drainLock);
+}
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+
+/**
+ * @struct DeferredTraits
+ * @brief How DebugDeferred() and DebugStream::With() capture a value of type T.
+ *
+ * Size() returns the number of payload bytes and Store() copies them. Only types
+ * whose bytes can be formatted later are supported.
+ */
+template<typename T>
+struct DeferredTraits {
+    static_assert(sizeof(T) == 0, "DebugDeferred() and With() capture arithmetic types, characters, pointers and strings only");
+};
+
+template<typename T, DeferredTag ValueTag>
+struct DeferredValueTraits {
+    static const unsigned int Tag = ValueTag;
+    static size_t Size(const T&) { return sizeof(T); }
+    static void Store(char* out, const T& value, size_t) {
+        std::char_traits<char>::copy(out, reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+};
+
+template<> struct DeferredTraits<bool> : DeferredValueTraits<bool, DeferredBool> {};
+template<> struct DeferredTraits<char> : DeferredValueTraits<char, DeferredChar> {};
+template<> struct DeferredTraits<wchar_t> : DeferredValueTraits<wchar_t, DeferredWChar> {};
+template<> struct DeferredTraits<signed char> : DeferredValueTraits<signed char, DeferredSChar> {};
+template<> struct DeferredTraits<unsigned char> : DeferredValueTraits<unsigned char, DeferredUChar> {};
+template<> struct DeferredTraits<short> : DeferredValueTraits<short, DeferredShort> {};
+template<> struct DeferredTraits<unsigned short> : DeferredValueTraits<unsigned short, DeferredUShort> {};
+template<> struct DeferredTraits<int> : DeferredValueTraits<int, DeferredInt> {};
+template<> struct DeferredTraits<unsigned int> : DeferredValueTraits<unsigned int, DeferredUInt> {};
+template<> struct DeferredTraits<long> : DeferredValueTraits<long, DeferredLong> {};
+template<> struct DeferredTraits<unsigned long> : DeferredValueTraits<unsigned long, DeferredULong> {};
+template<> struct DeferredTraits<long long> : DeferredValueTraits<long long, DeferredLongLong> {};
+template<> struct DeferredTraits<unsigned long long> : DeferredValueTraits<unsigned long long, DeferredULongLong> {};
+template<> struct DeferredTraits<float> : DeferredValueTraits<float, DeferredFloat> {};
+template<> struct DeferredTraits<double> : DeferredValueTraits<double, DeferredDouble> {};
+template<> struct DeferredTraits<long double> : DeferredValueTraits<long double, DeferredLongDouble> {};
+
+// Pointers print their address, as with DebugStream
+template<typename T>
+struct DeferredTraits<T*> {
+    static const unsigned int Tag = DeferredPointer;
+    static size_t Size(const T*) { return sizeof(const void*); }
+    static void Store(char* out, const T* value, size_t) {
+        const void* address = value;
+        std::char_traits<char>::copy(out, reinterpret_cast<const char*>(&address), sizeof(address));
+    }
+};
+
+// Strings are copied, since the caller's buffer may be gone by the time they are formatted
+struct DeferredNarrowTraits {
+    static const unsigned int Tag = DeferredNarrowString;
+    static size_t Size(const char* str) {
+        if (!str) throw std::invalid_argument("Null string pointer");
+        return std::char_traits<char>::length(str);
+    }
+    static size_t Size(const std::string& str) { return str.size(); }
+    static void Store(char* out, const char* str, size_t size) { std::char_traits<char>::copy(out, str, size); }
+    static void Store(char* out, const std::string& str, size_t size) { Store(out, str.data(), size); }
+#if defined(DEBUG_HAS_STRING_VIEW)
+    static size_t Size(std::string_view str) { return str.size(); }
+    static void Store(char* out, std::string_view str, size_t size) { Store(out, str.data(), size); }
+#endif
+};
+
+// Like DebugStream, a null wide string outputs nothing
+struct DeferredWideTraits {
+    static const unsigned int Tag = DeferredWideString;
+    static size_t Size(const wchar_t* str) { return str ? std::char_traits<wchar_t>::length(str) * sizeof(wchar_t) : 0; }
+    static size_t Size(const std::wstring& str) { return str.size() * sizeof(wchar_t); }
+    static void Store(char* out, const wchar_t* str, size_t size) {
+        if (size) std::char_traits<char>::copy(out, reinterpret_cast<const char*>(str), size);
+    }
+    static void Store(char* out, const std::wstring& str, size_t size) { Store(out, str.data(), size); }
+#if defined(DEBUG_HAS_STRING_VIEW)
+    static size_t Size(std::wstring_view str) { return str.size() * sizeof(wchar_t); }
+    static void Store(char* out, std::wstring_view str, size_t size) { Store(out, str.data(), size); }
+#endif
+};
+
+template<> struct DeferredTraits<const char*> : DeferredNarrowTraits {};
+template<> struct DeferredTraits<char*> : DeferredNarrowTraits {};
+template<size_t N> struct DeferredTraits<char[N]> : DeferredNarrowTraits {};
+template<> struct DeferredTraits<std::string> : DeferredNarrowTraits {};
+template<> struct DeferredTraits<const wchar_t*> : DeferredWideTraits {};
+template<> struct DeferredTraits<wchar_t*> : DeferredWideTraits {};
+template<size_t N> struct DeferredTraits<wchar_t[N]> : DeferredWideTraits {};
+template<> struct DeferredTraits<std::wstring> : DeferredWideTraits {};
+#if defined(DEBUG_HAS_STRING_VIEW)
+template<> struct DeferredTraits<std::string_view> : DeferredNarrowTraits {};
+template<> struct DeferredTraits<std::wstring_view> : DeferredWideTraits {};
+#endif
+
+template<typename T>
+inline void AppendField(FieldBuffer& fields, const wchar_t* key, const T& value) {
+    if (!key) {
+        throw std::invalid_argument("Null field key");
+    }
+    size_t keySize = std::char_traits<wchar_t>::length(key) * sizeof(wchar_t);
+    size_t valueSize = DeferredTraits<T>::Size(value);
+    if (keySize > UINT_MAX / 2 || valueSize > UINT_MAX / 2) throw std::runtime_error("String too long");
+
+    size_t keyEntry = DeferredAlign(sizeof(DeferredArgument) + keySize);
+    size_t size = keyEntry + DeferredAlign(sizeof(DeferredArgument) + valueSize);
+    char* out = fields.Reserve(size);
+    // Clear the padding too, so that records written out raw are reproducible
+    memset(out, 0, size);
+    DeferredArgument* argument = reinterpret_cast<DeferredArgument*>(out);
+    argument->tag = DeferredWideString;
+    argument->size = static_cast<unsigned int>(keySize);
+    DeferredWideTraits::Store(out + sizeof(DeferredArgument), key, keySize);
+    argument = reinterpret_cast<DeferredArgument*>(out + keyEntry);
+    argument->tag = DeferredTraits<T>::Tag;
+    argument->size = static_cast<unsigned int>(valueSize);
+    DeferredTraits<T>::Store(out + keyEntry + sizeof(DeferredArgument), value, valueSize);
+    fields.Commit(size);
+}
+
+inline void DeferredStore(char*, const size_t*) {}
+
+template<typename T, typename... Rest>
+inline void DeferredStore(char* out, const size_t* sizes, const T& value, const Rest&... rest) {
+    DeferredArgument* argument = reinterpret_cast<DeferredArgument*>(out);
+    argument->tag = DeferredTraits<T>::Tag;
+    argument->size = static_cast<unsigned int>(*sizes);
+    DeferredTraits<T>::Store(out + sizeof(DeferredArgument), value, *sizes);
+    DeferredStore(out + DeferredAlign(sizeof(DeferredArgument) + *sizes), sizes + 1, rest...);
+}
+
+template<typename... Args>
+inline void DeferredWriteRecord(char* out, size_t size, const wchar_t* format, const size_t* sizes, const Args&... args) {
+    DeferredRecord* record = reinterpret_cast<DeferredRecord*>(out);
+    record->size = static_cast<unsigned int>(size);
+    record->argumentCount = static_cast<unsigned int>(sizeof...(Args));
+    record->format = format;
+    DeferredStore(out + DeferredRecordHeaderSize, sizes, args...);
+}
+
+/**
+ * @brief Copies a DebugDeferred() statement into the calling thread's ring.
+ *
+ * Without a running output thread, or if the record can never fit in the ring, the
+ * statement is formatted and written on the calling thread instead.
+ */
+template<typename... Args>
+inline void DeferredCapture(const wchar_t* format, const Args&... args) {
+    if (!format) {
+        throw std::invalid_argument("Null format string");
+    }
+
+    size_t sizes[sizeof...(Args) + 1] = { DeferredTraits<Args>::Size(args)..., 0 };
+    size_t size = DeferredRecordHeaderSize;
+    for (size_t i = 0; i < sizeof...(Args); ++i) {
+        if (sizes[i] > UINT_MAX / 2) throw std::runtime_error("String too long");
+        size += DeferredAlign(sizeof(DeferredArgument) + sizes[i]);
+    }
+
+    AsyncState& async = GetAsyncState();
+    DeferredRing* ring = ReadAcquire(&async.running) ? GetDeferredRing() : nullptr;
+    if (ring && size <= (ring->mask + 1) / 2) {
+        char* out;
+        while (!(out = DeferredReserve(*ring, size))) {
+            if (ReadNoFence(&async.policy) != DebugOverflowBlock) {
+                // Only the output thread may discard queued records, so both drop policies drop this one
+                InterlockedIncrement64(&async.dropped);
+                return;
+            }
+            if (ReadAcquire(&async.running)) {
+                AsyncWakeConsumer(async);
+                SwitchToThread();
+            } else {
+                DrainDeferred();
+            }
+        }
+        DeferredWriteRecord(out, size, format, sizes, args...);
+        DeferredCommit(*ring, size);
+
+        // Pairs with AsyncStop(), as in AsyncPush()
+        MemoryBarrier();
+        if (ReadNoFence(&async.running)) {
+            AsyncWakeConsumer(async);
+        } else {
+            DrainDeferred();
+        }
+        return;
+    }
+
+    LONG64 local[32];
+    char* record = size <= sizeof(local) ? reinterpret_cast<char*>(local) : new char[size];
+    try {
+        DeferredWriteRecord(record, size, format, sizes, args...);
+        DebugStream stream(false, true);
+        DeferredFormatter::Format(stream, *reinterpret_cast<const DeferredRecord*>(record));
+    } catch (...) {
+        if (record != reinterpret_cast<char*>(local)) delete[] record;
+        throw;
+    }
+    if (record != reinterpret_cast<char*>(local)) delete[] record;
+}
+
+#endif
+
+} // namespace DebugDetail
+
+/**
+ * @class DebugFileSink
+ * @brief Appends records to a memory-mapped log file, rolling to a new file when full.
+ *
+ * The file is created at its full size and mapped into memory, so appending a record
+ * costs one atomic fetch-add and a copy, without a system call. Records are written
+ * as UTF-16LE lines after a byte order mark, or with DebugFileRecords as
+ * DebugRecordFrame records that keep the fields and the arguments of DebugDeferred()
+ * statements in binary, for DebugReadRecordFrame(). When a file is full, the next one is
+ * named after the first with a counter appended (app.log, app.log.1, app.log.2, ...).
+ * Each file is truncated to the data actually written when it is closed.
+ *
+ * A file that has been rolled over is closed as soon as the last thread that was still
+ * copying into it is done, so only the current file stays mapped. Remove the sink
+ * with DebugRemoveSink() before destroying it.
+ */
+class DebugFileSink : public DebugSink {
+public:
+    /**
+     * @brief Creates the first log file and maps it.
+     *
+     * @param filePath Path of the first log file. Existing files are overwritten.
+     * @param fileSize Size of each file in bytes.
+     * @param fileFormat Whether to write text lines or binary records.
+     * @throws std::invalid_argument If filePath is null or fileSize is too small.
+     * @throws std::runtime_error If the file cannot be created or mapped.
+     */
+    explicit DebugFileSink(const wchar_t* filePath, size_t fileSize = 16 * 1024 * 1024, DebugFileFormat fileFormat = DebugFileText)
+        : current(nullptr), fileCount(0), dropped(0), segmentSize(fileSize), format(fileFormat) {
+        if (!filePath) {
+            throw std::invalid_argument("Null file path");
+        }
+        if (fileSize < 4096) {
+            throw std::invalid_argument("Log file size too small");
+        }
+
+        path = filePath;
+        InitializeSRWLock(&rollLock);
+        current = OpenSegment();
+        if (!current) {
+            throw std::runtime_error("Failed to create the log file");
+        }
+    }
+
+#if defined(DEBUG_HAS_CPP11)
+    DebugFileSink(const DebugFileSink&) = delete;
+    DebugFileSink& operator=(const DebugFileSink&) = delete;
+#endif
+
+    ~DebugFileSink() {
+        Segment* segment = static_cast<Segment*>(current);
+        while (segment) {
+            Segment* previous = segment->previous;
+            if (!segment->closed) CloseSegment(segment);
+            delete segment;
+            segment = previous;
+        }
+    }
+
+    virtual void Write(const DebugRecord& record) {
+        // Every record becomes one line, or one frame
+        bool newline = record.length == 0 || record.text[record.length - 1] != L'\n';
+        size_t formatLength = format == DebugFileRecords && record.format ? wcslen(record.format) : 0;
+        size_t bytes = format == DebugFileText ? LineBytes(record, newline) : FrameBytes(record, formatLength);
+        if (bytes == 0 || bytes > segmentSize - HeaderSize()) {
+            InterlockedIncrement64(&dropped);
+            return;
+        }
+
+        for (;;) {
+            Segment* segment = Acquire();
+            LONG64 offset = InterlockedExchangeAdd64(&segment->used, static_cast<LONG64>(bytes));
+            if (static_cast<ULONGLONG>(offset) + bytes <= segment->size) {
+                char* out = segment->view + offset;
+                if (format == DebugFileText) {
+                    CopyLine(out, record, newline);
+                } else {
+                    CopyFrame(out, record, formatLength, bytes);
+                }
+                Release(segment);
+                return;
+            }
+
+            // The file is full: remember where its data ends and move on to the next file
+            LONG64 end = ReadNoFence64(&segment->end);
+            while (offset < end) {
+                LONG64 previous = InterlockedCompareExchange64(&segment->end, offset, end);
+                if (previous == end) break;
+                end = previous;
+            }
+            bool rolled = Roll(segment);
+            Release(segment);
+            if (!rolled) {
+                InterlockedIncrement64(&dropped);
+                return;
+            }
+        }
+    }
+
+    // Asks the system to write the mapped data of the current file to disk
+    virtual void Flush() {
+        Segment* segment = Acquire();
+        FlushViewOfFile(segment->view, 0);
+        Release(segment);
+    }
+
+    /**
+     * @brief Returns how many records were discarded because they did not fit in a
+     * file or a new file could not be created.
+     */
+    unsigned long long DroppedCount() const {
+        return static_cast<unsigned long long>(ReadNoFence64(&dropped));
+    }
+
+private:
+    struct Segment {
+        HANDLE file;
+        HANDLE mapping;
+        char* view;
+        size_t size;
+        volatile LONG64 used;           // Bytes reserved by writers, may exceed size
+        volatile LONG64 end;            // Offset of the first reservation that did not fit
+        volatile LONG writers;          // Threads between Acquire() and Release()
+        volatile LONG retired;          // Set once another file has replaced this one
+        volatile LONG closed;           // Set by the thread that closes the file
+        Segment* previous;              // The file this one replaced; only the struct is kept once closed
+    };
+
+#if !defined(DEBUG_HAS_CPP11)
+    // Not copyable
+    DebugFileSink(const DebugFileSink&);
+    DebugFileSink& operator=(const DebugFileSink&);
+#endif
+
+    // The byte order mark or the signature at the start of every file
+    size_t HeaderSize() const {
+        return format == DebugFileText ? sizeof(wchar_t) : sizeof(DEBUG_RECORD_FILE_SIGNATURE);
+    }
+
+    // Bytes of the record as a line, or 0 if it would not fit in any file
+    size_t LineBytes(const DebugRecord& record, bool newline) const {
+        if (record.length > segmentSize / sizeof(wchar_t)) return 0;
+        return (record.length + (newline ? 2 : 0)) * sizeof(wchar_t);
+    }
+
+    // Bytes of the record as a DebugRecordFrame, or 0 if it would not fit in any file
+    size_t FrameBytes(const DebugRecord& record, size_t formatLength) const {
+        if (record.length >= UINT_MAX || formatLength >= UINT_MAX ||
+            record.fieldsSize >= UINT_MAX || record.argumentsSize >= UINT_MAX) return 0;
+        unsigned long long bytes = sizeof(DebugRecordFrame) + FrameSection((record.length + 1ULL) * sizeof(wchar_t)) +
+            (record.format ? FrameSection((formatLength + 1ULL) * sizeof(wchar_t)) : 0) +
+            FrameSection(record.fieldsSize) + FrameSection(record.argumentsSize);
+        return bytes <= segmentSize && bytes < UINT_MAX ? static_cast<size_t>(bytes) : 0;
+    }
+
+    static unsigned long long FrameSection(unsigned long long bytes) {
+        return (bytes + 7) & ~7ULL;
+    }
+
+    static void CopyLine(char* out, const DebugRecord& record, bool newline) {
+        std::char_traits<char>::copy(out, reinterpret_cast<const char*>(record.text), record.length * sizeof(wchar_t));
+        if (newline) {
+            const wchar_t lineEnd[2] = { L'\r', L'\n' };
+            std::char_traits<char>::copy(out + record.length * sizeof(wchar_t), reinterpret_cast<const char*>(lineEnd), sizeof(lineEnd));
+        }
+    }
+
+    // The file was created zero-filled, so the padding between sections is already there
+    static void CopyFrame(char* out, const DebugRecord& record, size_t formatLength, size_t bytes) {
+        DebugRecordFrame frame;
+        frame.size = static_cast<unsigned int>(bytes);
+        frame.level = record.level;
+        frame.length = static_cast<unsigned int>(record.length);
+        frame.formatLength = record.format ? static_cast<unsigned int>(formatLength) : UINT_MAX;
+        frame.fieldsSize = record.fields ? static_cast<unsigned int>(record.fieldsSize) : 0;
+        frame.argumentsSize = record.arguments ? static_cast<unsigned int>(record.argumentsSize) : 0;
+        frame.prefix = record.prefix;
+        frame.threadId = record.threadId;
+        frame.timestamp = record.timestamp;
+        frame.sequence = record.sequence;
+
+        size_t position = sizeof(frame);
+        std::char_traits<char>::copy(out + position, reinterpret_cast<const char*>(record.text), record.length * sizeof(wchar_t));
+        position += static_cast<size_t>(FrameSection((record.length + 1ULL) * sizeof(wchar_t)));
+        if (record.format) {
+            std::char_traits<char>::copy(out + position, reinterpret_cast<const char*>(record.format), formatLength * sizeof(wchar_t));
+            position += static_cast<size_t>(FrameSection((formatLength + 1ULL) * sizeof(wchar_t)));
+        }
+        if (frame.fieldsSize) {
+            std::char_traits<char>::copy(out + position, static_cast<const char*>(record.fields), frame.fieldsSize);
+            position += static_cast<size_t>(FrameSection(frame.fieldsSize));
+        }
+        if (frame.argumentsSize) {
+            std::char_traits<char>::copy(out + position, static_cast<const char*>(record.arguments), frame.argumentsSize);
+        }
+
+        // The size goes last, so a reader of a crashed process's file never sees a frame
+        // whose header is complete but whose body is not
+        std::char_traits<char>::copy(out + sizeof(frame.size), reinterpret_cast<const char*>(&frame) + sizeof(frame.size), sizeof(frame) - sizeof(frame.size));
+        MemoryBarrier();
+        std::char_traits<char>::copy(out, reinterpret_cast<const char*>(&frame.size), sizeof(frame.size));
+    }
+
+    // Creates, sizes and maps the next file; returns nullptr on failure
+    Segment* OpenSegment() {
+        std::wstring name = path;
+        if (fileCount > 0) {
+            wchar_t digits[16];
+            size_t count = 0;
+            for (unsigned int index = fileCount; index; index /= 10) {
+                digits[count++] = static_cast<wchar_t>(L'0' + index % 10);
+            }
+            name += L'.';
+            while (count) name += digits[--count];
+        }
+
+        HANDLE file = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return nullptr;
+
+        ULONGLONG size = segmentSize;
+        HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+        char* view = mapping ? static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, segmentSize)) : nullptr;
+        Segment* segment = view ? new (std::nothrow) Segment() : nullptr;
+        if (!segment) {
+            if (view) UnmapViewOfFile(view);
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            DeleteFileW(name.c_str());
+            return nullptr;
+        }
+
+        if (format == DebugFileText) {
+            const wchar_t byteOrderMark = 0xFEFF;
+            std::char_traits<char>::copy(view, reinterpret_cast<const char*>(&byteOrderMark), sizeof(byteOrderMark));
+        } else {
+            std::char_traits<char>::copy(view, DEBUG_RECORD_FILE_SIGNATURE, sizeof(DEBUG_RECORD_FILE_SIGNATURE));
+        }
+        segment->file = file;
+        segment->mapping = mapping;
+        segment->view = view;
+        segment->size = segmentSize;
+        segment->used = static_cast<LONG64>(HeaderSize());
+        segment->end = static_cast<LONG64>(segmentSize);
+        segment->writers = 0;
+        segment->retired = 0;
+        segment->closed = 0;
+        segment->previous = nullptr;
+        ++fileCount;
+        return segment;
+    }
+
+    /**
+     * @brief Returns the current file, which stays mapped until the matching Release().
+     *
+     * Segment structs are only freed by the destructor, so a thread that finds the file
+     * it read from current already replaced can still safely drop its reference.
+     */
+    Segment* Acquire() {
+        for (;;) {
+            Segment* segment = static_cast<Segment*>(ReadPointerAcquire(&current));
+            InterlockedIncrement(&segment->writers);
+            if (!ReadAcquire(&segment->retired)) return segment;
+            // Replaced meanwhile; current already points to its successor
+            Release(segment);
+        }
+    }
+
+    // The last thread to leave a replaced file closes it
+    static void Release(Segment* segment) {
+        if (InterlockedDecrement(&segment->writers) == 0 && ReadAcquire(&segment->retired) &&
+            InterlockedCompareExchange(&segment->closed, 1, 0) == 0) {
+            CloseSegment(segment);
+        }
+    }
+
+    // Unmaps a file and cuts off the space that was never written
+    static void CloseSegment(Segment* segment) {
+        LONG64 end = segment->used < segment->end ? segment->used : segment->end;
+        UnmapViewOfFile(segment->view);
+        CloseHandle(segment->mapping);
+
+        LARGE_INTEGER position;
+        position.QuadPart = end;
+        if (SetFilePointerEx(segment->file, position, nullptr, FILE_BEGIN)) {
+            SetEndOfFile(segment->file);
+        }
+        CloseHandle(segment->file);
+        segment->view = nullptr;
+    }
+
+    // Replaces the full segment with a new file, unless another writer already did
+    bool Roll(Segment* full) {
+        AcquireSRWLockExclusive(&rollLock);
+        bool rolled = true;
+        if (current == full) {
+            Segment* next = OpenSegment();
+            if (next) {
+                next->previous = full;
+                WritePointerRelease(&current, next);
+                // The caller still holds full, so its Release() or a later one closes it
+                InterlockedExchange(&full->retired, 1);
+            } else {
+                rolled = false;
+            }
+        }
+        ReleaseSRWLockExclusive(&rollLock);
+        return rolled;
+    }
+
+    PVOID volatile current;             // Segment that records are appended to
+    SRWLOCK rollLock;                   // Serializes opening the next file
+    unsigned int fileCount;             // Files opened so far, used to name the next one
+    volatile LONG64 dropped;
+    std::wstring path;
+    size_t segmentSize;
+    DebugFileFormat format;
+};
+
+/**
+ * @class DebugSharedRingSink
+ * @brief Writes records into a named shared-memory ring that other processes can tail.
+ *
+ * OutputDebugStringW passes every message in the system through one 4 KB DBWIN buffer,
+ * one message at a time, so a busy process makes DebugView drop lines from others.
+ * This sink writes into its own ring instead, the way the flight recorder does: one
+ * atomic fetch-add and a copy, without a lock or a system call. Readers, such as
+ * tools/DebugRingViewer.cpp through DebugSharedRingReader, never hold up writers; the
+ * oldest records are overwritten when the ring is full. Records longer than 1/16 of
+ * the ring are cut off.
+ * @code
+ *     DebugSharedRingSink ring;
+ *     DebugAddSink(&ring);
+ *     DebugRemoveSink(&DebugDefaultSink());   // Optional: no more DBWIN output
+ * @endcode
+ * The ring lives as long as a sink or a reader has it open. Create one sink per name;
+ * a sink created for a name that still exists continues the existing ring.
+ */
+class DebugSharedRingSink : public DebugSink {
+public:
+    /**
+     * @brief Creates the ring and maps it.
+     *
+     * @param capacity Bytes of records, rounded up to a power of two of at least 4096.
+     * @param name The name of the file mapping, or nullptr for DebugSharedRingName() of
+     * this process. Use a "Global\\" name for a service that is read from another session.
+     * @throws std::runtime_error If the ring cannot be created or mapped, or the name
+     * belongs to an object that is not a ring.
+     */
+    explicit DebugSharedRingSink(size_t capacity = DEBUG_SHARED_RING_SIZE, const wchar_t* name = nullptr)
+        : mapping(nullptr), ring(nullptr) {
+        ringName = name ? std::wstring(name) : DebugSharedRingName(GetCurrentProcessId());
+
+        ULONGLONG size = 4096;
+        while (size < capacity && size < SIZE_MAX / 4) size <<= 1;
+        ULONGLONG total = sizeof(DebugDetail::FlightRecorderHeader) + size;
+
+        // Pagefile-backed sections start zeroed, so no stale stamp can match
+        mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(total >> 32), static_cast<DWORD>(total & 0xFFFFFFFF), ringName.c_str());
+        bool existed = mapping && GetLastError() == ERROR_ALREADY_EXISTS;
+        ring = mapping ? static_cast<DebugDetail::FlightRecorderHeader*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0)) : nullptr;
+        if (!ring || (existed && std::char_traits<wchar_t>::compare(ring->signature, L"DebugUtilRing", 14) != 0)) {
+            if (ring) UnmapViewOfFile(ring);
+            if (mapping) CloseHandle(mapping);
+            throw std::runtime_error("Failed to create the shared ring");
+        }
+
+        ring->processId = GetCurrentProcessId();
+        if (!existed) {
+            ring->capacity = static_cast<LONG64>(size);
+            // Readers check the signature, so it is written last
+            MemoryBarrier();
+            std::char_traits<wchar_t>::copy(ring->signature, L"DebugUtilRing", 14);
+        }
+    }
+
+#if defined(DEBUG_HAS_CPP11)
+    DebugSharedRingSink(const DebugSharedRingSink&) = delete;
+    DebugSharedRingSink& operator=(const DebugSharedRingSink&) = delete;
+#endif
+
+    ~DebugSharedRingSink() {
+        UnmapViewOfFile(ring);
+        CloseHandle(mapping);
+    }
+
+    virtual void Write(const DebugRecord& record) {
+        DebugDetail::FlightRecord(ring, record);
+    }
+
+    // The name readers open the ring with
+    const wchar_t* Name() const { return ringName.c_str(); }
+
+private:
+#if !defined(DEBUG_HAS_CPP11)
+    // Not copyable
+    DebugSharedRingSink(const DebugSharedRingSink&);
+    DebugSharedRingSink& operator=(const DebugSharedRingSink&);
+#endif
+
+    HANDLE mapping;
+    DebugDetail::FlightRecorderHeader* ring;
+    std::wstring ringName;
+};
+
+#if defined(DEBUG_ENABLE_ETW)
+/**
+ * @class DebugEtwSink
+ * @brief Writes every record as a TraceLogging event, for capture with WPR, xperf or tracelog.
+ *
+ * Unlike OutputDebugStringW, which serializes all writers on a system-wide mutex,
+ * ETW buffers events per processor and costs almost nothing while no session has
+ * the provider enabled. Each record becomes an event named "DebugMessage" with a
+ * "Message" field and, for DebugDeferred() statements formatted by the output thread,
+ * a "Format" field holding the format string, so that events can be grouped by
+ * statement, and a binary "Arguments" field with the captured arguments for decoding
+ * with DebugReadArgument(). Fields attached with DebugStream::With() are passed raw in
+ * a binary "Fields" field, for decoding with DebugReadField(). Binary fields over
+ * 16 KB are left empty. DEBUG_LEVEL_DEBUG,
+ * _INFO, _WARN and _ERROR map to WINEVENT_LEVEL_VERBOSE, _INFO, _WARNING and _ERROR,
+ * and every event carries the keyword DEBUG_ETW_KEYWORD.
+ *
+ * The provider belongs to the application: define it with TRACELOGGING_DEFINE_PROVIDER
+ * in one source file, and keep it registered with TraceLoggingRegister() for as long
+ * as the sink is installed.
+ */
+class DebugEtwSink : public DebugSink {
+public:
+    /**
+     * @brief Creates a sink that writes to a registered provider.
+     *
+     * @param providerHandle Provider defined with TRACELOGGING_DEFINE_PROVIDER.
+     * @throws std::invalid_argument If providerHandle is null.
+     */
+    explicit DebugEtwSink(TraceLoggingHProvider providerHandle) : provider(providerHandle) {
+        if (!provider) {
+            throw std::invalid_argument("Null ETW provider");
+        }
+    }
+
+    virtual void Write(const DebugRecord& record) {
+        // The line break only matters to the debugger, and an event is limited to 64 KB
+        size_t length = record.length;
+        while (length > 0 && (record.text[length - 1] == L'\n' || record.text[length - 1] == L'\r')) {
+            --length;
+        }
+        if (length > MaxMessageLength) {
+            length = MaxMessageLength;
+            if (IS_HIGH_SURROGATE(record.text[length - 1])) --length;
+        }
+        USHORT count = static_cast<USHORT>(length);
+        const wchar_t* format = record.format ? record.format : L"";
+        USHORT fieldsSize = record.fieldsSize <= MaxFieldsSize ? static_cast<USHORT>(record.fieldsSize) : 0;
+        USHORT argumentsSize = record.argumentsSize <= MaxFieldsSize ? static_cast<USHORT>(record.argumentsSize) : 0;
+
+        // TraceLogging needs the level as a constant, so every level has its own event
+#define DEBUG_ETW_WRITE(eventLevel) \
+        TraceLoggingWrite(provider, "DebugMessage", \
+            TraceLoggingLevel(eventLevel), \
+            TraceLoggingKeyword(DEBUG_ETW_KEYWORD), \
+            TraceLoggingCountedWideString(record.text, count, "Message"), \
+            TraceLoggingWideString(format, "Format"), \
+            TraceLoggingBinary(record.fields, fieldsSize, "Fields"), \
+            TraceLoggingBinary(record.arguments, argumentsSize, "Arguments"))
+
+        switch (record.level) {
+        case DEBUG_LEVEL_INFO:
+            DEBUG_ETW_WRITE(WINEVENT_LEVEL_INFO);
+            break;
+        case DEBUG_LEVEL_WARN:
+            DEBUG_ETW_WRITE(WINEVENT_LEVEL_WARNING);
+            break;
+        case DEBUG_LEVEL_ERROR:
+            DEBUG_ETW_WRITE(WINEVENT_LEVEL_ERROR);
+            break;
+        default:
+            DEBUG_ETW_WRITE(WINEVENT_LEVEL_VERBOSE);
+            break;
+        }
+#undef DEBUG_ETW_WRITE
+    }
+
+    /**
+     * @brief Returns true if a trace session is collecting events at the given level.
+     *
+     * @param logLevel One of the DEBUG_LEVEL_* values.
+     */
+    bool IsTracing(int logLevel = DEBUG_LEVEL_DEBUG) const {
+        UCHAR eventLevel = logLevel >= DEBUG_LEVEL_ERROR ? WINEVENT_LEVEL_ERROR
+            : logLevel == DEBUG_LEVEL_WARN ? WINEVENT_LEVEL_WARNING
+            : logLevel == DEBUG_LEVEL_INFO ? WINEVENT_LEVEL_INFO
+            : WINEVENT_LEVEL_VERBOSE;
+        return TraceLoggingProviderEnabled(provider, eventLevel, DEBUG_ETW_KEYWORD) != FALSE;
+    }
+
+private:
+    // Characters and field bytes per event, leaving room for the format string within the 64 KB limit
+    enum { MaxMessageLength = 16384, MaxFieldsSize = 16384 };
+
+    TraceLoggingHProvider provider;
+};
+#endif
+
+/**
+ * @brief Moves OutputDebugStringW calls to a dedicated output thread.
+ *
+ * Afterwards, flushing a DebugStream copies the message into a bounded lock-free
+ * queue and returns without waiting for the debugger, which is drained to
+ * OutputDebugStringW by the output thread. Calling it again while the thread is
+ * running only changes the overflow policy. Queued messages are written when
+ * DebugDisableAsync() is called and at process exit.
+ *
+ * @param capacity Number of messages the queue can hold, rounded up to a power of two.
+ * Only the first call allocates the queue; later calls keep its capacity.
+ * @param policy What to do with a message when the queue is full.
+ * @throws std::runtime_error If the queue or the output thread could not be created.
+ */
+inline void DebugEnableAsync(size_t capacity = 1024, DebugOverflowPolicy policy = DebugOverflowBlock) {
+    if (!DebugDetail::AsyncStart(capacity, policy)) {
+        throw std::runtime_error("Failed to start the debug output thread");
+    }
+}
+
+/**
+ * @brief Stops the output thread after writing every queued message.
+ *
+ * Messages flushed afterwards are written with OutputDebugStringW on the calling
+ * thread again. It is safe to call this when asynchronous output is not enabled.
+ */
+inline void DebugDisableAsync() {
+    DebugDetail::AsyncStop();
+}
+
+/**
+ * @brief Returns how many messages the overflow policy has discarded so far.
+ */
+inline unsigned long long DebugAsyncDroppedCount() {
+    return static_cast<unsigned long long>(ReadAcquire64(&DebugDetail::GetAsyncState().dropped));
+}
+
+/**
+ * @brief Returns the built-in DebugOutputSink, which writes with OutputDebugStringW.
+ *
+ * It receives every record until it is removed with DebugRemoveSink().
+ */
+inline DebugSink& DebugDefaultSink() {
+    return DebugDetail::GetDefaultSink();
+}
+
+/**
+ * @brief Registers a sink; every finished statement is passed to all registered sinks.
+ *
+ * The sink is not owned and must stay alive until it is removed. Adding a sink that is
+ * already registered has no effect. Adding DebugDefaultSink() restores it after it was
+ * removed.
+ *
+ * @param sink The sink to add.
+ * @throws std::invalid_argument If sink is null.
+ * @throws std::runtime_error If DEBUG_MAX_SINKS sinks are already registered.
+ */
+inline void DebugAddSink(DebugSink* sink) {
+    if (!sink) {
+        throw std::invalid_argument("Null sink");
+    }
+
+    DebugDetail::SinkState& sinks = DebugDetail::GetSinkState();
+    AcquireSRWLockExclusive(&sinks.lock);
+    bool full = false;
+    if (sink == &DebugDefaultSink()) {
+        InterlockedExchange(&sinks.defaultRemoved, 0);
+    } else {
+        bool found = false;
+        for (LONG i = 0; i < sinks.count; ++i) {
+            if (sinks.sinks[i] == sink) found = true;
+        }
+        if (!found && sinks.count == DEBUG_MAX_SINKS) {
+            full = true;
+        } else if (!found) {
+            sinks.sinks[sinks.count] = sink;
+            InterlockedIncrement(&sinks.count);
+        }
+    }
+    ReleaseSRWLockExclusive(&sinks.lock);
+
+    if (full) {
+        throw std::runtime_error("Too many debug sinks");
+    }
+}
+
+/**
+ * @brief Unregisters a sink.
+ *
+ * When this returns, no thread is writing to the sink any more and it may be
+ * destroyed. Records still queued for the output thread are not written to it.
+ *
+ * @param sink The sink to remove. Removing DebugDefaultSink() stops OutputDebugStringW output.
+ */
+inline void DebugRemoveSink(DebugSink* sink) {
+    DebugDetail::SinkState& sinks = DebugDetail::GetSinkState();
+    AcquireSRWLockExclusive(&sinks.lock);
+    if (sink == &DebugDefaultSink()) {
+        InterlockedExchange(&sinks.defaultRemoved, 1);
+    } else {
+        for (LONG i = 0; i < sinks.count; ++i) {
+            if (sinks.sinks[i] == sink) {
+                for (LONG j = i + 1; j < sinks.count; ++j) sinks.sinks[j - 1] = sinks.sinks[j];
+                InterlockedDecrement(&sinks.count);
+                break;
+            }
+        }
+    }
+    ReleaseSRWLockExclusive(&sinks.lock);
+}
+
+/**
+ * @brief Calls Flush() on every registered sink.
+ */
+inline void DebugFlushSinks() {
+    DebugDetail::RepeatState& repeat = DebugDetail::GetRepeatState();
+    if (ReadNoFence(&repeat.enabled)) {
+        DebugDetail::ExclusiveLockGuard repeatGuard(repeat.lock);
+        DebugDetail::FlushRepeats(repeat);
+    }
+
+    DebugDetail::SinkState& sinks = DebugDetail::GetSinkState();
+    DebugDetail::SharedLockGuard guard(sinks.lock);
+    for (LONG i = 0; i < sinks.count; ++i) {
+        sinks.sinks[i]->Flush();
+    }
+}
+
+/**
+ * @brief Collapses identical consecutive lines into one line and a repeat count.
+ *
+ * While enabled, a line that equals the previous one, including its level and fields,
+ * is not written. Lines are compared before the DebugSetPrefix() prefix is added, so
+ * lines repeated with a sequence number or time are collapsed too. The next different
+ * line, DebugFlushSinks() or disabling this first writes "Last message repeated N
+ * times". Lines are compared and written under one lock, so each line costs a
+ * comparison and the sinks are no longer called concurrently.
+ *
+ * @param enabled Whether to collapse repeated lines.
+ */
+inline void DebugSetCollapseRepeats(bool enabled) {
+    DebugDetail::RepeatState& repeat = DebugDetail::GetRepeatState();
+    DebugDetail::ExclusiveLockGuard guard(repeat.lock);
+    if (!enabled) {
+        DebugDetail::FlushRepeats(repeat);
+        delete[] repeat.last;
+        repeat.last = nullptr;
+        repeat.lastCapacity = 0;
+    }
+    InterlockedExchange(&repeat.enabled, enabled ? 1 : 0);
+}
+
+/**
+ * @brief Keeps the most recent statements in memory so they survive a crash.
+ *
+ * Every flushed statement is also copied into a fixed-size ring in process memory,
+ * overwriting the oldest entries. Recording costs one atomic fetch-add and a copy,
+ * with no lock and no system call. In DebugLoggingAuto, statements are then always
+ * formatted and recorded, but only reach the sinks while a debugger or DebugView is
+ * attached, so the recorder can be left on without paying for OutputDebugStringW.
+ *
+ * An unhandled-exception filter dumps the ring to crashFilePath, or to the sinks if
+ * no path is given, and then calls the filter that was installed before. Windows does
+ * not call the filter while a debugger is attached. The ring can also be dumped with
+ * DebugDumpFlightRecorder() and found in a minidump; see DebugFlightRecorderMemory().
+ *
+ * The ring is kept until the process exits. Calling this again only changes the path.
+ *
+ * @param capacity Bytes of the ring, rounded up to a power of two. Each entry keeps at
+ *                 most capacity / 16 characters of its statement.
+ * @param crashFilePath File the filter writes the ring to, or nullptr for the sinks.
+ * @throws std::invalid_argument If crashFilePath is longer than MAX_PATH.
+ * @throws std::runtime_error If the ring cannot be allocated.
+ */
+inline void DebugEnableFlightRecorder(size_t capacity = 1024 * 1024, const wchar_t* crashFilePath = nullptr) {
+    DebugDetail::FlightRecorderState& recorder = DebugDetail::GetFlightRecorderState();
+    size_t pathLength = crashFilePath ? std::char_traits<wchar_t>::length(crashFilePath) : 0;
+    if (pathLength >= MAX_PATH) {
+        throw std::invalid_argument("Crash file path too long");
+    }
+    if (!DebugDetail::FlightStart(capacity)) {
+        throw std::runtime_error("Failed to allocate the flight recorder");
+    }
+
+    // A crash while the path changes dumps to the sinks instead of a half-written path
+    InterlockedExchange(&recorder.crashPathSet, 0);
+    if (crashFilePath) {
+        std::char_traits<wchar_t>::copy(recorder.crashPath, crashFilePath, pathLength + 1);
+        InterlockedExchange(&recorder.crashPathSet, 1);
+    }
+}
+
+/**
+ * @brief Writes the statements in the flight recorder to the registered sinks, oldest first.
+ *
+ * Does nothing if the flight recorder is not enabled. The ring is not cleared.
+ */
+inline void DebugDumpFlightRecorder() {
+    DebugDetail::SinkDispatcher sinks;
+    DebugDetail::FlightDump(sinks, true);
+}
+
+/**
+ * @brief Writes the statements in the flight recorder to a file, oldest first.
+ *
+ * The file is written as UTF-16LE lines after a byte order mark, like DebugFileSink.
+ *
+ * @param filePath The file to write. An existing file is overwritten.
+ * @throws std::invalid_argument If filePath is null.
+ * @throws std::runtime_error If the file cannot be written.
+ */
+inline void DebugDumpFlightRecorder(const wchar_t* filePath) {
+    if (!filePath) {
+        throw std::invalid_argument("Null file path");
+    }
+    if (!DebugDetail::FlightDumpToFile(filePath, true)) {
+        throw std::runtime_error("Failed to write the flight recorder dump");
+    }
+}
+
+/**
+ * @brief Returns the memory of the flight recorder, for including it in a minidump.
+ *
+ * Full-memory dumps contain it anyway. For smaller dumps, add the range in the
+ * MemoryCallback of a MINIDUMP_CALLBACK_ROUTINE passed to MiniDumpWriteDump(). The
+ * range starts with the wide string "DebugUtilFlight", followed by the ring size and
+ * write position as 64-bit integers, then the entries: a 64-bit stamp (the entry's
+ * position plus one), the length in characters and the level as 32-bit integers, and
+ * the UTF-16 text padded to 8 bytes.
+ *
+ * @param size Receives the size of the range in bytes, or 0 if the recorder is not enabled.
+ * @return The start of the range, or nullptr if the recorder is not enabled.
+ */
+inline const void* DebugFlightRecorderMemory(size_t* size) {
+    const DebugDetail::FlightRecorderHeader* ring =
+        static_cast<const DebugDetail::FlightRecorderHeader*>(ReadPointerAcquire(&DebugDetail::GetFlightRecorderState().ring));
+    if (size) *size = ring ? sizeof(*ring) + static_cast<size_t>(ring->capacity) : 0;
+    return ring;
+}
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+/**
+ * @brief Logs a statement whose text is formatted later, on the output thread.
+ *
+ * The calling thread only copies the format pointer and the argument bytes into a
+ * per-thread ring; the output thread started by DebugEnableAsync() formats them with
+ * the same rules as DebugStream::Format() and writes the result. Each {} or {:spec}
+ * in the format is replaced by the next argument; {{ and }} output literal braces.
+ * Without the output thread, the statement is formatted immediately.
+ * @code
+ *     DebugDeferred(L"Frame {} took {} ms", frame, elapsed);
+ * @endcode
+ *
+ * @param format The format string. It must stay valid until the statement is written,
+ * so it is normally a string literal.
+ * @param args Arithmetic values, characters, pointers or strings. Strings are copied.
+ * @throws std::invalid_argument If format or a narrow string argument is null.
+ *
+ * @remark Statements from one thread are written in order, but not in order with
+ * Debug() statements or with DebugDeferred() statements from other threads. When the
+ * ring is full, DebugOverflowBlock waits; both drop policies discard the new statement.
+ */
+template<typename... Args>
+inline void DebugDeferred(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...> format, const Args&... args) {
+    if (DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_DEBUG) && DebugIsEnabled()) {
+        DebugDetail::DeferredCapture(format.Text(), args...);
+    }
+}
+#endif
+
+#endif
+
+/**
+ * @class DebugNullStream
+ * @brief A dummy class that provides a no-op stream-like interface.
+ * 
+ * DebugNullStream is what DebugStream is in release builds, and what the logging
+ * functions return for levels below DEBUG_MIN_LEVEL. Every operation does nothing
+ * and is removed by the compiler.
+ */
+class DebugNullStream {
+public:
+    DebugNullStream() {}
+    explicit DebugNullStream(bool) {}
+    explicit DebugNullStream(const DebugFlushPolicy&) {}
+    DebugNullStream(bool, bool, int = 0) {}
+
+    template<typename T>
+    DebugNullStream& operator<<(const T&) { return *this; }
+
+#if defined(DEBUG_HAS_CPP11)
+    // Movable but not copyable, like DebugStream, so the factories can return it in C++11 and C++14
+    DebugNullStream(DebugNullStream&&) {}
+    DebugNullStream(const DebugNullStream&) = delete;
+    DebugNullStream& operator=(const DebugNullStream&) = delete;
+#endif
+
+    // Support manipulators in release build too
+    DebugNullStream& operator<<(std::basic_ostream<wchar_t>& (*)(std::basic_ostream<wchar_t>&)) { return *this; }
+    DebugNullStream& operator<<(std::ios_base& (*)(std::ios_base&)) { return *this; }
+    DebugNullStream& operator<<(std::basic_ios<wchar_t>& (*)(std::basic_ios<wchar_t>&)) { return *this; }
+
+    DebugNullStream& Write(const char*, size_t) { return *this; }
+    DebugNullStream& Write(const wchar_t*, size_t) { return *this; }
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+    template<typename... Args>
+    DebugNullStream& Format(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...>, const Args&...) { return *this; }
+
+    template<typename T>
+    DebugNullStream& With(const wchar_t*, const T&) { return *this; }
+#endif
+
+    DebugNullStream& Streaming(size_t = 0) { return *this; }
+    DebugNullStream& SetFlushPolicy(const DebugFlushPolicy&) { return *this; }
+    void Flush() {}
+};
+
+#if defined(DEBUG_HAS_STATIC_ASSERT)
+// Compiled-out statements rely on this: creating and destroying the stream generates no code
+static_assert(std::is_empty<DebugNullStream>::value, "DebugNullStream must not have members");
+static_assert(std::is_trivially_destructible<DebugNullStream>::value, "DebugNullStream must be trivially destructible");
+#endif
+
+#ifndef _DEBUG
+
+typedef DebugNullStream DebugStream;
+
+inline void DebugEnableAsync(size_t = 1024, DebugOverflowPolicy = DebugOverflowBlock) {}
+inline void DebugDisableAsync() {}
+inline unsigned long long DebugAsyncDroppedCount() { return 0; }
+
+inline bool DebugIsEnabled() { return false; }
+inline void DebugSetLoggingMode(DebugLoggingMode) {}
+inline DebugLoggingMode DebugGetLoggingMode() { return DebugLoggingOff; }
+inline void DebugSetPrefix(unsigned int) {}
+inline unsigned int DebugGetPrefix() { return DebugPrefixNone; }
+
+class DebugFileSink : public DebugSink {
+public:
+    explicit DebugFileSink(const wchar_t*, size_t = 16 * 1024 * 1024, DebugFileFormat = DebugFileText) {}
+    virtual void Write(const DebugRecord&) {}
+    unsigned long long DroppedCount() const { return 0; }
+};
+
+class DebugSharedRingSink : public DebugSink {
+public:
+    explicit DebugSharedRingSink(size_t = DEBUG_SHARED_RING_SIZE, const wchar_t* = nullptr) {}
+    virtual void Write(const DebugRecord&) {}
+    const wchar_t* Name() const { return L""; }
+};
+
+#if defined(DEBUG_ENABLE_ETW)
+class DebugEtwSink : public DebugSink {
+public:
+    explicit DebugEtwSink(TraceLoggingHProvider) {}
+    virtual void Write(const DebugRecord&) {}
+    bool IsTracing(int = DEBUG_LEVEL_DEBUG) const { return false; }
+};
+#endif
+
+inline DebugSink& DebugDefaultSink() {
+    static DebugNullSink sink;
+    return sink;
+}
+inline void DebugAddSink(DebugSink*) {}
+inline void DebugRemoveSink(DebugSink*) {}
+inline void DebugFlushSinks() {}
+inline void DebugSetCollapseRepeats(bool) {}
+
+inline void DebugEnableFlightRecorder(size_t = 1024 * 1024, const wchar_t* = nullptr) {}
+inline void DebugDumpFlightRecorder() {}
+inline void DebugDumpFlightRecorder(const wchar_t*) {}
+inline const void* DebugFlightRecorderMemory(size_t* size) {
+    if (size) *size = 0;
+    return nullptr;
+}
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+template<typename... Args>
+inline void DebugDeferred(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...>, const Args&...) {}
+#endif
+
+#endif
+
+/**
+ * @brief Switches a category declared with DEBUG_DECLARE_CATEGORY on or off at run time.
+ *
+ * Categories are enabled by default. This only affects levels that are compiled in.
+ */
+template<typename Category>
+inline void DebugSetCategoryEnabled(bool enabled) {
+    InterlockedExchange(&Category::DisabledFlag(), enabled ? 0 : 1);
+}
+
+/**
+ * @brief Returns whether a category is enabled, with a single relaxed load.
+ */
+template<typename Category>
+inline bool DebugIsCategoryEnabled() {
+    return ReadNoFence(&Category::DisabledFlag()) == 0;
+}
+
+/**
+ * @brief Selects DebugStream for enabled log levels and DebugNullStream otherwise.
+ */
+template<bool Enabled>
+struct DebugStreamSelect {
+    typedef DebugStream Type;
+    enum { CompiledIn = true };
+};
+
+template<>
+struct DebugStreamSelect<false> {
+    typedef DebugNullStream Type;
+    enum { CompiledIn = false };
+};
+
+/**
+ * @brief Creates a stream for a log level known at compile time.
+ *
+ * Returns a DebugNullStream, which compiles to nothing, if Level is below
+ * DEBUG_MIN_LEVEL or in release builds.
+ *
+ * @tparam Level One of DEBUG_LEVEL_DEBUG, DEBUG_LEVEL_INFO, DEBUG_LEVEL_WARN or DEBUG_LEVEL_ERROR.
+ */
+template<int Level>
+inline typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level)>::Type DebugAt() {
+    typedef DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level)> Select;
+    // Compiled-out levels must not even read the run-time switch
+    return typename Select::Type(false, Select::CompiledIn && DebugIsEnabled(), Level);
+}
+
+/**
+ * @brief Creates a stream for a log level and a category declared with DEBUG_DECLARE_CATEGORY.
+ *
+ * The statement is compiled out unless Level is at least both DEBUG_MIN_LEVEL and the
+ * category's own minimum level.
+ */
+template<int Level, typename Category>
+inline typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level) && Level >= Category::MinLevel>::Type DebugAt() {
+    typedef DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level) && Level >= Category::MinLevel> Select;
+    return typename Select::Type(false, Select::CompiledIn && DebugIsEnabled() && DebugIsCategoryEnabled<Category>(), Level);
+}
+
+namespace DebugDetail {
+
+// Used by the DEBUG_LOG_* macros, which have already checked the run-time switches
+template<int Level>
+inline typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level)>::Type CheckedAt() {
+    return typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level)>::Type(false, true, Level);
+}
+
+template<int Level, typename Category>
+inline typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level) && Level >= Category::MinLevel>::Type CheckedAt() {
+    return typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level) && Level >= Category::MinLevel>::Type(false, true, Level);
+}
+
+// Throttling used by the DEBUG_LOG_EVERY_N, _FIRST_N and _EVERY_MS macros. Each call site
+// owns a zero-initialized static, and a skipped statement costs one atomic operation.
+inline bool TakeEveryN(volatile LONG& count, LONG n) {
+    if (n <= 1) return true;
+    return (static_cast<unsigned long>(InterlockedIncrement(&count)) - 1) % static_cast<unsigned long>(n) == 0;
+}
+
+inline bool TakeFirstN(volatile LONG& count, LONG n) {
+    // Stop incrementing once the limit is reached, so the counter cannot wrap around
+    if (ReadNoFence(&count) >= n) return false;
+    return InterlockedIncrement(&count) <= n;
+}
+
+inline bool TakeEveryMs(volatile LONG64& next, ULONGLONG milliseconds) {
+    ULONGLONG now = GetTickCount64();
+    LONG64 due = ReadNoFence64(&next);
+    if (now < static_cast<ULONGLONG>(due)) return false;
+    // Exactly one thread wins each interval
+    return InterlockedCompareExchange64(&next, static_cast<LONG64>(now + milliseconds), due) == due;
+}
+
+#ifdef _DEBUG
+/**
+ * @brief Decides whether a DEBUG_LOG_SAMPLED statement is written, with probability k / n.
+ *
+ * Draws from a xorshift32 generator kept per thread, so threads share no state and a
+ * skipped statement costs no atomic operation. Each thread's generator is seeded from
+ * its id and the time of its first sampled statement.
+ */
+inline bool TakeSample(unsigned long k, unsigned long n) {
+    if (k >= n) return n != 0;
+    ThreadCache* cache = GetThreadCache();
+    if (!cache) return false;
+
+    unsigned int x = cache->sampleState;
+    if (x == 0) x = ((static_cast<unsigned int>(GetCurrentThreadId()) * 2654435761u) ^ static_cast<unsigned int>(GetTickCount64())) | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cache->sampleState = x;
+    // Scales x to [0, n) with a multiplication instead of a division
+    return (static_cast<unsigned long long>(x) * n >> 32) < k;
+}
+#endif
+
+// A stream whose line starts with the sample rate, e.g. "[sample 1/1000] "
+template<int Level>
+inline typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level)>::Type SampledAt(unsigned long k, unsigned long n) {
+    typename DebugStreamSelect<DEBUG_LEVEL_ENABLED(Level)>::Type stream(false, true, Level);
+    stream << L"[sample " << k << L'/' << n << L"] ";
+    return stream;
+}
+
+} // namespace DebugDetail
+
+/**
+ * @brief Creates a DebugStream object for logging debug messages.
+ *
+ * This function mimics the behavior of qDebug() in Qt which
+ * returns a DebugStream object that can be used to log debug messages.
+ * The returned stream buffers the whole statement and writes it with a
+ * single OutputDebugStringW call when it is destroyed. In release builds, or
+ * if DEBUG_MIN_LEVEL is above DEBUG_LEVEL_DEBUG, it returns a DebugNullStream.
+ *
+ * @return A DebugStream object for logging debug messages.
+ */
+inline DebugStreamSelect<DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_DEBUG)>::Type Debug() {
+    return DebugAt<DEBUG_LEVEL_DEBUG>();
+}
+
+/**
+ * @brief Creates a stream for informational messages, compiled out below DEBUG_MIN_LEVEL.
+ */
+inline DebugStreamSelect<DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_INFO)>::Type Info() {
+    return DebugAt<DEBUG_LEVEL_INFO>();
+}
+
+/**
+ * @brief Creates a stream for warnings, compiled out below DEBUG_MIN_LEVEL.
+ */
+inline DebugStreamSelect<DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_WARN)>::Type Warn() {
+    return DebugAt<DEBUG_LEVEL_WARN>();
+}
+
+/**
+ * @brief Creates a stream for errors, compiled out below DEBUG_MIN_LEVEL.
+ */
+inline DebugStreamSelect<DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_ERROR)>::Type Error() {
+    return DebugAt<DEBUG_LEVEL_ERROR>();
+}
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+/**
+ * @brief Logs one formatted statement, like Debug().Format(format, args...).
+ *
+ * Writes a single line through the same buffer, sinks and level filtering as
+ * Debug(). The format syntax is described at DebugStream::Format().
+ * @code
+ *     Debug(L"x={} y={:#x}", x, y);
+ * @endcode
+ */
+template<typename... Args>
+inline void Debug(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...> format, const Args&... args) {
+    DebugAt<DEBUG_LEVEL_DEBUG>().Format(format, args...);
+}
+
+// Formatted forms of Info(), Warn() and Error()
+template<typename... Args>
+inline void Info(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...> format, const Args&... args) {
+    DebugAt<DEBUG_LEVEL_INFO>().Format(format, args...);
+}
+
+template<typename... Args>
+inline void Warn(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...> format, const Args&... args) {
+    DebugAt<DEBUG_LEVEL_WARN>().Format(format, args...);
+}
+
+template<typename... Args>
+inline void Error(DebugFormatString<typename DebugDetail::FormatIdentity<Args>::Type...> format, const Args&... args) {
+    DebugAt<DEBUG_LEVEL_ERROR>().Format(format, args...);
+}
+#endif
+
+#define DEBUG_WIDEN_(str) L##str
+#define DEBUG_WIDEN(str) DEBUG_WIDEN_(str)
+
+/**
+ * @brief Declares a log category with its own minimum level.
+ *
+ * Statements in the category below minLevel are compiled out, in addition to those
+ * below DEBUG_MIN_LEVEL. Use DEBUG_LEVEL_NONE to compile out a whole category.
+ * @code
+ *     DEBUG_DECLARE_CATEGORY(Network, DEBUG_LEVEL_WARN);
+ *     DEBUG_LOG_CAT(Network, DEBUG_LEVEL_INFO) << L"Compiled out";
+ *     DEBUG_LOG_CAT(Network, DEBUG_LEVEL_ERROR) << L"Connection lost";
+ * @endcode
+ */
+#define DEBUG_DECLARE_CATEGORY(name, minLevel) \
+    struct name { \
+        enum { MinLevel = (minLevel) }; \
+        static const wchar_t* Name() { return DEBUG_WIDEN(#name); } \
+        static volatile LONG& DisabledFlag() { static volatile LONG flag; return flag; } \
+    }
+
+/**
+ * @brief Statement forms of the logging functions that also skip their arguments.
+ *
+ * Debug() << ExpensiveToString(x) still calls ExpensiveToString when the stream is a
+ * DebugNullStream or logging is switched off, because only operator<< is a no-op.
+ * These macros put the whole statement in the dead branch of an if, so the arguments
+ * are never evaluated when the level is compiled out or DebugIsEnabled() is false:
+ * @code
+ *     DEBUG_LOG_INFO << L"State: " << ExpensiveToString(x);
+ * @endcode
+ */
+#ifdef _DEBUG
+#define DEBUG_LOG_AT(level) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && DebugIsEnabled())) {} else DebugDetail::CheckedAt<(level)>()
+#define DEBUG_LOG_CAT(category, level) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && (level) >= category::MinLevel && \
+          DebugIsEnabled() && DebugIsCategoryEnabled<category>())) {} else DebugDetail::CheckedAt<(level), category>()
+#else
+// In release builds, if constexpr discards the statement before code generation, so not
+// even an unoptimized build keeps its string literals or calls
+#if defined(__cpp_if_constexpr) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define DEBUG_RELEASE_SKIP if constexpr (true) {} else
+#else
+#define DEBUG_RELEASE_SKIP if (true) {} else
+#endif
+#define DEBUG_LOG_AT(level) DEBUG_RELEASE_SKIP DebugDetail::CheckedAt<(level)>()
+#define DEBUG_LOG_CAT(category, level) DEBUG_RELEASE_SKIP DebugDetail::CheckedAt<(level), category>()
+#endif
+#define DEBUG_LOG_DEBUG DEBUG_LOG_AT(DEBUG_LEVEL_DEBUG)
+#define DEBUG_LOG_INFO DEBUG_LOG_AT(DEBUG_LEVEL_INFO)
+#define DEBUG_LOG_WARN DEBUG_LOG_AT(DEBUG_LEVEL_WARN)
+#define DEBUG_LOG_ERROR DEBUG_LOG_AT(DEBUG_LEVEL_ERROR)
+
+/**
+ * @brief Short forms of DEBUG_LOG_DEBUG: DBG for insertions, DEBUG_LOG for format strings.
+ *
+ * Both are dead code in release builds, arguments included. DBG is not defined if
+ * another header already defines it, as the Windows Driver Kit does.
+ * @code
+ *     DBG << L"Loaded " << items.size() << L" items from " << path;
+ *     DEBUG_LOG(L"Loaded {} items from {}", items.size(), path);
+ * @endcode
+ */
+#if !defined(DBG)
+#define DBG DEBUG_LOG_DEBUG
+#endif
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+#define DEBUG_LOG(...) do { DEBUG_LOG_DEBUG.Format(__VA_ARGS__); } while (0)
+#endif
+
+#if defined(DEBUG_HAS_LAMBDAS)
+/**
+ * @brief Logging macros that only write some executions of a statement, for hot loops.
+ *
+ * DEBUG_LOG_EVERY_N writes the 1st, (n+1)th, (2n+1)th... execution, DEBUG_LOG_FIRST_N
+ * the first n, and DEBUG_LOG_EVERY_MS at most one per interval. Each call site keeps
+ * its own count. Like DEBUG_LOG_AT, a skipped statement does not construct a stream or
+ * evaluate its arguments; it costs one atomic operation on the call site's counter.
+ * Executions while logging is off are not counted. DebugEveryN, DebugFirstN and
+ * DebugEveryMs log at DEBUG_LEVEL_DEBUG. Requires lambdas (C++11 or Visual C++ 2010).
+ * @code
+ *     for (int i = 0; i < count; ++i) {
+ *         DebugEveryN(1000) << L"Item " << i;
+ *         DEBUG_LOG_EVERY_MS(DEBUG_LEVEL_WARN, 500) << L"Queue full";
+ *     }
+ * @endcode
+ */
+#ifdef _DEBUG
+#define DEBUG_LOG_EVERY_N(level, n) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && DebugIsEnabled() && \
+          [&]() -> bool { static volatile LONG debugSite_; return DebugDetail::TakeEveryN(debugSite_, (n)); }())) {} \
+    else DebugDetail::CheckedAt<(level)>()
+#define DEBUG_LOG_FIRST_N(level, n) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && DebugIsEnabled() && \
+          [&]() -> bool { static volatile LONG debugSite_; return DebugDetail::TakeFirstN(debugSite_, (n)); }())) {} \
+    else DebugDetail::CheckedAt<(level)>()
+#define DEBUG_LOG_EVERY_MS(level, milliseconds) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && DebugIsEnabled() && \
+          [&]() -> bool { static volatile LONG64 debugSite_; return DebugDetail::TakeEveryMs(debugSite_, (milliseconds)); }())) {} \
+    else DebugDetail::CheckedAt<(level)>()
+#else
+#define DEBUG_LOG_EVERY_N(level, n) DEBUG_RELEASE_SKIP ((void)(n), DebugDetail::CheckedAt<(level)>())
+#define DEBUG_LOG_FIRST_N(level, n) DEBUG_LOG_EVERY_N(level, n)
+#define DEBUG_LOG_EVERY_MS(level, milliseconds) DEBUG_LOG_EVERY_N(level, milliseconds)
+#endif
+#define DebugEveryN(n) DEBUG_LOG_EVERY_N(DEBUG_LEVEL_DEBUG, n)
+#define DebugFirstN(n) DEBUG_LOG_FIRST_N(DEBUG_LEVEL_DEBUG, n)
+#define DebugEveryMs(milliseconds) DEBUG_LOG_EVERY_MS(DEBUG_LEVEL_DEBUG, milliseconds)
+#endif
+
+/**
+ * @brief Logging macros that write a sample of a statement's executions, marked with the rate.
+ *
+ * DEBUG_LOG_SAMPLED writes each execution with probability k / n, drawn from a generator
+ * kept per thread, so that threads running the same statement never share a cache line.
+ * DEBUG_LOG_SAMPLED_EVERY writes exactly every nth execution of the call site, counted as
+ * in DEBUG_LOG_EVERY_N. Written lines start with the rate, e.g. "[sample 1/1000] ", so
+ * counts taken from the output can be scaled back up. A skipped statement neither
+ * constructs a stream nor evaluates its arguments. k and n are evaluated again for the
+ * lines that are written, so pass constants. DebugSampled and DebugSampledEvery log at
+ * DEBUG_LEVEL_DEBUG; DEBUG_LOG_SAMPLED_EVERY requires lambdas.
+ * @code
+ *     void OnPacket(const Packet& packet) {
+ *         DebugSampled(1, 1000) << L"Packet " << packet.id << L", " << packet.size << L" bytes";
+ *     }
+ * @endcode
+ */
+#ifdef _DEBUG
+#define DEBUG_LOG_SAMPLED(level, k, n) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && DebugIsEnabled() && DebugDetail::TakeSample((k), (n)))) {} \
+    else DebugDetail::SampledAt<(level)>((k), (n))
+#if defined(DEBUG_HAS_LAMBDAS)
+#define DEBUG_LOG_SAMPLED_EVERY(level, n) \
+    if (!(DEBUG_LEVEL_ENABLED(level) && DebugIsEnabled() && \
+          [&]() -> bool { static volatile LONG debugSite_; return DebugDetail::TakeEveryN(debugSite_, (n)); }())) {} \
+    else DebugDetail::SampledAt<(level)>(1, (n))
+#endif
+#else
+#define DEBUG_LOG_SAMPLED(level, k, n) DEBUG_RELEASE_SKIP ((void)(k), (void)(n), DebugDetail::CheckedAt<(level)>())
+#define DEBUG_LOG_SAMPLED_EVERY(level, n) DEBUG_RELEASE_SKIP ((void)(n), DebugDetail::CheckedAt<(level)>())
+#endif
+#define DebugSampled(k, n) DEBUG_LOG_SAMPLED(DEBUG_LEVEL_DEBUG, k, n)
+#if defined(DEBUG_LOG_SAMPLED_EVERY)
+#define DebugSampledEvery(n) DEBUG_LOG_SAMPLED_EVERY(DEBUG_LEVEL_DEBUG, n)
+#endif
+
+#ifdef _DEBUG
+namespace DebugDetail {
+
+inline double TicksToMilliseconds(LONG64 ticks) {
+    return static_cast<double>(ticks) * 1000.0 / static_cast<double>(TimerFrequency());
+}
+
+inline void StoreMin(volatile LONG64& target, LONG64 value) {
+    LONG64 current = ReadNoFence64(&target);
+    while (value < current) {
+        LONG64 seen = InterlockedCompareExchange64(&target, value, current);
+        if (seen == current) return;
+        current = seen;
+    }
+}
+
+inline void StoreMax(volatile LONG64& target, LONG64 value) {
+    LONG64 current = ReadNoFence64(&target);
+    while (value > current) {
+        LONG64 seen = InterlockedCompareExchange64(&target, value, current);
+        if (seen == current) return;
+        current = seen;
+    }
+}
+
+} // namespace DebugDetail
+
+/**
+ * @class DebugTimerStats
+ * @brief Count, total, minimum and maximum of the times measured under one name.
+ *
+ * A DebugTimer constructed with a DebugTimerStats adds its time here instead of writing
+ * a line, so a scope that runs millions of times costs a few atomic operations each.
+ * The statistics returned by DebugGetTimerStats() are written by DebugReportTimers().
+ * Reading while timers are adding gives values that may be one measurement apart.
+ */
+class DebugTimerStats {
+public:
+    explicit DebugTimerStats(const wchar_t* statsName) : name(statsName ? statsName : L"") { Reset(); }
+
+    const wchar_t* Name() const { return name.c_str(); }
+    unsigned long long Count() const { return static_cast<unsigned long long>(ReadNoFence64(&count)); }
+    double TotalMilliseconds() const { return DebugDetail::TicksToMilliseconds(ReadNoFence64(&total)); }
+    double MinMilliseconds() const { return Count() ? DebugDetail::TicksToMilliseconds(ReadNoFence64(&minTicks)) : 0.0; }
+    double MaxMilliseconds() const { return DebugDetail::TicksToMilliseconds(ReadNoFence64(&maxTicks)); }
+
+    // Adds one measurement in QueryPerformanceCounter ticks
+    void Add(LONG64 ticks) {
+        InterlockedIncrement64(&count);
+        InterlockedExchangeAdd64(&total, ticks);
+        DebugDetail::StoreMin(minTicks, ticks);
+        DebugDetail::StoreMax(maxTicks, ticks);
+    }
+
+    void Reset() {
+        InterlockedExchange64(&count, 0);
+        InterlockedExchange64(&total, 0);
+        InterlockedExchange64(&minTicks, static_cast<LONG64>(~0ULL >> 1));
+        InterlockedExchange64(&maxTicks, 0);
+    }
+
+private:
+    DebugTimerStats(const DebugTimerStats&);
+    DebugTimerStats& operator=(const DebugTimerStats&);
+
+    std::wstring name;
+    volatile LONG64 count;
+    volatile LONG64 total;
+    volatile LONG64 minTicks;
+    volatile LONG64 maxTicks;
+};
+
+/**
+ * @class DebugTimer
+ * @brief Measures the time from its construction to its destruction with QueryPerformanceCounter.
+ *
+ * Constructed with a name, it writes "name: 1.234 ms" at DEBUG_LEVEL_DEBUG when it
+ * goes out of scope. Constructed with a DebugTimerStats, it adds the time there and
+ * writes nothing. If logging is off when the timer starts, or DEBUG_LEVEL_DEBUG is
+ * compiled out, it reads no clock at all. In release builds it compiles to nothing.
+ * @code
+ *     {
+ *         DebugTimer timer(L"Parse");
+ *         Parse(document);
+ *     }   // Writes "Parse: 0.731 ms"
+ * @endcode
+ */
+class DebugTimer {
+public:
+    explicit DebugTimer(const wchar_t* timerName) : name(timerName), stats(nullptr), start(Start()) {}
+    explicit DebugTimer(DebugTimerStats& timerStats) : name(nullptr), stats(&timerStats), start(Start()) {}
+
+    ~DebugTimer() { Stop(); }
+
+    // Returns the time since the timer started, or 0 if it is stopped or was never started
+    double ElapsedMilliseconds() const {
+        return start ? DebugDetail::TicksToMilliseconds(DebugDetail::TimerNow() - start) : 0.0;
+    }
+
+    // Ends the measurement early and reports it; the destructor then does nothing
+    void Stop() {
+        if (!start) return;
+        LONG64 ticks = DebugDetail::TimerNow() - start;
+        start = 0;
+        if (stats) {
+            stats->Add(ticks);
+        } else {
+            Debug() << (name ? name : L"") << L": " << std::fixed << std::setprecision(3)
+                    << DebugDetail::TicksToMilliseconds(ticks) << L" ms\n";
+        }
+    }
+
+private:
+    DebugTimer(const DebugTimer&);
+    DebugTimer& operator=(const DebugTimer&);
+
+    // 0 means not running; the counter counts from boot, so it is never 0 itself
+    static LONG64 Start() {
+        return DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_DEBUG) && DebugIsEnabled() ? DebugDetail::TimerNow() : 0;
+    }
+
+    const wchar_t* name;
+    DebugTimerStats* stats;
+    LONG64 start;
+};
+
+namespace DebugDetail {
+
+struct TimerNode {
+    explicit TimerNode(const wchar_t* name) : stats(name), next(nullptr) {}
+
+    DebugTimerStats stats;
+    TimerNode* next;
+};
+
+/**
+ * @struct TimerRegistry
+ * @brief The statistics created by DebugGetTimerStats(), kept until the process exits.
+ *
+ * Zero-initialized static storage like SinkState.
+ */
+struct TimerRegistry {
+    SRWLOCK lock;
+    TimerNode* head;
+    TimerNode* tail;                    // New names are appended to keep the report in order
+};
+
+inline TimerRegistry& GetTimerRegistry() {
+    static TimerRegistry registry;
+    return registry;
+}
+
+} // namespace DebugDetail
+
+/**
+ * @brief Returns the statistics for a name, creating them on first use.
+ *
+ * Every call with an equal name returns the same object, so call sites that share a
+ * name are added up together. Look the object up once and keep the reference, as
+ * DebugScopeAggregate does; the lookup takes a lock and compares names.
+ *
+ * @throws std::bad_alloc If the statistics cannot be allocated.
+ */
+inline DebugTimerStats& DebugGetTimerStats(const wchar_t* name) {
+    if (!name) name = L"";
+    DebugDetail::TimerRegistry& registry = DebugDetail::GetTimerRegistry();
+    DebugDetail::ExclusiveLockGuard guard(registry.lock);
+    for (DebugDetail::TimerNode* node = registry.head; node; node = node->next) {
+        if (std::wcscmp(node->stats.Name(), name) == 0) return node->stats;
+    }
+    DebugDetail::TimerNode* node = new DebugDetail::TimerNode(name);
+    if (registry.tail) {
+        registry.tail->next = node;
+    } else {
+        registry.head = node;
+    }
+    registry.tail = node;
+    return node->stats;
+}
+
+/**
+ * @brief Writes one line per name returned by DebugGetTimerStats() that has measurements.
+ *
+ * Each line reads "name: 12 calls, total 3.456 ms, min 0.100 ms, avg 0.288 ms, max 0.900 ms".
+ */
+inline void DebugReportTimers() {
+    DebugDetail::TimerRegistry& registry = DebugDetail::GetTimerRegistry();
+    DebugDetail::SharedLockGuard guard(registry.lock);
+    for (DebugDetail::TimerNode* node = registry.head; node; node = node->next) {
+        const DebugTimerStats& stats = node->stats;
+        unsigned long long count = stats.Count();
+        if (count == 0) continue;
+        double total = stats.TotalMilliseconds();
+        Debug() << stats.Name() << L": " << count << (count == 1 ? L" call" : L" calls") << std::fixed << std::setprecision(3)
+                << L", total " << total << L" ms, min " << stats.MinMilliseconds() << L" ms, avg " << total / static_cast<double>(count)
+                << L" ms, max " << stats.MaxMilliseconds() << L" ms\n";
+    }
+}
+
+// Clears the measurements of every name returned by DebugGetTimerStats()
+inline void DebugResetTimers() {
+    DebugDetail::TimerRegistry& registry = DebugDetail::GetTimerRegistry();
+    DebugDetail::SharedLockGuard guard(registry.lock);
+    for (DebugDetail::TimerNode* node = registry.head; node; node = node->next) {
+        node->stats.Reset();
+    }
+}
+
+#define DEBUG_SCOPE_NAME_(prefix, line) prefix##line
+#define DEBUG_SCOPE_NAME(prefix, line) DEBUG_SCOPE_NAME_(prefix, line)
+
+/**
+ * @brief Times the rest of the enclosing scope.
+ *
+ * DebugScope writes one line per execution, like a DebugTimer. DebugScopeAggregate
+ * adds the time to DebugGetTimerStats(name) instead, for scopes too hot to log each
+ * time; DebugReportTimers() then writes the totals.
+ * @code
+ *     void RenderFrame() {
+ *         DebugScopeAggregate(L"RenderFrame");
+ *         ...
+ *     }
+ * @endcode
+ */
+#define DebugScope(name) DebugTimer DEBUG_SCOPE_NAME(debugScope_, __LINE__)(name)
+#define DebugScopeAggregate(name) \
+    static DebugTimerStats& DEBUG_SCOPE_NAME(debugScopeStats_, __LINE__) = DebugGetTimerStats(name); \
+    DebugTimer DEBUG_SCOPE_NAME(debugScope_, __LINE__)(DEBUG_SCOPE_NAME(debugScopeStats_, __LINE__))
+
+#else
+
+class DebugTimerStats {
+public:
+    explicit DebugTimerStats(const wchar_t*) {}
+
+    const wchar_t* Name() const { return L""; }
+    unsigned long long Count() const { return 0; }
+    double TotalMilliseconds() const { return 0.0; }
+    double MinMilliseconds() const { return 0.0; }
+    double MaxMilliseconds() const { return 0.0; }
+    void Add(LONG64) {}
+    void Reset() {}
+};
+
+class DebugTimer {
+public:
+    explicit DebugTimer(const wchar_t*) {}
+    explicit DebugTimer(DebugTimerStats&) {}
+
+    double ElapsedMilliseconds() const { return 0.0; }
+    void Stop() {}
+};
+
+inline DebugTimerStats& DebugGetTimerStats(const wchar_t*) {
+    static DebugTimerStats stats(L"");
+    return stats;
+}
+inline void DebugReportTimers() {}
+inline void DebugResetTimers() {}
+
+#define DEBUG_SCOPE_NAME_(prefix, line) prefix##line
+#define DEBUG_SCOPE_NAME(prefix, line) DEBUG_SCOPE_NAME_(prefix, line)
+
+// Both forms compile to an empty object, without a static to initialize
+#define DebugScope(name) DebugTimer DEBUG_SCOPE_NAME(debugScope_, __LINE__)(name)
+#define DebugScopeAggregate(name) DebugTimer DEBUG_SCOPE_NAME(debugScope_, __LINE__)(name)
+
+#endif
+
+#ifdef _DEBUG
+namespace DebugDetail {
+
+enum MetricKind {
+    MetricCounter,
+    MetricHistogram
+};
+
+// Values below 2^HistogramSubBits get a bucket each; every higher power of two is split
+// into 2^HistogramSubBits buckets, so a bucket is at most 12.5% wide relative to its values
+const unsigned HistogramSubBits = 3;
+const unsigned HistogramSubBuckets = 1u << HistogramSubBits;
+const unsigned HistogramBuckets = HistogramSubBuckets * (64 - HistogramSubBits + 1);
+
+struct CounterShard {
+    volatile LONG64 value;
+    char padding[64 - sizeof(LONG64)];  // One cache line per shard
+};
+
+// The count is the sum of the buckets, so recording a value takes no separate increment
+struct HistogramShard {
+    volatile LONG64 sum;
+    volatile LONG64 minValue;
+    volatile LONG64 maxValue;
+    char padding[64 - 3 * sizeof(LONG64)];
+    volatile LONG64 buckets[HistogramBuckets];
+};
+
+inline unsigned HighestBit(unsigned long long value) {
+    unsigned long index;
+#if defined(_M_X64) || defined(_M_AMD64) || defined(_M_ARM64)
+    _BitScanReverse64(&index, value);
+#else
+    if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32))) return index + 32;
+    _BitScanReverse(&index, static_cast<unsigned long>(value));
+#endif
+    return index;
+}
+
+inline unsigned HistogramBucket(unsigned long long value) {
+    if (value < HistogramSubBuckets) return static_cast<unsigned>(value);
+    unsigned shift = HighestBit(value) - HistogramSubBits;
+    return (shift + 1) * HistogramSubBuckets + static_cast<unsigned>((value >> shift) & (HistogramSubBuckets - 1));
+}
+
+// The largest value that falls into a bucket
+inline unsigned long long HistogramBucketLimit(unsigned bucket) {
+    if (bucket < HistogramSubBuckets) return bucket;
+    unsigned shift = bucket / HistogramSubBuckets - 1;
+    unsigned long long low = static_cast<unsigned long long>(HistogramSubBuckets + bucket % HistogramSubBuckets) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+// The calling thread's shard, assigned round-robin on first use
+inline unsigned MetricShardIndex() {
+    static volatile LONG nextShard;
+    ThreadCache* cache = GetThreadCache();
+    if (!cache) return 0;
+    if (!cache->metricShard) {
+        cache->metricShard = static_cast<unsigned long>(InterlockedIncrement(&nextShard) - 1) % DEBUG_METRIC_SHARDS + 1;
+    }
+    return static_cast<unsigned>(cache->metricShard - 1);
+}
+
+/**
+ * @class Metric
+ * @brief A named counter or histogram, split into per-thread shards.
+ *
+ * Each thread updates the shard assigned to it with interlocked operations on its own
+ * cache lines, so threads do not contend unless there are more of them than
+ * DEBUG_METRIC_SHARDS. Histogram shards are allocated when a thread first records into
+ * them. Reports merge the shards while they are being updated, so a value may be
+ * missing from one statistic and already counted in another.
+ */
+class Metric {
+public:
+    Metric(const wchar_t* metricName, int metricKind) : name(metricName), kind(metricKind), next(nullptr) {
+        for (unsigned i = 0; i < DEBUG_METRIC_SHARDS; ++i) {
+            counters[i].value = 0;
+            histograms[i] = nullptr;
+        }
+    }
+
+    ~Metric() {
+        for (unsigned i = 0; i < DEBUG_METRIC_SHARDS; ++i) {
+            delete static_cast<HistogramShard*>(histograms[i]);
+        }
+    }
+
+    void Count(LONG64 amount) {
+        InterlockedExchangeAdd64(&counters[MetricShardIndex()].value, amount);
+    }
+
+    void Record(unsigned long long value) {
+        HistogramShard* shard = Shard(MetricShardIndex());
+        if (!shard) return;
+        InterlockedExchangeAdd64(&shard->sum, static_cast<LONG64>(value));
+        InterlockedIncrement64(&shard->buckets[HistogramBucket(value)]);
+        StoreUnsignedMin(shard->minValue, value);
+        StoreUnsignedMax(shard->maxValue, value);
+    }
+
+    void Report() const;
+    void Reset();
+
+    std::wstring name;
+    int kind;
+    Metric* next;
+
+private:
+    Metric(const Metric&);
+    Metric& operator=(const Metric&);
+
+    // Compared as unsigned, so values of 2^63 and above keep their order
+    static void StoreUnsignedMin(volatile LONG64& target, unsigned long long value) {
+        LONG64 current = ReadNoFence64(&target);
+        while (value < static_cast<unsigned long long>(current)) {
+            LONG64 seen = InterlockedCompareExchange64(&target, static_cast<LONG64>(value), current);
+            if (seen == current) return;
+            current = seen;
+        }
+    }
+
+    static void StoreUnsignedMax(volatile LONG64& target, unsigned long long value) {
+        LONG64 current = ReadNoFence64(&target);
+        while (value > static_cast<unsigned long long>(current)) {
+            LONG64 seen = InterlockedCompareExchange64(&target, static_cast<LONG64>(value), current);
+            if (seen == current) return;
+            current = seen;
+        }
+    }
+
+    HistogramShard* Shard(unsigned index) {
+        HistogramShard* shard = static_cast<HistogramShard*>(ReadPointerAcquire(&histograms[index]));
+        if (shard) return shard;
+        HistogramShard* created = new (std::nothrow) HistogramShard();
+        if (!created) return nullptr;
+        created->minValue = -1;         // The largest value when compared as unsigned
+        PVOID previous = InterlockedCompareExchangePointer(&histograms[index], created, nullptr);
+        if (previous) {
+            // Another thread assigned to the same shard created it first
+            delete created;
+            return static_cast<HistogramShard*>(previous);
+        }
+        return created;
+    }
+
+    CounterShard counters[DEBUG_METRIC_SHARDS];
+    PVOID volatile histograms[DEBUG_METRIC_SHARDS];
+};
+
+inline void Metric::Report() const {
+    if (kind == MetricCounter) {
+        LONG64 total = 0;
+        for (unsigned i = 0; i < DEBUG_METRIC_SHARDS; ++i) total += ReadNoFence64(&counters[i].value);
+        Debug() << name << L": " << total << L"\n";
+        return;
+    }
+
+    // Merge the shards into one histogram first, so every statistic sees the same counts
+    unsigned long long merged[HistogramBuckets] = {};
+    unsigned long long count = 0;
+    unsigned long long sum = 0;
+    unsigned long long minValue = ~0ULL;
+    unsigned long long maxValue = 0;
+    for (unsigned i = 0; i < DEBUG_METRIC_SHARDS; ++i) {
+        const HistogramShard* shard = static_cast<const HistogramShard*>(ReadPointerAcquire(&histograms[i]));
+        if (!shard) continue;
+        for (unsigned bucket = 0; bucket < HistogramBuckets; ++bucket) {
+            unsigned long long value = static_cast<unsigned long long>(ReadNoFence64(&shard->buckets[bucket]));
+            merged[bucket] += value;
+            count += value;
+        }
+        sum += static_cast<unsigned long long>(ReadNoFence64(&shard->sum));
+        unsigned long long shardMin = static_cast<unsigned long long>(ReadNoFence64(&shard->minValue));
+        unsigned long long shardMax = static_cast<unsigned long long>(ReadNoFence64(&shard->maxValue));
+        if (shardMin < minValue) minValue = shardMin;
+        if (shardMax > maxValue) maxValue = shardMax;
+    }
+    if (count == 0) {
+        Debug() << name << L": no samples\n";
+        return;
+    }
+
+    static const unsigned percents[] = { 50, 90, 99 };
+    unsigned long long percentiles[3];
+    unsigned long long seen = 0;
+    unsigned bucket = 0;
+    for (unsigned i = 0; i < 3; ++i) {
+        // The smallest bucket that holds at least percents[i]% of the samples
+        unsigned long long rank = (count * percents[i] + 99) / 100;
+        while (bucket < HistogramBuckets - 1 && seen + merged[bucket] < rank) seen += merged[bucket++];
+        unsigned long long limit = HistogramBucketLimit(bucket);
+        percentiles[i] = limit < maxValue ? limit : maxValue;
+    }
+    Debug() << name << L": count " << count << L", min " << minValue << L", p50 " << percentiles[0]
+            << L", p90 " << percentiles[1] << L", p99 " << percentiles[2] << L", max " << maxValue
+            << L", mean " << std::fixed << std::setprecision(1) << static_cast<double>(sum) / static_cast<double>(count) << L"\n";
+}
+
+inline void Metric::Reset() {
+    for (unsigned i = 0; i < DEBUG_METRIC_SHARDS; ++i) {
+        InterlockedExchange64(&counters[i].value, 0);
+        HistogramShard* shard = static_cast<HistogramShard*>(ReadPointerAcquire(&histograms[i]));
+        if (!shard) continue;
+        InterlockedExchange64(&shard->sum, 0);
+        InterlockedExchange64(&shard->minValue, -1);
+        InterlockedExchange64(&shard->maxValue, 0);
+        for (unsigned bucket = 0; bucket < HistogramBuckets; ++bucket) InterlockedExchange64(&shard->buckets[bucket], 0);
+    }
+}
+
+/**
+ * @struct MetricState
+ * @brief Every counter and histogram, kept until the process exits, and the report timer.
+ *
+ * Zero-initialized static storage like TimerRegistry. timerLock only serializes
+ * starting and stopping the timer, so the timer callback never waits for it.
+ */
+struct MetricState {
+    SRWLOCK lock;
+    Metric* head;
+    Metric* tail;
+    SRWLOCK timerLock;
+    HANDLE timer;                       // Timer-queue timer of DebugEnableMetricsReport(), or nullptr
+};
+
+inline MetricState& GetMetricState() {
+    static MetricState state;
+    return state;
+}
+
+// Returns the metric for a name and kind, creating it on first use
+inline Metric& GetMetric(const wchar_t* name, int kind) {
+    if (!name) name = L"";
+    MetricState& metrics = GetMetricState();
+    ExclusiveLockGuard guard(metrics.lock);
+    for (Metric* metric = metrics.head; metric; metric = metric->next) {
+        if (metric->kind == kind && metric->name == name) return *metric;
+    }
+    Metric* metric = new Metric(name, kind);
+    if (metrics.tail) {
+        metrics.tail->next = metric;
+    } else {
+        metrics.head = metric;
+    }
+    metrics.tail = metric;
+    return *metric;
+}
+
+} // namespace DebugDetail
+
+/**
+ * @brief Writes one line per counter and histogram, in the order they were first used.
+ *
+ * A counter line reads "name: 1234", a histogram line "name: count 1000, min 3, p50 12,
+ * p90 30, p99 95, max 120, mean 14.2". Percentiles are the upper end of the bucket the
+ * sample falls into, within 12.5% of the exact value. Values are not reset.
+ */
+inline void DebugReportMetrics() {
+    DebugDetail::MetricState& metrics = DebugDetail::GetMetricState();
+    DebugDetail::SharedLockGuard guard(metrics.lock);
+    for (DebugDetail::Metric* metric = metrics.head; metric; metric = metric->next) {
+        metric->Report();
+    }
+}
+
+// Clears every counter and histogram; updates made meanwhile may survive
+inline void DebugResetMetrics() {
+    DebugDetail::MetricState& metrics = DebugDetail::GetMetricState();
+    DebugDetail::SharedLockGuard guard(metrics.lock);
+    for (DebugDetail::Metric* metric = metrics.head; metric; metric = metric->next) {
+        metric->Reset();
+    }
+}
+
+namespace DebugDetail {
+
+inline VOID CALLBACK MetricsTimerProc(PVOID, BOOLEAN) {
+    try {
+        DebugReportMetrics();
+    } catch (...) {
+        // An exception must not escape into the thread pool
+    }
+}
+
+// Deletes the report timer, waiting for a running report; the caller holds timerLock
+inline void DisableMetricsReportLocked(MetricState& metrics) {
+    if (metrics.timer) {
+        DeleteTimerQueueTimer(nullptr, metrics.timer, INVALID_HANDLE_VALUE);
+        metrics.timer = nullptr;
+    }
+}
+
+} // namespace DebugDetail
+
+/**
+ * @brief Stops the periodic report started by DebugEnableMetricsReport().
+ *
+ * Waits for a report that is being written to finish.
+ */
+inline void DebugDisableMetricsReport() {
+    DebugDetail::MetricState& metrics = DebugDetail::GetMetricState();
+    DebugDetail::ExclusiveLockGuard guard(metrics.timerLock);
+    DebugDetail::DisableMetricsReportLocked(metrics);
+}
+
+/**
+ * @brief Calls DebugReportMetrics() every interval on a thread-pool thread.
+ *
+ * Replaces the interval of a report that is already running.
+ *
+ * @param intervalMilliseconds The time between reports.
+ * @throws std::invalid_argument If the interval is 0.
+ * @throws std::runtime_error If the timer cannot be created.
+ */
+inline void DebugEnableMetricsReport(unsigned long intervalMilliseconds) {
+    if (intervalMilliseconds == 0) {
+        throw std::invalid_argument("Metrics report interval must not be 0");
+    }
+    // The old timer is replaced under the same lock, so concurrent calls cannot both create one
+    DebugDetail::MetricState& metrics = DebugDetail::GetMetricState();
+    DebugDetail::ExclusiveLockGuard guard(metrics.timerLock);
+    DebugDetail::DisableMetricsReportLocked(metrics);
+    if (!CreateTimerQueueTimer(&metrics.timer, nullptr, &DebugDetail::MetricsTimerProc, nullptr,
+                               intervalMilliseconds, intervalMilliseconds, WT_EXECUTEDEFAULT)) {
+        metrics.timer = nullptr;
+        throw std::runtime_error("Failed to create metrics report timer");
+    }
+}
+
+/**
+ * @brief Counts events or records values under a name, for hot paths that are too
+ * frequent to log.
+ *
+ * DebugCounter(name) adds one to a counter, DebugCounterAdd(name, amount) adds amount,
+ * and DebugHistogram(name, value) records a non-negative integer value, such as a
+ * latency in microseconds or a size in bytes. Each call site looks up its metric once;
+ * after that, an update is one or a few interlocked operations on the calling thread's
+ * shard, with no string building. Call sites with the same name share a metric.
+ * Nothing is recorded, and the arguments are not evaluated, while logging is off, when
+ * DEBUG_LEVEL_DEBUG is compiled out and in release builds. DebugReportMetrics() and
+ * DebugEnableMetricsReport() write the summaries.
+ * @code
+ *     DebugCounter(L"CacheMiss");
+ *     DebugHistogram(L"RequestUs", elapsedMicroseconds);
+ * @endcode
+ */
+#define DEBUG_METRIC_(name, kind, update) \
+    do { \
+        if (DEBUG_LEVEL_ENABLED(DEBUG_LEVEL_DEBUG) && DebugIsEnabled()) { \
+            static DebugDetail::Metric& debugMetric_ = DebugDetail::GetMetric(name, kind); \
+            debugMetric_.update; \
+        } \
+    } while (0)
+#define DebugCounter(name) DEBUG_METRIC_(name, DebugDetail::MetricCounter, Count(1))
+#define DebugCounterAdd(name, amount) DEBUG_METRIC_(name, DebugDetail::MetricCounter, Count(static_cast<LONG64>(amount)))
+#define DebugHistogram(name, value) \
+    DEBUG_METRIC_(name, DebugDetail::MetricHistogram, Record(static_cast<unsigned long long>(value)))
+
+#else
+
+inline void DebugReportMetrics() {}
+inline void DebugResetMetrics() {}
+inline void DebugEnableMetricsReport(unsigned long) {}
+inline void DebugDisableMetricsReport() {}
+
+// The arguments stay referenced, so variables only used here do not become unused
+#define DebugCounter(name) do { if (false) { (void)(name); } } while (0)
+#define DebugCounterAdd(name, amount) do { if (false) { (void)(name); (void)(amount); } } while (0)
+#define DebugHistogram(name, value) do { if (false) { (void)(name); (void)(value); } } while (0)
+
+#endif
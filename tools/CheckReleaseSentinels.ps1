@@ -0,0 +1,75 @@
+#------------------------------------------------------------------------------
+# CheckReleaseSentinels.ps1
+#------------------------------------------------------------------------------
+# Builds ReleaseSentinels.cpp as a release build at /Od and /O2, for each C++
+# standard given, and fails if any of its _Sentinel string literals, narrow or
+# UTF-16, is left in an executable. C++14 checks the if (true) {} else fallback
+# of the release macros, C++17 their if constexpr form.
+#
+# Run it from a Developer Command Prompt, so that cl is on the path:
+#
+#     powershell -ExecutionPolicy Bypass -File tools\CheckReleaseSentinels.ps1
+#     powershell -ExecutionPolicy Bypass -File tools\CheckReleaseSentinels.ps1 -Standards c++14
+#
+# Exits with 0 if every build is clean, 1 otherwise.
+
+param(
+    [string[]] $Standards = @('c++14', 'c++17')
+)
+
+$ErrorActionPreference = 'Stop'
+
+$source = Join-Path $PSScriptRoot 'ReleaseSentinels.cpp'
+$work = Join-Path ([IO.Path]::GetTempPath()) "ReleaseSentinels-$PID"
+New-Item -ItemType Directory -Force -Path $work | Out-Null
+
+$sentinels = [regex]::Matches((Get-Content -Raw -Path $source), '"(\w+_Sentinel)\b') |
+    ForEach-Object { $_.Groups[1].Value } | Sort-Object -Unique
+$latin1 = [Text.Encoding]::GetEncoding(28591)
+$failed = $false
+
+try {
+    foreach ($standard in $Standards) {
+        foreach ($optimization in '/Od', '/O2') {
+            $name = 'ReleaseSentinels-{0}{1}' -f ($standard -replace '\+', 'p'), $optimization.TrimStart('/')
+            $executable = Join-Path $work "$name.exe"
+            $label = '{0} {1}' -f $standard, $optimization
+
+            # No /D_DEBUG: this is the release build
+            & cl /nologo /EHsc $optimization "/std:$standard" "/Fe$executable" "/Fo$(Join-Path $work "$name.obj")" $source | Out-Host
+            if ($LASTEXITCODE -ne 0) {
+                # An unresolved Describe_Sentinel means a release macro generated a call
+                Write-Host ('FAIL {0}: build failed' -f $label)
+                $failed = $true
+                continue
+            }
+
+            # Narrow literals are searched byte for byte, wide ones at even and odd offsets
+            $bytes = [IO.File]::ReadAllBytes($executable)
+            $narrow = $latin1.GetString($bytes)
+            $wide = [Text.Encoding]::Unicode.GetString($bytes) + "`n" +
+                [Text.Encoding]::Unicode.GetString($bytes, 1, $bytes.Length - 1)
+
+            # The printed controls prove that the search finds literals that are there
+            if (-not $narrow.Contains('Narrow_Control') -or -not $wide.Contains('Wide_Control')) {
+                Write-Host ('FAIL {0}: control literals not found, the search is broken' -f $label)
+                $failed = $true
+                continue
+            }
+
+            $found = @($sentinels | Where-Object { $narrow.Contains($_) -or $wide.Contains($_) })
+            if ($found.Count -ne 0) {
+                Write-Host ('FAIL {0}: {1} sentinels left in {2}' -f $label, $found.Count, $executable)
+                $found | ForEach-Object { Write-Host "    $_" }
+                $failed = $true
+            } else {
+                Write-Host ('ok   {0}: none of {1} sentinels found' -f $label, $sentinels.Count)
+            }
+        }
+    }
+} finally {
+    if (-not $failed) { Remove-Item -Recurse -Force -Path $work }
+}
+
+if ($failed) { exit 1 }
+exit 0
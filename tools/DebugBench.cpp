@@ -0,0 +1,184 @@
+//------------------------------------------------------------------------------
+// DebugBench.cpp
+//------------------------------------------------------------------------------
+/**
+ * @file DebugBench.cpp
+ * @brief Measures the cost of typical log statements in ns/op and allocations/op
+ *
+ * Every case runs a statement in a loop with DebugNullSink as the only sink, so the
+ * numbers are the cost of building and dispatching the statement without the
+ * debugger. The last cases repeat one statement with the default sink, whose
+ * OutputDebugStringW call is the cost of the debugger output, and is much higher
+ * while a debugger or DebugView is listening. Allocations are counted by replacing
+ * the global operator new. The contention case runs the same statement on several
+ * threads at once and reports the wall-clock time per statement.
+ *
+ * Usage:
+ * @code
+ *     DebugBench                  1000000 iterations per case
+ *     DebugBench 100000           Other iteration counts
+ * @endcode
+ *
+ * Build, as a debug build with optimizations, since release builds compile the
+ * statements out:
+ * @code
+ *     cl /EHsc /O2 /D_DEBUG DebugBench.cpp
+ * @endcode
+ */
+
+#ifndef _DEBUG
+#error DebugBench.cpp measures debug builds; build it with /D_DEBUG
+#endif
+
+#include "../DebugUtil.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <vector>
+
+namespace {
+
+// Incremented by every thread, so it has to be atomic
+volatile LONG allocations;
+
+} // namespace
+
+void* operator new(size_t size) {
+    InterlockedIncrement(&allocations);
+    if (void* block = std::malloc(size ? size : 1)) return block;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    std::free(block);
+}
+
+namespace {
+
+typedef void (*Statement)(int i);
+
+double Nanoseconds(const LARGE_INTEGER& start, const LARGE_INTEGER& end) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(end.QuadPart - start.QuadPart) * 1e9 / static_cast<double>(frequency.QuadPart);
+}
+
+void Report(const char* name, double nanoseconds, LONG allocationCount, long long iterations) {
+    std::printf("%-32s %10.1f ns/op %8.2f allocs/op\n", name,
+        nanoseconds / static_cast<double>(iterations),
+        static_cast<double>(allocationCount) / static_cast<double>(iterations));
+}
+
+// Runs statement iterations times on this thread, after a short warm-up that fills the caches
+void Measure(const char* name, Statement statement, int iterations) {
+    for (int i = 0; i < 1000; ++i) statement(i);
+
+    LARGE_INTEGER start, end;
+    LONG before = ReadAcquire(&allocations);
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < iterations; ++i) statement(i);
+    QueryPerformanceCounter(&end);
+    Report(name, Nanoseconds(start, end), ReadAcquire(&allocations) - before, iterations);
+}
+
+struct Worker {
+    Statement statement;
+    int iterations;
+    HANDLE start;
+    volatile LONG* ready;
+};
+
+DWORD WINAPI RunWorker(LPVOID parameter) {
+    Worker* worker = static_cast<Worker*>(parameter);
+    for (int i = 0; i < 1000; ++i) worker->statement(i);
+    InterlockedIncrement(worker->ready);
+    WaitForSingleObject(worker->start, INFINITE);
+    for (int i = 0; i < worker->iterations; ++i) worker->statement(i);
+    return 0;
+}
+
+// Runs statement on threadCount threads at once, iterations in total
+void MeasureContended(const char* name, Statement statement, int iterations, int threadCount) {
+    volatile LONG ready = 0;
+    HANDLE start = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    std::vector<Worker> workers(static_cast<size_t>(threadCount));
+    std::vector<HANDLE> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        Worker& worker = workers[static_cast<size_t>(t)];
+        worker.statement = statement;
+        worker.iterations = iterations / threadCount;
+        worker.start = start;
+        worker.ready = &ready;
+        HANDLE thread = CreateThread(nullptr, 0, RunWorker, &worker, 0, nullptr);
+        if (thread) threads.push_back(thread);
+    }
+    while (ReadAcquire(&ready) != static_cast<LONG>(threads.size())) Sleep(1);
+
+    LARGE_INTEGER begin, end;
+    LONG before = ReadAcquire(&allocations);
+    QueryPerformanceCounter(&begin);
+    SetEvent(start);
+    WaitForMultipleObjects(static_cast<DWORD>(threads.size()), &threads[0], TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    char label[64];
+    std::snprintf(label, sizeof(label), "%s, %d threads", name, static_cast<int>(threads.size()));
+    Report(label, Nanoseconds(begin, end), ReadAcquire(&allocations) - before,
+        static_cast<long long>(iterations / threadCount) * static_cast<long long>(threads.size()));
+
+    for (size_t t = 0; t < threads.size(); ++t) CloseHandle(threads[t]);
+    CloseHandle(start);
+}
+
+// The narrow and wide pairs print the same text, so the difference is the conversion
+void WideInt(int i) { Debug() << L"Value: " << i; }
+void NarrowInt(int i) { Debug() << "Value: " << i; }
+void AsciiNarrow(int i) { Debug() << "Gruss Gott " << i; }
+void Utf8Narrow(int i) { Debug() << "Gr\xC3\xBC\xC3\x9F Gott " << i; }
+void WideFloat(int i) { Debug() << L"Ratio: " << i * 0.001 << L' ' << static_cast<float>(i) * 0.5f; }
+void Manipulators(int i) {
+    Debug() << std::hex << std::setw(8) << std::setfill(L'0') << i << std::dec << L' '
+            << std::fixed << std::setprecision(3) << i * 0.25 << L' ' << std::showpos << i;
+}
+void AutoFlush(int i) { DebugStream() << L"Value: " << i; }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    if (iterations <= 0) {
+        std::fprintf(stderr, "Usage: DebugBench [iterations]\n");
+        return 1;
+    }
+
+    DebugNullSink nullSink;
+    DebugAddSink(&nullSink);
+    DebugRemoveSink(&DebugDefaultSink());
+
+    std::printf("DebugNullSink\n");
+    Measure("wide + int", WideInt, iterations);
+    Measure("narrow + int", NarrowInt, iterations);
+    Measure("ascii narrow", AsciiNarrow, iterations);
+    Measure("utf-8 narrow", Utf8Narrow, iterations);
+    Measure("double + float", WideFloat, iterations);
+    Measure("manipulators", Manipulators, iterations);
+    Measure("auto-flush", AutoFlush, iterations);
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    int threadCount = systemInfo.dwNumberOfProcessors < 8 ? static_cast<int>(systemInfo.dwNumberOfProcessors) : 8;
+    if (threadCount < 2) threadCount = 2;
+    MeasureContended("wide + int", WideInt, iterations, threadCount);
+
+    // OutputDebugStringW costs far more than formatting, so fewer iterations are enough
+    DebugAddSink(&DebugDefaultSink());
+    DebugRemoveSink(&nullSink);
+    std::printf("\nDefault sink (OutputDebugStringW%s)\n", IsDebuggerPresent() ? ", debugger attached" : "");
+    Measure("wide + int", WideInt, iterations / 10 > 0 ? iterations / 10 : 1);
+    Measure("narrow + int", NarrowInt, iterations / 10 > 0 ? iterations / 10 : 1);
+    return 0;
+}
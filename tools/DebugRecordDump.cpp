@@ -0,0 +1,220 @@
+//------------------------------------------------------------------------------
+// DebugRecordDump.cpp
+//------------------------------------------------------------------------------
+/**
+ * @file DebugRecordDump.cpp
+ * @brief Console decoder for the files written by DebugFileSink with DebugFileRecords
+ *
+ * Prints every record with its fields and, for DebugDeferred() statements, its format
+ * string and arguments, decoded from their binary form with DebugReadRecordFrame(),
+ * DebugReadField() and DebugReadArgument(). Files are read in the order given, so a
+ * rolled-over log is dumped with app.log app.log.1 app.log.2 ...
+ *
+ * Usage:
+ * @code
+ *     DebugRecordDump app.log app.log.1               Every record
+ *     DebugRecordDump -k request app.log              Only records with a "request" field
+ * @endcode
+ *
+ * Build:
+ * @code
+ *     cl /EHsc /O2 DebugRecordDump.cpp
+ * @endcode
+ */
+
+#include "../DebugUtil.h"
+#include <io.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cwchar>
+
+namespace {
+
+// Values are stored at the width of the writing process, so integers are read by their size
+bool ReadSigned(const DebugField& field, long long& value) {
+    switch (field.size) {
+    case 1: { signed char v; memcpy(&v, field.value, 1); value = v; return true; }
+    case 2: { short v; memcpy(&v, field.value, 2); value = v; return true; }
+    case 4: { int v; memcpy(&v, field.value, 4); value = v; return true; }
+    case 8: { long long v; memcpy(&v, field.value, 8); value = v; return true; }
+    default: return false;
+    }
+}
+
+bool ReadUnsigned(const DebugField& field, unsigned long long& value) {
+    switch (field.size) {
+    case 1: { unsigned char v; memcpy(&v, field.value, 1); value = v; return true; }
+    case 2: { unsigned short v; memcpy(&v, field.value, 2); value = v; return true; }
+    case 4: { unsigned int v; memcpy(&v, field.value, 4); value = v; return true; }
+    case 8: { unsigned long long v; memcpy(&v, field.value, 8); value = v; return true; }
+    default: return false;
+    }
+}
+
+// Prints a field or argument value as "type value"
+void PrintValue(const DebugField& field) {
+    static const wchar_t* const typeNames[] = {
+        L"bool", L"char", L"wchar_t", L"signed char", L"unsigned char",
+        L"short", L"unsigned short", L"int", L"unsigned int", L"long", L"unsigned long",
+        L"long long", L"unsigned long long", L"float", L"double", L"long double",
+        L"pointer", L"string", L"wstring"
+    };
+    std::wprintf(L"%ls ", typeNames[field.type]);
+
+    long long signedValue;
+    unsigned long long unsignedValue;
+    switch (field.type) {
+    case DebugFieldBool:
+        std::wprintf(L"%ls", ReadUnsigned(field, unsignedValue) ? (unsignedValue ? L"true" : L"false") : L"?");
+        break;
+    case DebugFieldChar:
+    case DebugFieldSChar:
+    case DebugFieldUChar:
+        if (ReadUnsigned(field, unsignedValue)) std::wprintf(L"'%lc' (%llu)", static_cast<wchar_t>(unsignedValue), unsignedValue);
+        break;
+    case DebugFieldWChar:
+        if (ReadUnsigned(field, unsignedValue)) std::wprintf(L"'%lc'", static_cast<wchar_t>(unsignedValue));
+        break;
+    case DebugFieldShort:
+    case DebugFieldInt:
+    case DebugFieldLong:
+    case DebugFieldLongLong:
+        if (ReadSigned(field, signedValue)) std::wprintf(L"%lld", signedValue);
+        break;
+    case DebugFieldUShort:
+    case DebugFieldUInt:
+    case DebugFieldULong:
+    case DebugFieldULongLong:
+        if (ReadUnsigned(field, unsignedValue)) std::wprintf(L"%llu", unsignedValue);
+        break;
+    case DebugFieldFloat:
+    case DebugFieldDouble:
+    case DebugFieldLongDouble:
+        if (field.size == sizeof(float)) {
+            float v;
+            memcpy(&v, field.value, sizeof(v));
+            std::wprintf(L"%.9g", v);
+        } else if (field.size == sizeof(double)) {
+            double v;
+            memcpy(&v, field.value, sizeof(v));
+            std::wprintf(L"%.17g", v);
+        }
+        break;
+    case DebugFieldPointer:
+        if (ReadUnsigned(field, unsignedValue)) std::wprintf(L"0x%llX", unsignedValue);
+        break;
+    case DebugFieldNarrowString: {
+        // Narrow strings are decoded like DebugStream does, with DEBUG_CODE_PAGE
+        int length = MultiByteToWideChar(DEBUG_CODE_PAGE, 0, static_cast<const char*>(field.value), static_cast<int>(field.size), nullptr, 0);
+        std::wstring text(static_cast<size_t>(length), L'\0');
+        if (length > 0) {
+            MultiByteToWideChar(DEBUG_CODE_PAGE, 0, static_cast<const char*>(field.value), static_cast<int>(field.size), &text[0], length);
+        }
+        std::wprintf(L"\"%ls\"", text.c_str());
+        break;
+    }
+    case DebugFieldWideString: {
+        std::wstring text(static_cast<const wchar_t*>(field.value), field.size / sizeof(wchar_t));
+        std::wprintf(L"\"%ls\"", text.c_str());
+        break;
+    }
+    }
+    std::fputwc(L'\n', stdout);
+}
+
+bool HasField(const DebugRecord& record, const wchar_t* key) {
+    size_t keyLength = std::wcslen(key);
+    size_t offset = 0;
+    DebugField field;
+    while (DebugReadField(record.fields, record.fieldsSize, offset, field)) {
+        if (field.keyLength == keyLength && std::wmemcmp(field.key, key, keyLength) == 0) return true;
+    }
+    return false;
+}
+
+void PrintRecord(const DebugRecord& record) {
+    size_t length = record.length;
+    if (length != 0 && record.text[length - 1] == L'\n') --length;
+    std::wprintf(L"%.*ls\n", static_cast<int>(length), record.text);
+
+    size_t offset = 0;
+    DebugField field;
+    while (DebugReadField(record.fields, record.fieldsSize, offset, field)) {
+        std::wprintf(L"    %.*ls: ", static_cast<int>(field.keyLength), field.key);
+        PrintValue(field);
+    }
+
+    if (record.format) std::wprintf(L"    format: \"%ls\"\n", record.format);
+    offset = 0;
+    for (int index = 0; DebugReadArgument(record.arguments, record.argumentsSize, offset, field); ++index) {
+        std::wprintf(L"    {%d}: ", index);
+        PrintValue(field);
+    }
+}
+
+// Prints the records of one file; returns false if it cannot be read
+bool Dump(const wchar_t* path, const wchar_t* key) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::fwprintf(stderr, L"Cannot open %ls\n", path);
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = nullptr;
+    const char* view = nullptr;
+    size_t size = 0;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+        size = static_cast<size_t>(fileSize.QuadPart);
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+
+    const size_t headerSize = sizeof(DEBUG_RECORD_FILE_SIGNATURE);
+    bool ok = view && size >= headerSize && memcmp(view, DEBUG_RECORD_FILE_SIGNATURE, headerSize) == 0;
+    if (!ok) {
+        std::fwprintf(stderr, L"%ls is not a DebugFileRecords file\n", path);
+    } else {
+        size_t offset = 0;
+        DebugRecord record;
+        while (DebugReadRecordFrame(view, size, offset, record)) {
+            if (!key || HasField(record, key)) PrintRecord(record);
+        }
+
+        // Zeros after the last record are the unused end of a file that was not closed
+        if (offset == 0) offset = headerSize;
+        unsigned int frameSize = 0;
+        if (offset < size) memcpy(&frameSize, view + offset, size - offset < sizeof(frameSize) ? size - offset : sizeof(frameSize));
+        if (frameSize != 0) {
+            std::fwprintf(stderr, L"%ls: malformed record at offset %llu\n", path, static_cast<unsigned long long>(offset));
+        }
+    }
+
+    if (view) UnmapViewOfFile(view);
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    return ok;
+}
+
+} // namespace
+
+int wmain(int argc, wchar_t* argv[]) {
+    _setmode(_fileno(stdout), _O_U16TEXT);
+
+    const wchar_t* key = nullptr;
+    int files = 0;
+    int failed = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::wcscmp(argv[i], L"-k") == 0 && i + 1 < argc) {
+            key = argv[++i];
+        } else {
+            ++files;
+            if (!Dump(argv[i], key)) ++failed;
+        }
+    }
+    if (files == 0) {
+        std::fwprintf(stderr, L"Usage: DebugRecordDump [-k key] file...\n");
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+//------------------------------------------------------------------------------
+// DebugRingViewer.cpp
+//------------------------------------------------------------------------------
+/**
+ * @file DebugRingViewer.cpp
+ * @brief Console viewer for the shared-memory rings written by DebugSharedRingSink
+ *
+ * Tails any number of rings at once and prints each record prefixed with the ID of the
+ * process that wrote it. Unlike DebugView, which reads the single system-wide DBWIN
+ * buffer, the viewer never makes a writer wait, so it cannot slow down the processes it
+ * watches; if it falls behind, it reports how many bytes were overwritten instead.
+ *
+ * Usage:
+ * @code
+ *     DebugRingViewer                         Every process in this session, including new ones
+ *     DebugRingViewer 1234 5678               The rings of the given process IDs
+ *     DebugRingViewer -n Global\MyServiceRing A ring created with a custom name
+ * @endcode
+ *
+ * Build:
+ * @code
+ *     cl /EHsc /O2 DebugRingViewer.cpp
+ * @endcode
+ */
+
+#include "../DebugUtil.h"
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cwchar>
+#include <vector>
+
+#pragma comment(lib, "psapi.lib")
+
+namespace {
+
+// Prints each record on its own line, after the ID of the process that wrote it
+class ConsoleWriter : public DebugSink {
+public:
+    explicit ConsoleWriter(DWORD writerId) : processId(writerId) {}
+
+    virtual void Write(const DebugRecord& record) {
+        std::wprintf(L"[%5lu] %ls", processId, record.text);
+        if (record.length == 0 || record.text[record.length - 1] != L'\n') std::fputwc(L'\n', stdout);
+    }
+
+    DWORD processId;
+};
+
+struct WatchedRing {
+    DebugSharedRingReader* reader;
+    DWORD processId;
+    HANDLE process;                     // Waited on to notice the writer exiting, or nullptr
+    unsigned long long reportedLost;
+};
+
+// Starts watching a ring; returns false if it does not exist
+bool Watch(std::vector<WatchedRing>& rings, const wchar_t* name) {
+    DebugSharedRingReader* reader;
+    try {
+        reader = new DebugSharedRingReader(name);
+    } catch (const std::exception&) {
+        return false;
+    }
+
+    WatchedRing ring;
+    ring.reader = reader;
+    ring.processId = reader->ProcessId();
+    ring.process = OpenProcess(SYNCHRONIZE, FALSE, ring.processId);
+    ring.reportedLost = 0;
+    rings.push_back(ring);
+    std::wprintf(L"[%5lu] --- watching %ls\n", ring.processId, name);
+    return true;
+}
+
+bool IsWatched(const std::vector<WatchedRing>& rings, DWORD processId) {
+    for (size_t i = 0; i < rings.size(); ++i) {
+        if (rings[i].processId == processId) return true;
+    }
+    return false;
+}
+
+// Looks for rings of processes that are not watched yet
+void Discover(std::vector<WatchedRing>& rings) {
+    std::vector<DWORD> processIds(4096);
+    DWORD bytes = 0;
+    if (!EnumProcesses(&processIds[0], static_cast<DWORD>(processIds.size() * sizeof(DWORD)), &bytes)) return;
+
+    for (size_t i = 0; i < bytes / sizeof(DWORD); ++i) {
+        if (processIds[i] != 0 && !IsWatched(rings, processIds[i])) {
+            Watch(rings, DebugSharedRingName(processIds[i]).c_str());
+        }
+    }
+}
+
+// Prints what a ring has gathered; returns the number of records
+size_t Drain(WatchedRing& ring) {
+    ConsoleWriter writer(ring.processId);
+    size_t count = ring.reader->Read(writer);
+    unsigned long long lost = ring.reader->LostBytes();
+    if (lost != ring.reportedLost) {
+        std::wprintf(L"[%5lu] --- %llu bytes lost\n", ring.processId, lost - ring.reportedLost);
+        ring.reportedLost = lost;
+    }
+    return count;
+}
+
+} // namespace
+
+int wmain(int argc, wchar_t* argv[]) {
+    _setmode(_fileno(stdout), _O_U16TEXT);
+
+    std::vector<WatchedRing> rings;
+    bool discover = argc == 1;
+    for (int i = 1; i < argc; ++i) {
+        if (std::wcscmp(argv[i], L"-n") == 0 && i + 1 < argc) {
+            ++i;
+            if (!Watch(rings, argv[i])) std::fwprintf(stderr, L"No ring named %ls\n", argv[i]);
+        } else {
+            DWORD processId = static_cast<DWORD>(std::wcstoul(argv[i], nullptr, 10));
+            if (!Watch(rings, DebugSharedRingName(processId).c_str())) std::fwprintf(stderr, L"No ring for process %ls\n", argv[i]);
+        }
+    }
+    if (!discover && rings.empty()) return 1;
+
+    ULONGLONG nextDiscovery = 0;
+    for (;;) {
+        if (discover && GetTickCount64() >= nextDiscovery) {
+            Discover(rings);
+            nextDiscovery = GetTickCount64() + 500;
+        }
+
+        size_t count = 0;
+        for (size_t i = 0; i < rings.size();) {
+            count += Drain(rings[i]);
+
+            // Once the writer has exited, print what is left and let the ring go
+            if (rings[i].process && WaitForSingleObject(rings[i].process, 0) == WAIT_OBJECT_0) {
+                Drain(rings[i]);
+                std::wprintf(L"[%5lu] --- exited\n", rings[i].processId);
+                CloseHandle(rings[i].process);
+                delete rings[i].reader;
+                rings.erase(rings.begin() + static_cast<std::ptrdiff_t>(i));
+                continue;
+            }
+            ++i;
+        }
+
+        if (!discover && rings.empty()) return 0;
+        std::fflush(stdout);
+        if (count == 0) Sleep(10);
+    }
+}
@@ -0,0 +1,80 @@
+//------------------------------------------------------------------------------
+// ReleaseSentinels.cpp
+//------------------------------------------------------------------------------
+/**
+ * @file ReleaseSentinels.cpp
+ * @brief Checks that release builds leave nothing of the logging macros in the binary
+ *
+ * Every release macro is used with string literals that end in _Sentinel, narrow
+ * and wide, and with a call to a function that is declared but never defined. In a
+ * release build none of the literals may appear in the executable, and it must link,
+ * since a call that was generated would need the missing function. The Control
+ * literals are printed, so their presence shows that the search itself works.
+ *
+ * CheckReleaseSentinels.ps1 builds this file at /Od and /O2, as C++14 (where the
+ * macros fall back to if (true) {} else) and as C++17 (if constexpr), and searches
+ * each executable.
+ *
+ * Build:
+ * @code
+ *     cl /EHsc /O2 /std:c++14 ReleaseSentinels.cpp
+ * @endcode
+ */
+
+#ifdef _DEBUG
+#error ReleaseSentinels.cpp checks release builds; build it without _DEBUG
+#endif
+
+#include "../DebugUtil.h"
+#include <cstdio>
+#include <string>
+
+DEBUG_DECLARE_CATEGORY(SentinelCategory, DEBUG_LEVEL_DEBUG);
+
+// Declared only: the program fails to link if a release macro calls it
+std::wstring Describe_Sentinel(int value);
+
+int main(int argc, char* argv[]) {
+    (void)argv;
+    int value = argc;
+
+    DBG << L"DBG_Wide_Sentinel" << "DBG_Narrow_Sentinel" << value << Describe_Sentinel(value);
+    DBG.With(L"DBG_WithKey_Sentinel", "DBG_WithValue_Sentinel") << L"DBG_With_Sentinel";
+
+    DEBUG_LOG_DEBUG << L"DEBUG_LOG_DEBUG_Wide_Sentinel" << "DEBUG_LOG_DEBUG_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_INFO << L"DEBUG_LOG_INFO_Wide_Sentinel" << "DEBUG_LOG_INFO_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_WARN << L"DEBUG_LOG_WARN_Wide_Sentinel" << "DEBUG_LOG_WARN_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_ERROR << L"DEBUG_LOG_ERROR_Wide_Sentinel" << "DEBUG_LOG_ERROR_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_AT(DEBUG_LEVEL_ERROR) << L"DEBUG_LOG_AT_Wide_Sentinel" << "DEBUG_LOG_AT_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_CAT(SentinelCategory, DEBUG_LEVEL_ERROR) << L"DEBUG_LOG_CAT_Wide_Sentinel" << "DEBUG_LOG_CAT_Narrow_Sentinel" << Describe_Sentinel(value);
+
+#if defined(DEBUG_HAS_VARIADIC_TEMPLATES)
+    DEBUG_LOG(L"DEBUG_LOG_Format_Sentinel {} {}", value, Describe_Sentinel(value));
+    DEBUG_LOG_WARN.Format(L"DEBUG_LOG_WARN_Format_Sentinel {} {}", "DEBUG_LOG_WARN_FormatArg_Sentinel", value);
+    DEBUG_LOG_ERROR.With(L"DEBUG_LOG_ERROR_WithKey_Sentinel", Describe_Sentinel(value)) << L"DEBUG_LOG_ERROR_With_Sentinel";
+#endif
+
+#if defined(DEBUG_HAS_LAMBDAS)
+    DEBUG_LOG_EVERY_N(DEBUG_LEVEL_INFO, 10) << L"DEBUG_LOG_EVERY_N_Wide_Sentinel" << "DEBUG_LOG_EVERY_N_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_FIRST_N(DEBUG_LEVEL_INFO, 10) << L"DEBUG_LOG_FIRST_N_Wide_Sentinel" << "DEBUG_LOG_FIRST_N_Narrow_Sentinel" << Describe_Sentinel(value);
+    DEBUG_LOG_EVERY_MS(DEBUG_LEVEL_INFO, 100) << L"DEBUG_LOG_EVERY_MS_Wide_Sentinel" << "DEBUG_LOG_EVERY_MS_Narrow_Sentinel" << Describe_Sentinel(value);
+    DebugEveryN(10) << L"DebugEveryN_Wide_Sentinel" << "DebugEveryN_Narrow_Sentinel" << Describe_Sentinel(value);
+    DebugFirstN(10) << L"DebugFirstN_Wide_Sentinel" << "DebugFirstN_Narrow_Sentinel" << Describe_Sentinel(value);
+    DebugEveryMs(100) << L"DebugEveryMs_Wide_Sentinel" << "DebugEveryMs_Narrow_Sentinel" << Describe_Sentinel(value);
+#endif
+
+    DEBUG_LOG_SAMPLED(DEBUG_LEVEL_INFO, 1, 100) << L"DEBUG_LOG_SAMPLED_Wide_Sentinel" << "DEBUG_LOG_SAMPLED_Narrow_Sentinel" << Describe_Sentinel(value);
+    DebugSampled(1, 100) << L"DebugSampled_Wide_Sentinel" << "DebugSampled_Narrow_Sentinel" << Describe_Sentinel(value);
+#if defined(DEBUG_LOG_SAMPLED_EVERY)
+    DEBUG_LOG_SAMPLED_EVERY(DEBUG_LEVEL_INFO, 100) << L"DEBUG_LOG_SAMPLED_EVERY_Wide_Sentinel" << "DEBUG_LOG_SAMPLED_EVERY_Narrow_Sentinel" << Describe_Sentinel(value);
+    DebugSampledEvery(100) << L"DebugSampledEvery_Wide_Sentinel" << "DebugSampledEvery_Narrow_Sentinel" << Describe_Sentinel(value);
+#endif
+
+    // A braceless if/else around a macro must still pair the else with the outer if
+    if (value > 100)
+        DBG << L"DBG_Dangling_Sentinel";
+    else
+        std::printf("%s\n", "Narrow_Control");
+    std::printf("%ls\n", L"Wide_Control");
+    return 0;
+}